@@ -35,7 +35,7 @@ struct AppItemView: View {
                 Label("Save", systemImage: saved ? "star.fill" : "star")
                     .foregroundColor(.accentColor)
             }
-            IconView(data: app.icon)
+            IconView(app: app)
             Text(app.bundleName)
             Spacer()
         }.buttonStyle(PlainButtonStyle())
@@ -43,32 +43,29 @@ struct AppItemView: View {
 }
 
 struct IconView: View {
-    let data: Data
+    let app: JBApp
+    @State private var image: CGImage?
     
     var body: some View {
-        #if canImport(UIKit)
-        if let icon = UIImage(data: data) {
-            Image(uiImage: icon)
-                .resizable()
-                .frame(width: 32, height: 32)
-                .aspectRatio(contentMode: .fit)
-        } else {
-            EmptyView()
-                .frame(width: 32, height: 32)
-        }
-        #elseif canImport(AppKit)
-        if let icon = NSImage(data: data) {
-            Image(nsImage: icon)
-                .resizable()
-                .frame(width: 32, height: 32)
-                .aspectRatio(contentMode: .fit)
-        } else {
-            EmptyView()
-                .frame(width: 32, height: 32)
+        Group {
+            if let icon = image {
+                Image(decorative: icon, scale: 1)
+                    .resizable()
+                    .frame(width: 32, height: 32)
+                    .aspectRatio(contentMode: .fit)
+            } else {
+                Color.clear
+                    .frame(width: 32, height: 32)
+            }
+        }.onAppear {
+            if let icon = app.icon {
+                image = icon
+            } else {
+                app.loadIcon { icon in
+                    image = icon
+                }
+            }
         }
-        #else
-        #error("Cannot import UIKit or AppKit")
-        #endif
     }
 }
 
@@ -183,8 +183,10 @@ struct DeviceDetailsView: View {
     }
     
     private func resetConnection(onComplete: @escaping () -> Void) {
-        main.backgroundTask(message: NSLocalizedString("Disconnecting...", comment: "DeviceDetailsView")) {
-            host.stopLockdown()
+        main.deviceTask(message: NSLocalizedString("Disconnecting...", comment: "DeviceDetailsView")) { done in
+            host.stopLockdown {
+                done(nil)
+            }
         } onComplete: {
             onComplete()
         }
@@ -192,11 +194,18 @@ struct DeviceDetailsView: View {
     
     private func loadPairing(for selected: URL) {
         var success = false
-        main.backgroundTask(message: NSLocalizedString("Loading pairing data...", comment: "DeviceDetailsView")) {
+        main.deviceTask(message: NSLocalizedString("Loading pairing data...", comment: "DeviceDetailsView")) { done in
             main.savePairing(nil, forHostIdentifier: host.identifier)
-            try host.startLockdown(withPairingUrl: selected)
-            try host.updateInfo()
-            success = true
+            host.startLockdown(withPairingUrl: selected, udid: main.pairingUdid(selected)) { error in
+                guard error == nil else {
+                    done(error)
+                    return
+                }
+                host.updateInfo { error in
+                    success = error == nil
+                    done(error)
+                }
+            }
         } onComplete: {
             selectedPairing = nil
             if success {
@@ -209,12 +218,30 @@ struct DeviceDetailsView: View {
     
     private func refreshAppsList(onSuccess: @escaping () -> Void) {
         var autoLaunchApp: JBApp?
-        main.backgroundTask(message: NSLocalizedString("Querying installed apps...", comment: "DeviceDetailsView")) {
-            try host.updateInfo()
-            apps = try host.installedApps()
-            main.archiveSavedHosts()
-            autoLaunchApp = try main.processAutoLaunch(withApps: apps)
-            onSuccess()
+        main.deviceTask(message: NSLocalizedString("Querying installed apps...", comment: "DeviceDetailsView")) { done in
+            host.updateInfo { error in
+                guard error == nil else {
+                    done(error)
+                    return
+                }
+                host.installedApps { result, error in
+                    guard let result = result else {
+                        done(error)
+                        return
+                    }
+                    DispatchQueue.main.async {
+                        apps = result
+                        main.archiveSavedHosts()
+                        do {
+                            autoLaunchApp = try main.processAutoLaunch(withApps: result)
+                            onSuccess()
+                            done(nil)
+                        } catch {
+                            done(error)
+                        }
+                    }
+                }
+            }
         } onComplete: {
             if let app = autoLaunchApp {
                 launchApplication(app)
@@ -223,10 +250,19 @@ struct DeviceDetailsView: View {
     }
     
     private func mountImage(_ supportImage: URL, signature supportImageSignature: URL) {
-        main.backgroundTask(message: NSLocalizedString("Mounting disk image...", comment: "DeviceDetailsView")) {
+        main.deviceTask(message: NSLocalizedString("Mounting disk image...", comment: "DeviceDetailsView")) { done in
             main.saveDiskImage(nil, signature: nil, forHostIdentifier: host.identifier)
-            try host.mountImage(for: supportImage, signatureUrl: supportImageSignature)
-            main.saveDiskImage(supportImage, signature: supportImageSignature, forHostIdentifier: host.identifier)
+            let onMounted: (Error?) -> Void = { error in
+                if error == nil {
+                    main.saveDiskImage(supportImage, signature: supportImageSignature, forHostIdentifier: host.identifier)
+                }
+                done(error)
+            }
+            if let signature = main.supportImageSignature(supportImageSignature) {
+                host.mountImage(for: supportImage, signature: signature, completion: onMounted)
+            } else {
+                host.mountImage(for: supportImage, signatureUrl: supportImageSignature, completion: onMounted)
+            }
         } onComplete: {
             selectedSupportImage = nil
             selectedSupportImageSignature = nil
@@ -239,15 +275,13 @@ struct DeviceDetailsView: View {
     
     private func launchApplication(_ app: JBApp) {
         var imageNotMounted = false
-        main.backgroundTask(message: NSLocalizedString("Launching...", comment: "DeviceDetailsView")) {
-            do {
-                try host.launchApplication(app)
-            } catch {
-                let code = (error as NSError).code
-                if code == kJBHostImageNotMounted {
+        main.deviceTask(message: NSLocalizedString("Launching...", comment: "DeviceDetailsView")) { done in
+            host.launchApplication(app) { error in
+                if let error = error, (error as NSError).code == kJBHostImageNotMounted {
                     imageNotMounted = true
+                    done(nil)
                 } else {
-                    throw error
+                    done(error)
                 }
             }
         } onComplete: {
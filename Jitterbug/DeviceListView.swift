@@ -113,11 +113,23 @@ struct ContextMenuViewModifier: ViewModifier {
                 main.savePairing(nil, forHostIdentifier: host.identifier)
                 main.saveDiskImage(nil, signature: nil, forHostIdentifier: host.identifier)
                 #if os(macOS)
-                main.backgroundTask(message: NSLocalizedString("Unpairing...", comment: "DeviceListView")) {
-                    if !host.isConnected {
-                        try host.startLockdown()
+                main.deviceTask(message: NSLocalizedString("Unpairing...", comment: "DeviceListView")) { done in
+                    let resetPairing = {
+                        host.resetPairing { error in
+                            done(error)
+                        }
+                    }
+                    if host.isConnected {
+                        resetPairing()
+                    } else {
+                        host.startLockdown { error in
+                            guard error == nil else {
+                                done(error)
+                                return
+                            }
+                            resetPairing()
+                        }
                     }
-                    try host.resetPairing()
                 }
                 #endif
             } label: {
@@ -0,0 +1,827 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/event.h>
+#define HAVE_KQUEUE 1
+#endif
+#include "DirectoryIndex.h"
+#include "Jitterbug.h"
+
+#if defined(__APPLE__)
+#define ST_MTIM st_mtimespec
+#else
+#define ST_MTIM st_mtim
+#endif
+
+#ifndef O_EVTONLY
+#define O_EVTONLY O_RDONLY
+#endif
+
+/**
+ * Journal records are in native byte order, the file is a cache that is
+ * thrown away if it does not parse.
+ */
+#define JOURNAL_MAGIC "JBDIDX1\n"
+#define JOURNAL_PUT '+'
+#define JOURNAL_REMOVE '-'
+#define MIN_CAPACITY 64
+
+typedef struct {
+    char *name;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    size_t meta_count;
+    char **meta; // key, value, key, value, ...
+    unsigned int seen;
+} index_entry_t;
+
+struct directory_index {
+    char *directory;
+    char *index_path;
+    directory_index_parse_cb_t parse;
+    void *ctx;
+
+    // written by the reconciling thread while holding `lock`, read anywhere while holding it
+    pthread_mutex_t lock;
+    index_entry_t **slots;
+    size_t capacity;
+    size_t count;
+    const char **sorted;
+    size_t sorted_count;
+    int sorted_valid;
+
+    // only used by the reconciling thread
+    index_entry_t *parsing;
+    unsigned int generation;
+    FILE *journal;
+    size_t journal_records;
+    int needs_compact;
+    int watch_fd;
+    int watch;
+};
+
+// MARK: - Entries
+
+static uint64_t hash_name(const char *name)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void entry_free(index_entry_t *entry)
+{
+    if (!entry) {
+        return;
+    }
+    for (size_t i = 0; i < entry->meta_count * 2; i++) {
+        free(entry->meta[i]);
+    }
+    free(entry->meta);
+    free(entry->name);
+    free(entry);
+}
+
+static int entry_same(const index_entry_t *a, const index_entry_t *b)
+{
+    if (a->mtime_sec != b->mtime_sec || a->mtime_nsec != b->mtime_nsec || a->size != b->size || a->meta_count != b->meta_count) {
+        return 0;
+    }
+    for (size_t i = 0; i < a->meta_count * 2; i++) {
+        if (strcmp(a->meta[i], b->meta[i]) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static const char *entry_value(const index_entry_t *entry, const char *key)
+{
+    for (size_t i = 0; i < entry->meta_count; i++) {
+        if (strcmp(entry->meta[i * 2], key) == 0) {
+            return entry->meta[i * 2 + 1];
+        }
+    }
+    return NULL;
+}
+
+static int entry_add_value(index_entry_t *entry, const char *key, const char *value)
+{
+    char **meta = realloc(entry->meta, sizeof(char *) * (entry->meta_count + 1) * 2);
+    char *key_copy = strdup(key);
+    char *value_copy = strdup(value);
+
+    if (meta) {
+        entry->meta = meta;
+    }
+    if (!meta || !key_copy || !value_copy) {
+        free(key_copy);
+        free(value_copy);
+        return 0;
+    }
+    meta[entry->meta_count * 2] = key_copy;
+    meta[entry->meta_count * 2 + 1] = value_copy;
+    entry->meta_count++;
+    return 1;
+}
+
+// MARK: - Table
+
+/** Open addressing with linear probing, removal shifts the run back so there are no tombstones. */
+static size_t table_find(directory_index_t index, const char *name)
+{
+    size_t mask = index->capacity - 1;
+    size_t i = (size_t)hash_name(name) & mask;
+
+    while (index->slots[i] && strcmp(index->slots[i]->name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static index_entry_t *table_get(directory_index_t index, const char *name)
+{
+    return index->slots[table_find(index, name)];
+}
+
+static int table_grow(directory_index_t index)
+{
+    size_t capacity = index->capacity * 2;
+    index_entry_t **old = index->slots;
+    size_t old_capacity = index->capacity;
+    index_entry_t **slots = calloc(capacity, sizeof(index_entry_t *));
+
+    if (!slots) {
+        return 0;
+    }
+    index->slots = slots;
+    index->capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i]) {
+            slots[table_find(index, old[i]->name)] = old[i];
+        }
+    }
+    free(old);
+    return 1;
+}
+
+/** Call with `lock` held. Replaces and frees an entry with the same name. */
+static int table_put(directory_index_t index, index_entry_t *entry)
+{
+    size_t i;
+
+    if ((index->count + 1) * 4 > index->capacity * 3 && !table_grow(index)) {
+        return 0;
+    }
+    i = table_find(index, entry->name);
+    if (index->slots[i]) {
+        entry_free(index->slots[i]);
+    } else {
+        index->count++;
+    }
+    index->slots[i] = entry;
+    index->sorted_valid = 0; // it points at the names of the entries
+    return 1;
+}
+
+/** Call with `lock` held. */
+static void table_remove(directory_index_t index, const char *name)
+{
+    size_t mask = index->capacity - 1;
+    size_t i = table_find(index, name);
+    size_t j = i;
+
+    if (!index->slots[i]) {
+        return;
+    }
+    entry_free(index->slots[i]);
+    index->slots[i] = NULL;
+    index->count--;
+    index->sorted_valid = 0;
+    for (;;) {
+        size_t home;
+        j = (j + 1) & mask;
+        if (!index->slots[j]) {
+            break;
+        }
+        home = (size_t)hash_name(index->slots[j]->name) & mask;
+        // move the entry back if its home is not in (i, j]
+        if ((i < j) ? (home <= i || home > j) : (home <= i && home > j)) {
+            index->slots[i] = index->slots[j];
+            index->slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+// MARK: - Journal
+
+static void journal_write(FILE *journal, const void *data, size_t length)
+{
+    fwrite(data, 1, length, journal);
+}
+
+static void journal_write_string(FILE *journal, const char *string)
+{
+    uint32_t length = (uint32_t)strlen(string);
+
+    journal_write(journal, &length, sizeof(length));
+    journal_write(journal, string, length);
+}
+
+static void journal_write_put(FILE *journal, const index_entry_t *entry)
+{
+    uint32_t meta_count = (uint32_t)entry->meta_count;
+
+    fputc(JOURNAL_PUT, journal);
+    journal_write_string(journal, entry->name);
+    journal_write(journal, &entry->mtime_sec, sizeof(entry->mtime_sec));
+    journal_write(journal, &entry->mtime_nsec, sizeof(entry->mtime_nsec));
+    journal_write(journal, &entry->size, sizeof(entry->size));
+    journal_write(journal, &meta_count, sizeof(meta_count));
+    for (size_t i = 0; i < entry->meta_count * 2; i++) {
+        journal_write_string(journal, entry->meta[i]);
+    }
+}
+
+static void journal_write_remove(FILE *journal, const char *name)
+{
+    fputc(JOURNAL_REMOVE, journal);
+    journal_write_string(journal, name);
+}
+
+/** Opens the journal for appending unless it has to be rewritten anyway. */
+static FILE *journal_open(directory_index_t index)
+{
+    if (index->needs_compact) {
+        return NULL;
+    }
+    if (!index->journal && !(index->journal = fopen(index->index_path, "ab"))) {
+        index->needs_compact = 1;
+    }
+    return index->journal;
+}
+
+static void journal_put(directory_index_t index, const index_entry_t *entry)
+{
+    FILE *journal = journal_open(index);
+
+    if (journal) {
+        journal_write_put(journal, entry);
+        index->journal_records++;
+    }
+}
+
+static void journal_remove(directory_index_t index, const char *name)
+{
+    FILE *journal = journal_open(index);
+
+    if (journal) {
+        journal_write_remove(journal, name);
+        index->journal_records++;
+    }
+}
+
+/** Writes every live entry to a new file that replaces the journal. */
+static int journal_compact(directory_index_t index)
+{
+    char path[PATH_MAX];
+    FILE *file;
+
+    if (index->journal) {
+        fclose(index->journal);
+        index->journal = NULL;
+    }
+    snprintf(path, sizeof(path), "%s.tmp", index->index_path);
+    if (!(file = fopen(path, "wb"))) {
+        DEBUG_PRINT("Error creating %s: %s", path, strerror(errno));
+        return 0;
+    }
+    journal_write(file, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC));
+    for (size_t i = 0; i < index->capacity; i++) {
+        if (index->slots[i]) {
+            journal_write_put(file, index->slots[i]);
+        }
+    }
+    if (fflush(file) != 0 || ferror(file)) {
+        DEBUG_PRINT("Error writing %s", path);
+        fclose(file);
+        unlink(path);
+        return 0;
+    }
+    if (rename(path, index->index_path) != 0) {
+        DEBUG_PRINT("Error replacing %s: %s", index->index_path, strerror(errno));
+        fclose(file);
+        unlink(path);
+        return 0;
+    }
+    index->journal = file;
+    index->journal_records = index->count;
+    index->needs_compact = 0;
+    return 1;
+}
+
+/** Makes the changes of one reconcile or batch of events durable. */
+static void journal_finish(directory_index_t index, int changed)
+{
+    if (index->needs_compact || (changed && index->journal_records > index->count * 2 + MIN_CAPACITY)) {
+        journal_compact(index);
+    } else if (index->journal && fflush(index->journal) != 0) {
+        index->needs_compact = 1;
+    }
+}
+
+static int read_bytes(const char **p, const char *end, void *out, size_t length)
+{
+    if ((size_t)(end - *p) < length) {
+        return 0;
+    }
+    memcpy(out, *p, length);
+    *p += length;
+    return 1;
+}
+
+static char *read_string(const char **p, const char *end)
+{
+    uint32_t length;
+    char *string;
+
+    if (!read_bytes(p, end, &length, sizeof(length)) || (size_t)(end - *p) < length) {
+        return NULL;
+    }
+    if ((string = malloc(length + 1))) {
+        memcpy(string, *p, length);
+        string[length] = '\0';
+    }
+    *p += length;
+    return string;
+}
+
+static index_entry_t *read_put(const char **p, const char *end)
+{
+    index_entry_t *entry = calloc(1, sizeof(index_entry_t));
+    uint32_t meta_count;
+
+    if (!entry || !(entry->name = read_string(p, end))) {
+        goto error;
+    }
+    if (!read_bytes(p, end, &entry->mtime_sec, sizeof(entry->mtime_sec)) ||
+        !read_bytes(p, end, &entry->mtime_nsec, sizeof(entry->mtime_nsec)) ||
+        !read_bytes(p, end, &entry->size, sizeof(entry->size)) ||
+        !read_bytes(p, end, &meta_count, sizeof(meta_count)) ||
+        meta_count > (size_t)(end - *p) / 8) {
+        goto error;
+    }
+    if (meta_count && !(entry->meta = calloc(meta_count * 2, sizeof(char *)))) {
+        goto error;
+    }
+    entry->meta_count = meta_count;
+    for (size_t i = 0; i < entry->meta_count * 2; i++) {
+        if (!(entry->meta[i] = read_string(p, end))) {
+            goto error;
+        }
+    }
+    return entry;
+error:
+    entry_free(entry);
+    return NULL;
+}
+
+/** Replays the journal. A torn record at the end is dropped and the journal is rewritten on the next save. */
+static void journal_load(directory_index_t index)
+{
+    FILE *file = fopen(index->index_path, "rb");
+    char *data = NULL;
+    const char *p, *end;
+    long length;
+
+    if (!file) {
+        index->needs_compact = 1;
+        return;
+    }
+    if (fseek(file, 0, SEEK_END) != 0 || (length = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0 ||
+        !(data = malloc(length ? length : 1)) || fread(data, 1, length, file) != (size_t)length) {
+        DEBUG_PRINT("Error reading %s", index->index_path);
+        index->needs_compact = 1;
+        goto done;
+    }
+    p = data;
+    end = data + length;
+    if ((size_t)length < strlen(JOURNAL_MAGIC) || memcmp(data, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) != 0) {
+        index->needs_compact = 1;
+        goto done;
+    }
+    p += strlen(JOURNAL_MAGIC);
+    while (p < end) {
+        char op = *p++;
+        if (op == JOURNAL_PUT) {
+            index_entry_t *entry = read_put(&p, end);
+            if (!entry || !table_put(index, entry)) {
+                entry_free(entry);
+                index->needs_compact = 1;
+                break;
+            }
+        } else if (op == JOURNAL_REMOVE) {
+            char *name = read_string(&p, end);
+            if (!name) {
+                index->needs_compact = 1;
+                break;
+            }
+            table_remove(index, name);
+            free(name);
+        } else {
+            index->needs_compact = 1;
+            break;
+        }
+        index->journal_records++;
+    }
+done:
+    free(data);
+    fclose(file);
+}
+
+// MARK: - Indexing
+
+static int make_path(directory_index_t index, const char *name, char path[static PATH_MAX])
+{
+    return snprintf(path, PATH_MAX, "%s/%s", index->directory, name) < PATH_MAX;
+}
+
+static void publish_put(directory_index_t index, index_entry_t *entry)
+{
+    pthread_mutex_lock(&index->lock);
+    if (!table_put(index, entry)) {
+        pthread_mutex_unlock(&index->lock);
+        entry_free(entry);
+        return;
+    }
+    pthread_mutex_unlock(&index->lock);
+    journal_put(index, entry);
+}
+
+static void publish_remove(directory_index_t index, const char *name)
+{
+    journal_remove(index, name);
+    pthread_mutex_lock(&index->lock);
+    table_remove(index, name);
+    pthread_mutex_unlock(&index->lock);
+}
+
+/**
+ * Stats one file and parses it if it is new, changed or `forced`. Returns 1
+ * if the index changed.
+ */
+static int index_file(directory_index_t index, const char *name, int forced)
+{
+    char path[PATH_MAX];
+    index_entry_t *existing = table_get(index, name);
+    index_entry_t *entry;
+    struct stat st;
+
+    if (!make_path(index, name, path)) {
+        return 0;
+    }
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (existing) {
+            publish_remove(index, name);
+            return 1;
+        }
+        return 0;
+    }
+    if (existing) {
+        existing->seen = index->generation;
+        if (!forced && existing->mtime_sec == st.ST_MTIM.tv_sec && existing->mtime_nsec == st.ST_MTIM.tv_nsec && existing->size == (uint64_t)st.st_size) {
+            return 0;
+        }
+    }
+    if (!(entry = calloc(1, sizeof(index_entry_t))) || !(entry->name = strdup(name))) {
+        free(entry);
+        return 0;
+    }
+    entry->mtime_sec = st.ST_MTIM.tv_sec;
+    entry->mtime_nsec = st.ST_MTIM.tv_nsec;
+    entry->size = st.st_size;
+    entry->seen = index->generation;
+    index->parsing = entry;
+    index->parse(index, path, index->ctx);
+    index->parsing = NULL;
+    if (existing && entry_same(existing, entry)) {
+        entry_free(entry);
+        return 0;
+    }
+    publish_put(index, entry);
+    return 1;
+}
+
+static int is_replaced(const char *name, const char *const *replaced, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(replaced[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// MARK: - Watching
+
+static void watch_start(directory_index_t index)
+{
+    if (index->watch_fd < 0 || index->watch >= 0) {
+        return;
+    }
+#if defined(__linux__)
+    index->watch = inotify_add_watch(index->watch_fd, index->directory,
+                                     IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                     IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+#elif defined(HAVE_KQUEUE)
+    struct kevent change;
+
+    // the directory may not exist until the first import, reconciling tries again
+    if ((index->watch = open(index->directory, O_EVTONLY | O_CLOEXEC)) < 0) {
+        return;
+    }
+    EV_SET(&change, index->watch, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE | NOTE_DELETE | NOTE_RENAME, 0, NULL);
+    if (kevent(index->watch_fd, &change, 1, NULL, 0, NULL) < 0) {
+        close(index->watch);
+        index->watch = -1;
+    }
+#endif
+}
+
+static void watch_stop(directory_index_t index)
+{
+    if (index->watch < 0) {
+        return;
+    }
+#if defined(__linux__)
+    inotify_rm_watch(index->watch_fd, index->watch);
+#elif defined(HAVE_KQUEUE)
+    close(index->watch);
+#endif
+    index->watch = -1;
+}
+
+int directoryIndexWatchDescriptor(directory_index_t index)
+{
+    return index->watch_fd;
+}
+
+int directoryIndexHandleEvents(directory_index_t index)
+{
+    int changed = 0;
+    int rescan = 0;
+
+    if (index->watch_fd < 0) {
+        return 0;
+    }
+#if defined(__linux__)
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+
+    while ((length = read(index->watch_fd, buf, sizeof(buf))) > 0) {
+        char *p = buf;
+        while (p < buf + length) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                rescan = 1;
+            } else if (event->wd != index->watch) {
+                continue; // a watch we already dropped
+            } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                // directory itself is gone, watch again once it is recreated
+                if (!(event->mask & IN_IGNORED)) {
+                    watch_stop(index);
+                }
+                index->watch = -1;
+                rescan = 1;
+            } else if (event->len > 0) {
+                changed |= index_file(index, event->name, 0);
+            }
+        }
+    }
+#elif defined(HAVE_KQUEUE)
+    struct kevent events[8];
+    struct timespec timeout = {0};
+    int count;
+
+    // kqueue does not say which files changed, so any event is a rescan
+    while ((count = kevent(index->watch_fd, NULL, 0, events, 8, &timeout)) > 0) {
+        for (int i = 0; i < count; i++) {
+            if (events[i].fflags & (NOTE_DELETE | NOTE_RENAME)) {
+                watch_stop(index);
+            }
+        }
+        rescan = 1;
+    }
+#endif
+    if (rescan) {
+        return directoryIndexReconcile(index, NULL, 0) > 0 || changed;
+    }
+    journal_finish(index, changed);
+    return changed;
+}
+
+// MARK: - Public
+
+directory_index_t directoryIndexNew(const char *directory, const char *index_path, directory_index_parse_cb_t parse, void *ctx)
+{
+    directory_index_t index = calloc(1, sizeof(struct directory_index));
+
+    if (!index) {
+        return NULL;
+    }
+    pthread_mutex_init(&index->lock, NULL);
+    index->watch_fd = -1;
+    index->watch = -1;
+    index->directory = strdup(directory);
+    index->index_path = strdup(index_path);
+    index->parse = parse;
+    index->ctx = ctx;
+    index->capacity = MIN_CAPACITY;
+    index->slots = calloc(index->capacity, sizeof(index_entry_t *));
+    if (!index->directory || !index->index_path || !index->slots) {
+        directoryIndexFree(index);
+        return NULL;
+    }
+#if defined(__linux__)
+    index->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#elif defined(HAVE_KQUEUE)
+    index->watch_fd = kqueue();
+#else
+    index->watch_fd = -1;
+#endif
+    journal_load(index);
+    watch_start(index);
+    return index;
+}
+
+void directoryIndexFree(directory_index_t index)
+{
+    if (!index) {
+        return;
+    }
+    watch_stop(index);
+    if (index->watch_fd >= 0) {
+        close(index->watch_fd);
+    }
+    if (index->journal) {
+        fclose(index->journal);
+    }
+    for (size_t i = 0; index->slots && i < index->capacity; i++) {
+        entry_free(index->slots[i]);
+    }
+    pthread_mutex_destroy(&index->lock);
+    free(index->sorted);
+    free(index->slots);
+    free(index->index_path);
+    free(index->directory);
+    free(index);
+}
+
+void directoryIndexSetMetadata(directory_index_t index, const char *key, const char *value)
+{
+    if (index->parsing) {
+        entry_add_value(index->parsing, key, value);
+    }
+}
+
+int directoryIndexReconcile(directory_index_t index, const char *const *replaced, size_t count)
+{
+    DIR *dir;
+    struct dirent *ent;
+    const char **gone = NULL;
+    size_t gone_count = 0;
+    int changed = 0;
+
+    // watch before listing so nothing that changes in between is missed
+    watch_start(index);
+    if (!(dir = opendir(index->directory))) {
+        return -1;
+    }
+    index->generation++;
+    while ((ent = readdir(dir))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        changed |= index_file(index, ent->d_name, is_replaced(ent->d_name, replaced, count));
+    }
+    closedir(dir);
+    for (size_t i = 0; i < index->capacity; i++) {
+        index_entry_t *entry = index->slots[i];
+        if (entry && entry->seen != index->generation) {
+            const char **names = realloc(gone, sizeof(char *) * (gone_count + 1));
+            if (!names) {
+                break;
+            }
+            gone = names;
+            gone[gone_count++] = entry->name;
+        }
+    }
+    for (size_t i = 0; i < gone_count; i++) {
+        char *name = strdup(gone[i]);
+        if (name) {
+            publish_remove(index, name);
+            free(name);
+        }
+    }
+    changed |= gone_count > 0;
+    free(gone);
+    journal_finish(index, changed);
+    return changed;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+char **directoryIndexCopyFiles(directory_index_t index, size_t *count)
+{
+    char **files = NULL;
+
+    pthread_mutex_lock(&index->lock);
+    if (!index->sorted_valid) {
+        const char **sorted = realloc(index->sorted, sizeof(char *) * (index->count ? index->count : 1));
+        if (!sorted) {
+            goto done;
+        }
+        index->sorted = sorted;
+        index->sorted_count = 0;
+        for (size_t i = 0; i < index->capacity; i++) {
+            if (index->slots[i]) {
+                sorted[index->sorted_count++] = index->slots[i]->name;
+            }
+        }
+        qsort(sorted, index->sorted_count, sizeof(char *), compare_names);
+        index->sorted_valid = 1;
+    }
+    if (!(files = calloc(index->sorted_count ? index->sorted_count : 1, sizeof(char *)))) {
+        goto done;
+    }
+    for (size_t i = 0; i < index->sorted_count; i++) {
+        if (!(files[i] = strdup(index->sorted[i]))) {
+            directoryIndexFreeFiles(files, i);
+            files = NULL;
+            goto done;
+        }
+    }
+    *count = index->sorted_count;
+done:
+    pthread_mutex_unlock(&index->lock);
+    return files;
+}
+
+void directoryIndexFreeFiles(char **files, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        free(files[i]);
+    }
+    free(files);
+}
+
+char *directoryIndexCopyMetadata(directory_index_t index, const char *name, const char *key)
+{
+    index_entry_t *entry;
+    const char *value;
+    char *copy = NULL;
+
+    pthread_mutex_lock(&index->lock);
+    if ((entry = table_get(index, name)) && (value = entry_value(entry, key))) {
+        copy = strdup(value);
+    }
+    pthread_mutex_unlock(&index->lock);
+    return copy;
+}
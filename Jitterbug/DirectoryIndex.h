@@ -0,0 +1,74 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef DirectoryIndex_h
+#define DirectoryIndex_h
+
+#include <stddef.h>
+
+/**
+ * Persistent index of the regular files in a directory along with key/value
+ * metadata parsed from each file. A file is only parsed when it is new, its
+ * modification time or size changed, or the caller says it was replaced.
+ *
+ * The index is saved as a journal of changed entries, so persisting an update
+ * costs as much as the update itself; the journal is compacted once it holds
+ * more stale records than live ones.
+ *
+ * Reconciling, handling watch events and freeing must be serialized by the
+ * caller (e.g. on one queue). The copy functions are safe from any thread.
+ */
+typedef struct directory_index *directory_index_t;
+
+/**
+ * Called while a file is being indexed. Metadata for the file is added with
+ * directoryIndexSetMetadata() before returning.
+ */
+typedef void (*directory_index_parse_cb_t)(directory_index_t index, const char *path, void *ctx);
+
+/** Loads the saved index at `index_path` if there is one. */
+directory_index_t directoryIndexNew(const char *directory, const char *index_path, directory_index_parse_cb_t parse, void *ctx);
+void directoryIndexFree(directory_index_t index);
+void directoryIndexSetMetadata(directory_index_t index, const char *key, const char *value);
+
+/**
+ * Lists the directory and stats every file in it. Files named in `replaced`
+ * are parsed again even if they look unchanged. Returns 1 if the index
+ * changed, 0 if not, or -1 if the directory could not be read.
+ */
+int directoryIndexReconcile(directory_index_t index, const char *const *replaced, size_t count);
+
+/**
+ * Returns a descriptor that becomes readable when the directory changes, or
+ * -1 if the platform has no watch backend. On Linux it is an inotify
+ * descriptor and events name the files that changed, so only those are
+ * looked at. With kqueue, a change to the directory leads to a reconcile.
+ * The watch is set up again by directoryIndexReconcile() if the directory
+ * did not exist yet or was removed.
+ */
+int directoryIndexWatchDescriptor(directory_index_t index);
+
+/** Applies pending watch events. Returns 1 if the index changed, 0 if not. */
+int directoryIndexHandleEvents(directory_index_t index);
+
+/** Sorted names of the indexed files, free with directoryIndexFreeFiles(). */
+char **directoryIndexCopyFiles(directory_index_t index, size_t *count);
+void directoryIndexFreeFiles(char **files, size_t count);
+
+/** Returns a copy of the value of `key` for the file `name` or NULL. */
+char *directoryIndexCopyMetadata(directory_index_t index, const char *name, const char *key);
+
+#endif /* DirectoryIndex_h */
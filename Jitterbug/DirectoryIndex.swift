@@ -0,0 +1,174 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+import Foundation
+
+/// Keeps a persistent index of the files in a directory along with metadata
+/// parsed from each file. The index, its journal and the directory watch live
+/// in DirectoryIndex.c; this runs them on a background queue and publishes
+/// the sorted file list. A file is only parsed again when its modification
+/// date or size changed or the caller says it was replaced.
+class DirectoryIndex {
+    typealias Parser = (URL) -> [String: String]
+
+    let directory: URL
+    private let parse: Parser
+    private let queue = DispatchQueue(label: "DirectoryIndex", qos: .utility)
+    private let lock = NSLock()
+    private var index: directory_index_t!
+
+    // written on `queue` while holding `lock`, read anywhere while holding `lock`
+    private var sortedFiles: [URL] = []
+
+    // only used on `queue`
+    private var source: DispatchSourceRead?
+    private var onChange: (([URL]) -> Void)?
+
+    /// Sorted list of the indexed files as of the last reconcile.
+    var files: [URL] {
+        lock.lock()
+        defer {
+            lock.unlock()
+        }
+        return sortedFiles
+    }
+
+    init(directory: URL, indexURL: URL, parse: @escaping Parser) {
+        self.directory = directory
+        self.parse = parse
+        try? FileManager.default.createDirectory(at: indexURL.deletingLastPathComponent(), withIntermediateDirectories: true)
+        index = directoryIndexNew(directory.path, indexURL.path, { index, path, ctx in
+            let this = Unmanaged<DirectoryIndex>.fromOpaque(ctx!).takeUnretainedValue()
+            let file = URL(fileURLWithPath: String(cString: path!))
+            for (key, value) in this.parse(file) {
+                directoryIndexSetMetadata(index, key, value)
+            }
+        }, Unmanaged.passUnretained(self).toOpaque())
+        publish()
+    }
+
+    deinit {
+        if let source = source {
+            // the watch descriptor belongs to the index, free it once the source is done with it
+            source.cancel()
+        } else {
+            directoryIndexFree(index)
+        }
+    }
+
+    private func publish() {
+        var count = 0
+        guard let names = directoryIndexCopyFiles(index, &count) else {
+            return
+        }
+        let files = (0..<count).map { directory.appendingPathComponent(String(cString: names[$0]!)) }
+        directoryIndexFreeFiles(names, count)
+        lock.lock()
+        sortedFiles = files
+        lock.unlock()
+    }
+
+    // MARK: - Indexing
+
+    /// Reconciles the index with the directory in the background and calls
+    /// `completion` on the main queue with the sorted file list. Files in
+    /// `replaced` are read again even if they look unchanged.
+    func refresh(replacing replaced: [URL] = [], completion: (([URL]) -> Void)? = nil) {
+        let names = replaced.map { $0.lastPathComponent }
+        queue.async {
+            self.reconcile(replacing: names)
+            if let completion = completion {
+                let files = self.files
+                DispatchQueue.main.async {
+                    completion(files)
+                }
+            }
+        }
+    }
+
+    /// Value of `key` parsed from `file`, nil if it is not indexed yet or had no such value.
+    func metadata(for file: URL, key: String) -> String? {
+        guard file.deletingLastPathComponent().standardizedFileURL.path == directory.standardizedFileURL.path else {
+            return nil
+        }
+        guard let value = directoryIndexCopyMetadata(index, file.lastPathComponent, key) else {
+            return nil
+        }
+        defer {
+            free(value)
+        }
+        return String(cString: value)
+    }
+
+    /// Returns true if anything changed. Every file is stat'ed so one that was
+    /// overwritten outside of the app is noticed, but only files that are new,
+    /// changed on disk or in `replaced` are parsed.
+    @discardableResult
+    private func reconcile(replacing replaced: [String]) -> Bool {
+        dispatchPrecondition(condition: .onQueue(queue))
+        let names: [UnsafePointer<CChar>?] = replaced.map { UnsafePointer(strdup($0)) }
+        defer {
+            names.forEach { free(UnsafeMutablePointer(mutating: $0)) }
+        }
+        guard directoryIndexReconcile(index, names, names.count) > 0 else {
+            return false
+        }
+        publish()
+        return true
+    }
+
+    // MARK: - Watching
+
+    /// Calls `onChange` on the main queue with the new file list whenever the directory changes.
+    func startWatching(onChange: @escaping ([URL]) -> Void) {
+        queue.async {
+            self.onChange = onChange
+            if self.source == nil {
+                self.startSource()
+            }
+        }
+    }
+
+    private func startSource() {
+        // the index watches the directory again by itself once it is recreated
+        let fd = directoryIndexWatchDescriptor(index)
+        guard fd >= 0 else {
+            return
+        }
+        let source = DispatchSource.makeReadSource(fileDescriptor: fd, queue: queue)
+        source.setEventHandler { [weak self] in
+            guard let self = self else {
+                return
+            }
+            guard directoryIndexHandleEvents(self.index) > 0 else {
+                return
+            }
+            self.publish()
+            if let onChange = self.onChange {
+                let files = self.files
+                DispatchQueue.main.async {
+                    onChange(files)
+                }
+            }
+        }
+        let index = self.index
+        source.setCancelHandler {
+            directoryIndexFree(index)
+        }
+        self.source = source
+        source.resume()
+    }
+}
@@ -0,0 +1,579 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "IconStore.h"
+#include "Jitterbug.h"
+
+#define DEFAULT_BYTE_BUDGET (8 * 1024 * 1024)
+#define DEFAULT_THUMBNAIL_PIXEL_SIZE 96
+#define MIN_BUCKETS 64
+#define COMPARE_CHUNK 65536
+
+/**
+ * An entry lives while its thumbnail is cached or a decode of it is running,
+ * so its generation can tell a decode that the file was replaced meanwhile.
+ */
+typedef struct icon_entry {
+    char *key;
+    void *image;
+    size_t cost;
+    unsigned int generation;
+    unsigned int decoding;
+    struct icon_entry *chain;
+    struct icon_entry *newer;
+    struct icon_entry *older;
+} icon_entry_t;
+
+struct icon_store {
+    char *directory;
+    icon_store_decode_cb_t decode;
+    icon_store_image_cb_t retain;
+    icon_store_image_cb_t release;
+    void *ctx;
+
+    // everything below is protected by `lock`
+    pthread_mutex_t lock;
+    icon_entry_t **buckets;
+    size_t bucket_count;
+    size_t count;
+    icon_entry_t *newest;
+    icon_entry_t *oldest;
+    size_t byte_budget;
+    size_t current_bytes;
+    size_t thumbnails;
+    unsigned int pixel_size;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+// MARK: - Entries
+
+// all of these must be called with `lock` held
+
+static size_t bucket_for_key(icon_store_t store, const char *key)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 0x100000001b3ULL;
+    }
+    return (size_t)hash & (store->bucket_count - 1);
+}
+
+static icon_entry_t *entry_lookup(icon_store_t store, const char *key)
+{
+    icon_entry_t *entry = store->buckets[bucket_for_key(store, key)];
+
+    while (entry && strcmp(entry->key, key) != 0) {
+        entry = entry->chain;
+    }
+    return entry;
+}
+
+static void entries_grow(icon_store_t store)
+{
+    size_t old_count = store->bucket_count;
+    icon_entry_t **old = store->buckets;
+    icon_entry_t **buckets = calloc(old_count * 2, sizeof(icon_entry_t *));
+
+    if (!buckets) {
+        return; // chains just get longer
+    }
+    store->buckets = buckets;
+    store->bucket_count = old_count * 2;
+    for (size_t i = 0; i < old_count; i++) {
+        icon_entry_t *entry = old[i];
+        while (entry) {
+            icon_entry_t *chain = entry->chain;
+            size_t bucket = bucket_for_key(store, entry->key);
+            entry->chain = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = chain;
+        }
+    }
+    free(old);
+}
+
+static icon_entry_t *entry_create(icon_store_t store, const char *key)
+{
+    icon_entry_t *entry = calloc(1, sizeof(icon_entry_t));
+    size_t bucket;
+
+    if (!entry || !(entry->key = strdup(key))) {
+        free(entry);
+        return NULL;
+    }
+    if (store->count >= store->bucket_count) {
+        entries_grow(store);
+    }
+    bucket = bucket_for_key(store, key);
+    entry->chain = store->buckets[bucket];
+    store->buckets[bucket] = entry;
+    store->count++;
+    return entry;
+}
+
+/** Frees the entry once nothing refers to it anymore. */
+static void entry_release_if_unused(icon_store_t store, icon_entry_t *entry)
+{
+    icon_entry_t **link;
+
+    if (entry->image || entry->decoding) {
+        return;
+    }
+    link = &store->buckets[bucket_for_key(store, entry->key)];
+    while (*link != entry) {
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+    store->count--;
+    free(entry->key);
+    free(entry);
+}
+
+// MARK: - LRU list
+
+static void lru_unlink(icon_store_t store, icon_entry_t *entry)
+{
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        store->newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        store->oldest = entry->newer;
+    }
+    entry->newer = NULL;
+    entry->older = NULL;
+}
+
+static void lru_push(icon_store_t store, icon_entry_t *entry)
+{
+    entry->older = store->newest;
+    if (store->newest) {
+        store->newest->newer = entry;
+    } else {
+        store->oldest = entry;
+    }
+    store->newest = entry;
+}
+
+static void drop_thumbnail(icon_store_t store, icon_entry_t *entry)
+{
+    if (!entry->image) {
+        return;
+    }
+    lru_unlink(store, entry);
+    store->release(entry->image, store->ctx);
+    entry->image = NULL;
+    store->current_bytes -= entry->cost;
+    store->thumbnails--;
+}
+
+static void trim_locked(icon_store_t store, size_t bytes)
+{
+    while (store->current_bytes > bytes && store->oldest) {
+        icon_entry_t *entry = store->oldest;
+        drop_thumbnail(store, entry);
+        entry_release_if_unused(store, entry);
+    }
+}
+
+/** The file changed or is gone, a decode that is still running must not be cached. */
+static void invalidate(icon_store_t store, icon_entry_t *entry)
+{
+    drop_thumbnail(store, entry);
+    entry->generation++;
+    entry_release_if_unused(store, entry);
+}
+
+// MARK: - Files
+
+static int make_path(char path[static PATH_MAX], const char *directory, const char *name)
+{
+    return snprintf(path, PATH_MAX, "%s/%s", directory, name) < PATH_MAX;
+}
+
+static int make_directories(const char *path)
+{
+    char partial[PATH_MAX];
+    size_t length = strlen(path);
+
+    if (length >= sizeof(partial)) {
+        return 0;
+    }
+    memcpy(partial, path, length + 1);
+    for (char *p = partial + 1; ; p++) {
+        if (*p == '/' || *p == '\0') {
+            char c = *p;
+            *p = '\0';
+            if (mkdir(partial, 0755) != 0 && errno != EEXIST) {
+                return 0;
+            }
+            if (!(*p = c)) {
+                break;
+            }
+        }
+    }
+    return 1;
+}
+
+static int file_has_contents(const char *path, const void *data, size_t length)
+{
+    char buf[COMPARE_CHUNK];
+    struct stat st;
+    size_t offset = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    int same = 0;
+
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size != length) {
+        goto done;
+    }
+    while (offset < length) {
+        ssize_t got = read(fd, buf, length - offset < sizeof(buf) ? length - offset : sizeof(buf));
+        if (got <= 0 || memcmp(buf, (const char *)data + offset, got) != 0) {
+            goto done;
+        }
+        offset += got;
+    }
+    same = 1;
+done:
+    close(fd);
+    return same;
+}
+
+/** Readers never see a partly written icon. */
+static int write_file_atomically(const char *path, const void *data, size_t length)
+{
+    char temp[PATH_MAX];
+    size_t offset = 0;
+    int fd;
+
+    if (snprintf(temp, sizeof(temp), "%s.XXXXXX", path) >= (int)sizeof(temp) || (fd = mkstemp(temp)) < 0) {
+        return 0;
+    }
+    while (offset < length) {
+        ssize_t wrote = write(fd, (const char *)data + offset, length - offset);
+        if (wrote < 0 && errno == EINTR) {
+            continue;
+        }
+        if (wrote <= 0) {
+            close(fd);
+            unlink(temp);
+            return 0;
+        }
+        offset += wrote;
+    }
+    if (close(fd) != 0 || rename(temp, path) != 0) {
+        unlink(temp);
+        return 0;
+    }
+    return 1;
+}
+
+static int is_kept(const char *file, const char *const *keep, size_t keep_count)
+{
+    size_t length = strlen(file);
+
+    for (size_t i = 0; i < keep_count; i++) {
+        size_t stem = strlen(keep[i]);
+        if (length == stem + 4 && strncmp(file, keep[i], stem) == 0 && strcmp(file + stem, ".png") == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// MARK: - Public
+
+icon_store_t iconStoreNew(const char *directory, icon_store_decode_cb_t decode, icon_store_image_cb_t retain, icon_store_image_cb_t release, void *ctx)
+{
+    icon_store_t store = calloc(1, sizeof(struct icon_store));
+
+    if (!store) {
+        return NULL;
+    }
+    store->directory = strdup(directory);
+    store->bucket_count = MIN_BUCKETS;
+    store->buckets = calloc(store->bucket_count, sizeof(icon_entry_t *));
+    if (!store->directory || !store->buckets) {
+        free(store->directory);
+        free(store->buckets);
+        free(store);
+        return NULL;
+    }
+    store->decode = decode;
+    store->retain = retain;
+    store->release = release;
+    store->ctx = ctx;
+    store->byte_budget = DEFAULT_BYTE_BUDGET;
+    store->pixel_size = DEFAULT_THUMBNAIL_PIXEL_SIZE;
+    pthread_mutex_init(&store->lock, NULL);
+    return store;
+}
+
+void iconStoreFree(icon_store_t store)
+{
+    if (!store) {
+        return;
+    }
+    for (size_t i = 0; i < store->bucket_count; i++) {
+        icon_entry_t *entry = store->buckets[i];
+        while (entry) {
+            icon_entry_t *chain = entry->chain;
+            if (entry->image) {
+                store->release(entry->image, store->ctx);
+            }
+            free(entry->key);
+            free(entry);
+            entry = chain;
+        }
+    }
+    pthread_mutex_destroy(&store->lock);
+    free(store->buckets);
+    free(store->directory);
+    free(store);
+}
+
+size_t iconStoreGetByteBudget(icon_store_t store)
+{
+    size_t bytes;
+
+    pthread_mutex_lock(&store->lock);
+    bytes = store->byte_budget;
+    pthread_mutex_unlock(&store->lock);
+    return bytes;
+}
+
+void iconStoreSetByteBudget(icon_store_t store, size_t bytes)
+{
+    pthread_mutex_lock(&store->lock);
+    store->byte_budget = bytes;
+    trim_locked(store, bytes);
+    pthread_mutex_unlock(&store->lock);
+}
+
+unsigned int iconStoreGetThumbnailPixelSize(icon_store_t store)
+{
+    unsigned int pixel_size;
+
+    pthread_mutex_lock(&store->lock);
+    pixel_size = store->pixel_size;
+    pthread_mutex_unlock(&store->lock);
+    return pixel_size;
+}
+
+void iconStoreSetThumbnailPixelSize(icon_store_t store, unsigned int pixel_size)
+{
+    pthread_mutex_lock(&store->lock);
+    store->pixel_size = pixel_size;
+    trim_locked(store, 0);
+    pthread_mutex_unlock(&store->lock);
+}
+
+void iconStoreGetStats(icon_store_t store, icon_store_stats_t *stats)
+{
+    pthread_mutex_lock(&store->lock);
+    stats->current_bytes = store->current_bytes;
+    stats->thumbnails = store->thumbnails;
+    stats->hits = store->hits;
+    stats->misses = store->misses;
+    pthread_mutex_unlock(&store->lock);
+}
+
+int iconStoreStoreIcon(icon_store_t store, const char *host, const char *bundle_identifier, const void *data, size_t length, char **key)
+{
+    char host_path[PATH_MAX];
+    char path[PATH_MAX];
+    size_t key_length = strlen(host) + strlen(bundle_identifier) + sizeof("/.png");
+    icon_entry_t *entry;
+
+    if (!(*key = malloc(key_length))) {
+        return -1;
+    }
+    snprintf(*key, key_length, "%s/%s.png", host, bundle_identifier);
+    if (!make_path(host_path, store->directory, host) || !make_path(path, store->directory, *key)) {
+        goto error;
+    }
+    // icons rarely change, avoid rewriting the file and decoding it again
+    if (file_has_contents(path, data, length)) {
+        return 0;
+    }
+    if (!make_directories(host_path) || !write_file_atomically(path, data, length)) {
+        DEBUG_PRINT("failed to write icon %s: %s", *key, strerror(errno));
+        goto error;
+    }
+    pthread_mutex_lock(&store->lock);
+    if ((entry = entry_lookup(store, *key))) {
+        invalidate(store, entry);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return 1;
+error:
+    free(*key);
+    *key = NULL;
+    return -1;
+}
+
+void *iconStoreCopyCachedThumbnail(icon_store_t store, const char *key)
+{
+    icon_entry_t *entry;
+    void *image = NULL;
+
+    pthread_mutex_lock(&store->lock);
+    if ((entry = entry_lookup(store, key)) && entry->image) {
+        lru_unlink(store, entry);
+        lru_push(store, entry);
+        store->hits++;
+        image = entry->image;
+        store->retain(image, store->ctx);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return image;
+}
+
+void *iconStoreLoadThumbnail(icon_store_t store, const char *key)
+{
+    char path[PATH_MAX];
+    void *image = NULL;
+    int counted = 0;
+
+    if (!make_path(path, store->directory, key)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&store->lock);
+    for (;;) {
+        icon_entry_t *entry = entry_lookup(store, key);
+        unsigned int generation, pixel_size;
+        size_t cost = 0;
+
+        if (entry && entry->image) {
+            lru_unlink(store, entry);
+            lru_push(store, entry);
+            store->hits++;
+            image = entry->image;
+            store->retain(image, store->ctx);
+            break;
+        }
+        if (!entry && !(entry = entry_create(store, key))) {
+            break;
+        }
+        if (!counted) {
+            store->misses++;
+            counted = 1;
+        }
+        entry->decoding++;
+        generation = entry->generation;
+        pixel_size = store->pixel_size;
+        pthread_mutex_unlock(&store->lock);
+        image = store->decode(path, pixel_size, &cost, store->ctx);
+        pthread_mutex_lock(&store->lock);
+        entry->decoding--;
+        if (generation != entry->generation || pixel_size != store->pixel_size) {
+            // replaced or resized while decoding, decode the current file again
+            if (image) {
+                store->release(image, store->ctx);
+            }
+            entry_release_if_unused(store, entry);
+            continue;
+        }
+        if (image && entry->image) {
+            // another thread finished the same decode first
+            store->release(image, store->ctx);
+            image = entry->image;
+            store->retain(image, store->ctx);
+        } else if (image) {
+            store->retain(image, store->ctx); // one for the caller, the decode's for the cache
+            entry->image = image;
+            entry->cost = cost;
+            lru_push(store, entry);
+            store->current_bytes += cost;
+            store->thumbnails++;
+            trim_locked(store, store->byte_budget);
+        } else {
+            entry_release_if_unused(store, entry);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&store->lock);
+    return image;
+}
+
+void iconStoreRemoveHost(icon_store_t store, const char *host, const char *const *keep, size_t keep_count)
+{
+    char host_path[PATH_MAX];
+    char path[PATH_MAX];
+    size_t prefix_length = strlen(host);
+    DIR *dir;
+    struct dirent *ent;
+
+    if (!make_path(host_path, store->directory, host)) {
+        return;
+    }
+    if ((dir = opendir(host_path))) {
+        while ((ent = readdir(dir))) {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+            if (keep && is_kept(ent->d_name, keep, keep_count)) {
+                continue;
+            }
+            if (make_path(path, host_path, ent->d_name) && unlink(path) != 0 && errno != ENOENT) {
+                DEBUG_PRINT("failed to remove stale icon %s: %s", path, strerror(errno));
+            }
+        }
+        closedir(dir);
+    }
+    if (!keep && rmdir(host_path) != 0 && errno != ENOENT) {
+        DEBUG_PRINT("failed to remove icons for %s: %s", host, strerror(errno));
+    }
+    pthread_mutex_lock(&store->lock);
+    for (size_t i = 0; i < store->bucket_count; i++) {
+        icon_entry_t *entry = store->buckets[i];
+        while (entry) {
+            icon_entry_t *chain = entry->chain;
+            if (strncmp(entry->key, host, prefix_length) == 0 && entry->key[prefix_length] == '/' &&
+                !(keep && is_kept(entry->key + prefix_length + 1, keep, keep_count))) {
+                invalidate(store, entry);
+            }
+            entry = chain;
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+void iconStoreTrim(icon_store_t store, size_t bytes)
+{
+    pthread_mutex_lock(&store->lock);
+    trim_locked(store, bytes);
+    pthread_mutex_unlock(&store->lock);
+}
@@ -0,0 +1,80 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef IconStore_h
+#define IconStore_h
+
+#include <stddef.h>
+
+/**
+ * App icons kept as files on disk under `directory`/<host>/<bundle id>.png
+ * with a byte budgeted, least recently used set of decoded thumbnails in
+ * memory. Decoding is left to the caller's callbacks, so the images are
+ * opaque reference counted pointers (CGImageRef in the app).
+ *
+ * All functions are thread safe. Decoding runs without the store's lock held,
+ * and a decode of an icon that is replaced while it runs is thrown away and
+ * done again.
+ */
+typedef struct icon_store *icon_store_t;
+
+/**
+ * Returns a retained thumbnail of the icon at `path` no larger than
+ * `pixel_size` and sets `cost` to its size in bytes, or returns NULL.
+ */
+typedef void *(*icon_store_decode_cb_t)(const char *path, unsigned int pixel_size, size_t *cost, void *ctx);
+typedef void (*icon_store_image_cb_t)(void *image, void *ctx);
+
+typedef struct {
+    size_t current_bytes;
+    size_t thumbnails;
+    unsigned long hits;
+    unsigned long misses;
+} icon_store_stats_t;
+
+icon_store_t iconStoreNew(const char *directory, icon_store_decode_cb_t decode, icon_store_image_cb_t retain, icon_store_image_cb_t release, void *ctx);
+void iconStoreFree(icon_store_t store);
+
+size_t iconStoreGetByteBudget(icon_store_t store);
+void iconStoreSetByteBudget(icon_store_t store, size_t bytes);
+unsigned int iconStoreGetThumbnailPixelSize(icon_store_t store);
+/** Drops every thumbnail since they were decoded at the old size. */
+void iconStoreSetThumbnailPixelSize(icon_store_t store, unsigned int pixel_size);
+void iconStoreGetStats(icon_store_t store, icon_store_stats_t *stats);
+
+/**
+ * Writes the icon file unless it already has the same contents and sets
+ * `key` to a string that must be freed. Returns 1 if the file was written,
+ * 0 if it was unchanged or -1 on error. Performs file I/O.
+ */
+int iconStoreStoreIcon(icon_store_t store, const char *host, const char *bundle_identifier, const void *data, size_t length, char **key);
+
+/** Returns a retained thumbnail if it is already decoded, never touches the disk. */
+void *iconStoreCopyCachedThumbnail(icon_store_t store, const char *key);
+
+/** Returns a retained thumbnail, decoding it on the calling thread if needed. */
+void *iconStoreLoadThumbnail(icon_store_t store, const char *key);
+
+/**
+ * Deletes the icon files of `host` except for the listed bundle identifiers,
+ * or all of them if `keep` is NULL. Performs file I/O.
+ */
+void iconStoreRemoveHost(icon_store_t store, const char *host, const char *const *keep, size_t keep_count);
+
+/** Evicts least recently used thumbnails until at most `bytes` are left. */
+void iconStoreTrim(icon_store_t store, size_t bytes);
+
+#endif /* IconStore_h */
@@ -15,6 +15,7 @@
 //
 
 #import <Foundation/Foundation.h>
+#import <CoreGraphics/CoreGraphics.h>
 
 NS_ASSUME_NONNULL_BEGIN
 
@@ -25,9 +26,12 @@ NS_ASSUME_NONNULL_BEGIN
 @property (nonatomic) NSString *bundleExecutable;
 @property (nonatomic) NSString *container;
 @property (nonatomic) NSString *path;
-@property (nonatomic) NSData *icon;
+@property (nonatomic, nullable) NSString *iconKey;
+@property (nonatomic, nullable, readonly) CGImageRef icon;
 @property (nonatomic, readonly) NSString *executablePath;
 
+- (void)loadIconWithCompletion:(void (^)(CGImageRef _Nullable icon))completion;
+
 @end
 
 NS_ASSUME_NONNULL_END
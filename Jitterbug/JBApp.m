@@ -15,6 +15,7 @@
 //
 
 #import "JBApp.h"
+#import "JBIconCache.h"
 
 @implementation JBApp
 
@@ -22,4 +23,21 @@
     return [self.path stringByAppendingPathComponent:self.bundleExecutable];
 }
 
+- (CGImageRef)icon {
+    if (!self.iconKey) {
+        return NULL;
+    }
+    return [JBIconCache.sharedCache cachedThumbnailForKey:self.iconKey];
+}
+
+- (void)loadIconWithCompletion:(void (^)(CGImageRef _Nullable icon))completion {
+    if (!self.iconKey) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            completion(NULL);
+        });
+        return;
+    }
+    [JBIconCache.sharedCache loadThumbnailForKey:self.iconKey completion:completion];
+}
+
 @end
@@ -27,6 +27,10 @@ const NSInteger kJBHostImageNotMounted;
 
 NS_ASSUME_NONNULL_BEGIN
 
+typedef void (^JBHostDeviceCompletionHandler)(NSError * _Nullable error);
+typedef void (^JBHostDeviceAppsCompletionHandler)(NSArray<JBApp *> * _Nullable apps, NSError * _Nullable error);
+typedef void (^JBHostDeviceDataCompletionHandler)(NSData * _Nullable data, NSError * _Nullable error);
+
 @interface JBHostDevice : NSObject<NSSecureCoding>
 
 @property (nonatomic) NSString *name;
@@ -56,6 +60,28 @@ NS_ASSUME_NONNULL_BEGIN
 - (BOOL)resetPairingWithError:(NSError **)error;
 - (nullable NSData *)exportPairingWithError:(NSError **)error;
 
+/**
+ * Asynchronous variants of the methods above; the synchronous methods wait on
+ * these. Lockdown requests run on a per-device queue and service operations
+ * (installed apps, mounting, launching) run on a shared non-blocking service
+ * loop, so they can overlap (for example, querying installed apps while an
+ * image is uploading). Starting, stopping, and resetting lockdown waits for
+ * outstanding lockdown requests to finish first. Completion handlers are
+ * called on a global queue.
+ */
+- (void)startLockdownWithPairingUrl:(NSURL *)url completion:(JBHostDeviceCompletionHandler)completion;
+/// `udid` is the pairing's UDID when the caller already knows it, which saves parsing the pairing again.
+- (void)startLockdownWithPairingUrl:(NSURL *)url udid:(nullable NSString *)udid completion:(JBHostDeviceCompletionHandler)completion;
+- (void)startLockdownWithCompletion:(JBHostDeviceCompletionHandler)completion;
+- (void)stopLockdownWithCompletion:(dispatch_block_t)completion;
+- (void)updateDeviceInfoWithCompletion:(JBHostDeviceCompletionHandler)completion;
+- (void)installedAppsWithCompletion:(JBHostDeviceAppsCompletionHandler)completion;
+- (void)mountImageForUrl:(NSURL *)url signatureUrl:(NSURL *)signatureUrl completion:(JBHostDeviceCompletionHandler)completion;
+- (void)mountImageForUrl:(NSURL *)url signature:(NSData *)signature completion:(JBHostDeviceCompletionHandler)completion;
+- (void)launchApplication:(JBApp *)application completion:(JBHostDeviceCompletionHandler)completion;
+- (void)resetPairingWithCompletion:(JBHostDeviceCompletionHandler)completion;
+- (void)exportPairingWithCompletion:(JBHostDeviceDataCompletionHandler)completion;
+
 @end
 
 NS_ASSUME_NONNULL_END
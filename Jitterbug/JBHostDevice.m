@@ -24,17 +24,25 @@
 #include <libimobiledevice/service.h>
 #include <libimobiledevice-glue/utils.h>
 #include "common/userpref.h"
+#include <fcntl.h>
+#include <unistd.h>
 #import "JBApp.h"
+#import "JBIconCache.h"
 #import "JBHostDevice.h"
 #import "Jitterbug.h"
 #import "Jitterbug-Swift.h"
 #import "CacheStorage.h"
+#import "Metrics.h"
+#import "ServiceLoop.h"
+#import "ServiceOperations.h"
 
 #define TOOL_NAME "jitterbug"
 NSString *const kJBErrorDomain = @"com.osy86.Jitterbug";
 const NSInteger kJBHostImageNotMounted = -666;
 static const char PKG_PATH[] = "PublicStaging";
 static const char PATH_PREFIX[] = "/private/var/mobile/Media";
+static const unsigned int kServiceTimeoutMs = 30000;
+static const size_t kImageReadChunk = 1024 * 1024;
 
 @interface JBHostDevice ()
 
@@ -47,6 +55,8 @@ static const char PATH_PREFIX[] = "/private/var/mobile/Media";
 @property (nonatomic, nonnull) dispatch_queue_t timerQueue;
 @property (nonatomic, nonnull) dispatch_semaphore_t timerCancelEvent;
 @property (nonatomic, nullable) dispatch_source_t heartbeat;
+@property (nonatomic, nonnull) dispatch_queue_t operationQueue;
+@property (nonatomic, nonnull) dispatch_semaphore_t lockdownLock;
 
 @end
 
@@ -101,6 +111,8 @@ static const char PATH_PREFIX[] = "/private/var/mobile/Media";
 - (void)setupDispatchQueue {
     self.timerQueue = dispatch_queue_create("heartbeatQueue", DISPATCH_QUEUE_SERIAL);
     self.timerCancelEvent = dispatch_semaphore_create(0);
+    self.operationQueue = dispatch_queue_create("operationQueue", DISPATCH_QUEUE_CONCURRENT);
+    self.lockdownLock = dispatch_semaphore_create(1);
 }
 
 - (instancetype)initWithHostname:(NSString *)hostname address:(NSData *)address {
@@ -130,7 +142,7 @@ static const char PATH_PREFIX[] = "/private/var/mobile/Media";
 }
 
 - (void)dealloc {
-    [self stopLockdown];
+    [self stopLockdownOnQueue];
 }
 
 #pragma mark - NSCoding
@@ -174,15 +186,32 @@ static const char PATH_PREFIX[] = "/private/var/mobile/Media";
 
 #pragma mark - Methods
 
-static service_error_t service_client_factory_start_service_with_lockdown(lockdownd_client_t lckd, idevice_t device, const char* service_name, void **client, const char* label, int32_t (*constructor_func)(idevice_t, lockdownd_service_descriptor_t, void**), int32_t *error_code)
+/**
+ * Operations can run concurrently on the same device, but the lockdown client is a single
+ * connection so requests on it must be serialized. It is only read under the lock so a
+ * request never sees a client that is being freed. The service connection itself is
+ * independent and is set up outside of the lock.
+ */
+static service_error_t service_client_factory_start_service_with_lockdown(lockdownd_client_t *lckd, dispatch_semaphore_t lock, idevice_t device, const char* service_name, void **client, const char* label, int32_t (*constructor_func)(idevice_t, lockdownd_service_descriptor_t, void**), int32_t *error_code)
 {
     *client = NULL;
 
+    char *udid = NULL;
+    uint64_t start = metricsNow();
+    idevice_get_udid(device, &udid);
+
     lockdownd_service_descriptor_t service = NULL;
-    lockdownd_start_service(lckd, service_name, &service);
+    dispatch_semaphore_wait(lock, DISPATCH_TIME_FOREVER);
+    if (*lckd) {
+        lockdownd_start_service(*lckd, service_name, &service);
+    }
+    dispatch_semaphore_signal(lock);
 
     if (!service || service->port == 0) {
         DEBUG_PRINT("Could not start service %s!", service_name);
+        metricsRecord(udid, kMetricsServiceStart, start, 0);
+        free(udid);
+        lockdownd_service_descriptor_free(service);
         return SERVICE_E_START_SERVICE_ERROR;
     }
 
@@ -199,6 +228,8 @@ static service_error_t service_client_factory_start_service_with_lockdown(lockdo
     if (ec != SERVICE_E_SUCCESS) {
         DEBUG_PRINT("Could not connect to service %s! Port: %i, error: %i", service_name, service->port, ec);
     }
+    metricsRecord(udid, kMetricsServiceStart, start, ec == SERVICE_E_SUCCESS);
+    free(udid);
 
     lockdownd_service_descriptor_free(service);
     service = NULL;
@@ -216,11 +247,32 @@ static service_error_t service_client_factory_start_service_with_lockdown(lockdo
     [self createError:error withString:string code:-1];
 }
 
-- (void)stopLockdown {
-    [self stopHeartbeat];
+- (lockdownd_error_t)performLockdownRequest:(lockdownd_error_t (^)(lockdownd_client_t lockdown))request {
+    lockdownd_error_t err = LOCKDOWN_E_NO_RUNNING_SESSION;
+    
+    dispatch_semaphore_wait(self.lockdownLock, DISPATCH_TIME_FOREVER);
     if (self.lockdown) {
-        lockdownd_client_free(self.lockdown);
-        self.lockdown = NULL;
+        err = request(self.lockdown);
+    }
+    dispatch_semaphore_signal(self.lockdownLock);
+    return err;
+}
+
+/**
+ * The methods below that end in "OnQueue" must run on the operation queue. Starting, stopping,
+ * and resetting lockdown are barriers so they never run while another operation is using the
+ * lockdown client or the device.
+ */
+- (void)stopLockdownOnQueue {
+    lockdownd_client_t lockdown = NULL;
+    
+    [self stopHeartbeat];
+    dispatch_semaphore_wait(self.lockdownLock, DISPATCH_TIME_FOREVER);
+    lockdown = self.lockdown;
+    self.lockdown = NULL;
+    dispatch_semaphore_signal(self.lockdownLock);
+    if (lockdown) {
+        lockdownd_client_free(lockdown);
     }
     if (self.device) {
         idevice_free(self.device);
@@ -231,23 +283,27 @@ static service_error_t service_client_factory_start_service_with_lockdown(lockdo
     }
 }
 
-- (BOOL)startLockdownWithPairingUrl:(NSURL *)url error:(NSError **)error {
+- (BOOL)startLockdownOnQueueWithPairingUrl:(NSURL *)url udid:(NSString *)udid error:(NSError **)error {
     idevice_error_t derr = IDEVICE_E_SUCCESS;
     lockdownd_error_t lerr = LOCKDOWN_E_SUCCESS;
+    uint64_t start = metricsNow();
     
     assert(!self.isUsbDevice);
-    [self stopLockdown];
+    [self stopLockdownOnQueue];
     NSData *data = [NSData dataWithContentsOfURL:url options:0 error:error];
     if (!data) {
         return NO;
     }
-    NSDictionary *plist = [NSPropertyListSerialization propertyListWithData:data options:NSPropertyListImmutable format:nil error:error];
-    if (!plist) {
-        return NO;
+    if (!udid) {
+        NSDictionary *plist = [NSPropertyListSerialization propertyListWithData:data options:NSPropertyListImmutable format:nil error:error];
+        if (!plist) {
+            return NO;
+        }
+        udid = plist[@"UDID"];
     }
-    NSString *udid = plist[@"UDID"];
     if (!udid) {
         [self createError:error withString:NSLocalizedString(@"Pairing data missing key 'UDID'", @"JBHostDevice")];
+        return NO;
     }
     if (!cachePairingUpdateData(udid.UTF8String, (__bridge CFDataRef)(data))) {
         if (!cachePairingAdd(udid.UTF8String, (__bridge CFDataRef)(self.address), (__bridge CFDataRef)(data))) {
@@ -274,19 +330,22 @@ static service_error_t service_client_factory_start_service_with_lockdown(lockdo
     }
     
     self.udid = udid;
+    metricsRecord(udid.UTF8String, kMetricsLockdownStart, start, 1);
     return YES;
     
 error:
-    [self stopLockdown];
+    metricsRecord(udid.UTF8String, kMetricsLockdownStart, start, 0);
+    [self stopLockdownOnQueue];
     return NO;
 }
 
-- (BOOL)startLockdownWithError:(NSError **)error {
+- (BOOL)startLockdownOnQueueWithError:(NSError **)error {
     idevice_error_t derr = IDEVICE_E_SUCCESS;
     lockdownd_error_t lerr = LOCKDOWN_E_SUCCESS;
+    uint64_t start = metricsNow();
     
     assert(self.udid);
-    [self stopLockdown];
+    [self stopLockdownOnQueue];
     
     if ((derr = idevice_new_with_options(&_device, self.udid.UTF8String, IDEVICE_LOOKUP_NETWORK | IDEVICE_LOOKUP_USBMUX)) != IDEVICE_E_SUCCESS) {
         [self createError:error withString:NSLocalizedString(@"Failed to create device.", @"JBHostDevice") code:derr];
@@ -305,34 +364,41 @@ error:
         goto error;
     }
     
+    metricsRecord(self.udid.UTF8String, kMetricsLockdownStart, start, 1);
     return YES;
     
 error:
-    [self stopLockdown];
+    metricsRecord(self.udid.UTF8String, kMetricsLockdownStart, start, 0);
+    [self stopLockdownOnQueue];
     return NO;
 }
 
 - (BOOL)startHeartbeatWithError:(NSError **)error {
     heartbeat_client_t client;
     heartbeat_error_t err = HEARTBEAT_E_UNKNOWN_ERROR;
+    char *udid = NULL;
     
     [self stopHeartbeat];
-    service_client_factory_start_service_with_lockdown(self.lockdown, self.device, HEARTBEAT_SERVICE_NAME, (void **)&client, TOOL_NAME, SERVICE_CONSTRUCTOR(heartbeat_client_new), &err);
+    service_client_factory_start_service_with_lockdown(&_lockdown, self.lockdownLock, self.device, HEARTBEAT_SERVICE_NAME, (void **)&client, TOOL_NAME, SERVICE_CONSTRUCTOR(heartbeat_client_new), &err);
     if (err != HEARTBEAT_E_SUCCESS) {
         [self createError:error withString:NSLocalizedString(@"Failed to create heartbeat service.", @"JBHostDevice") code:err];
         return NO;
     }
+    idevice_get_udid(self.device, &udid);
     self.heartbeat = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, self.timerQueue);
     dispatch_source_set_timer(self.heartbeat, DISPATCH_TIME_NOW, 0, 5LL * NSEC_PER_SEC);
     dispatch_source_set_event_handler(self.heartbeat, ^{
         plist_t ping;
         uint64_t interval = 15;
+        uint64_t start = metricsNow();
         DEBUG_PRINT("Timer run!");
         if (heartbeat_receive_with_timeout(client, &ping, (uint32_t)interval * 1000) != HEARTBEAT_E_SUCCESS) {
             DEBUG_PRINT("Did not recieve ping, canceling timer!");
+            metricsRecord(udid, kMetricsHeartbeatWait, start, 0);
             dispatch_source_cancel(self.heartbeat);
             return;
         }
+        metricsRecord(udid, kMetricsHeartbeatWait, start, 1);
         plist_get_uint_val(plist_dict_get_item(ping, "Interval"), &interval);
         DEBUG_PRINT("Set new timer interval: %llu!", interval);
         dispatch_source_set_timer(self.heartbeat, dispatch_time(DISPATCH_TIME_NOW, interval * NSEC_PER_SEC), 0, 5LL * NSEC_PER_SEC);
@@ -343,6 +409,7 @@ error:
     dispatch_source_set_cancel_handler(self.heartbeat, ^{
         DEBUG_PRINT("Timer cancel called!");
         heartbeat_client_free(client);
+        free(udid);
         self.heartbeat = nil;
         dispatch_semaphore_signal(self.timerCancelEvent);
     });
@@ -367,6 +434,7 @@ error:
     }
 }
 
+
 static NSString *plist_dict_get_nsstring(plist_t dict, const char *key) {
     plist_t *value = plist_dict_get_item(dict, key);
     if (value) {
@@ -396,18 +464,24 @@ static NSString *plist_dict_get_nsstring(plist_t dict, const char *key) {
     return ret;
 }
 
-- (BOOL)updateDeviceInfoWithError:(NSError **)error {
+- (BOOL)updateDeviceInfoOnQueueWithError:(NSError **)error {
     lockdownd_error_t err = LOCKDOWN_E_SUCCESS;
-    plist_t node = NULL;
+    __block plist_t node = NULL;
     
-    if ((err = lockdownd_get_value(self.lockdown, NULL, "DeviceName", &node)) != LOCKDOWN_E_SUCCESS) {
+    err = [self performLockdownRequest:^lockdownd_error_t(lockdownd_client_t lockdown) {
+        return lockdownd_get_value(lockdown, NULL, "DeviceName", &node);
+    }];
+    if (err != LOCKDOWN_E_SUCCESS) {
         [self createError:error withString:NSLocalizedString(@"Failed to read device name.", @"JBHostDevice") code:err];
         return NO;
     }
     self.name = [NSString stringWithUTF8String:plist_get_string_ptr(node, NULL)];
     plist_free(node);
     
-    if ((err = lockdownd_get_value(self.lockdown, NULL, "DeviceClass", &node)) != LOCKDOWN_E_SUCCESS) {
+    err = [self performLockdownRequest:^lockdownd_error_t(lockdownd_client_t lockdown) {
+        return lockdownd_get_value(lockdown, NULL, "DeviceClass", &node);
+    }];
+    if (err != LOCKDOWN_E_SUCCESS) {
         [self createError:error withString:NSLocalizedString(@"Failed to read device class.", @"JBHostDevice") code:err];
         return NO;
     }
@@ -423,340 +497,568 @@ static NSString *plist_dict_get_nsstring(plist_t dict, const char *key) {
     return YES;
 }
 
-- (NSArray<JBApp *> *)installedAppsWithError:(NSError **)error {
-    instproxy_client_t instproxy_client = NULL;
-    instproxy_error_t err = INSTPROXY_E_SUCCESS;
-    plist_t client_opts = NULL;
-    plist_t apps = NULL;
-    NSArray<JBApp *> *ret = nil;
-    
-    service_client_factory_start_service_with_lockdown(self.lockdown, self.device, INSTPROXY_SERVICE_NAME, (void**)&instproxy_client, TOOL_NAME, SERVICE_CONSTRUCTOR(instproxy_client_new), &err);
-    if (err != INSTPROXY_E_SUCCESS) {
-        [self createError:error withString:NSLocalizedString(@"Failed to start service on device. Make sure the device is connected to the network and unlocked and that the pairing is valid.", @"JBHostDevice") code:err];
-        goto end;
-    }
+- (BOOL)resetPairingOnQueueWithError:(NSError **)error {
+    lockdownd_error_t lerr = LOCKDOWN_E_SUCCESS;
     
-    client_opts = instproxy_client_options_new();
-    instproxy_client_options_add(client_opts, "ApplicationType", "Any", NULL);
-    instproxy_client_options_set_return_attributes(client_opts, "CFBundleName", "CFBundleIdentifier", "CFBundleExecutable", "Path", "Container", "iTunesArtwork", NULL);
-    if ((err = instproxy_lookup(instproxy_client, NULL, client_opts, &apps)) != INSTPROXY_E_SUCCESS) {
-        [self createError:error withString:NSLocalizedString(@"Failed to lookup installed apps.", @"JBHostDevice") code:err];
-        goto end;
+    lerr = [self performLockdownRequest:^lockdownd_error_t(lockdownd_client_t lockdown) {
+        return lockdownd_unpair(lockdown, NULL);
+    }];
+    if (lerr != LOCKDOWN_E_SUCCESS) {
+        [self createError:error withString:NSLocalizedString(@"Failed to reset pairing.", @"JBHostDevice") code:lerr];
+        return NO;
     }
     
-    ret = [self parseLookupResult:apps];
-    plist_free(apps);
-    if (ret == nil) {
-        goto end;
-    }
+    [self stopLockdownOnQueue];
+    return YES;
+}
+
+- (NSData *)exportPairingOnQueueWithError:(NSError **)error {
+    lockdownd_error_t lerr = LOCKDOWN_E_SUCCESS;
+    userpref_error_t err = USERPREF_E_SUCCESS;
+    plist_t pair_record = NULL;
+    char *plist_xml = NULL;
+    uint32_t length;
+    NSData *data = NULL;
     
-    sbservices_client_t sbs = NULL;
-    sbservices_error_t serr = SBSERVICES_E_SUCCESS;
-    service_client_factory_start_service_with_lockdown(self.lockdown, self.device, SBSERVICES_SERVICE_NAME, (void**)&sbs, TOOL_NAME, SERVICE_CONSTRUCTOR(sbservices_client_new), &err);
-    if (serr != SBSERVICES_E_SUCCESS) {
-        DEBUG_PRINT("ignoring sbservices error, no icons generated");
-        goto end;
-    }
+    assert(self.udid);
     
-    for (JBApp *app in ret) {
-        char *pngdata = NULL;
-        uint64_t pngsize = 0;
-        if (sbservices_get_icon_pngdata(sbs, app.bundleIdentifier.UTF8String, &pngdata, &pngsize) != SBSERVICES_E_SUCCESS) {
-            DEBUG_PRINT("failed to get icon for '%s'", app.bundleIdentifier.UTF8String);
-            continue;
+    if (self.isUsbDevice) {
+        lerr = [self performLockdownRequest:^lockdownd_error_t(lockdownd_client_t lockdown) {
+            return lockdownd_set_value(lockdown, "com.apple.mobile.wireless_lockdown", "EnableWifiDebugging", plist_new_bool(1));
+        }];
+        if (lerr != LOCKDOWN_E_SUCCESS) {
+            if (lerr == LOCKDOWN_E_UNKNOWN_ERROR) {
+                [self createError:error withString:NSLocalizedString(@"You must set up a passcode to enable wireless pairing.", @"JBHostDevice")];
+            } else {
+                [self createError:error withString:NSLocalizedString(@"Error setting up Wifi debugging.", @"JBHostDevice") code:lerr];
+            }
+            return nil;
         }
-        NSData *data = [NSData dataWithBytes:pngdata length:pngsize];
-        app.icon = data;
-        free(pngdata);
     }
     
-    sbservices_client_free(sbs);
-    
-end:
-    if (instproxy_client) {
-        instproxy_client_free(instproxy_client);
-    }
-    if (client_opts) {
-        instproxy_client_options_free(client_opts);
+    err = userpref_read_pair_record(self.udid.UTF8String, &pair_record);
+    if (err != USERPREF_E_SUCCESS) {
+        [self createError:error withString:NSLocalizedString(@"Failed to find pairing record.", @"JBHostDevice") code:err];
+        return nil;
     }
-    return ret;
+    plist_dict_set_item(pair_record, "UDID", plist_new_string(self.udid.UTF8String));
+    plist_to_xml(pair_record, &plist_xml, &length);
+    data = [NSData dataWithBytes:plist_xml length:length];
+    free(plist_xml);
+    plist_free(pair_record);
+    return data;
 }
 
-static ssize_t mim_upload_cb(void* buf, size_t size, void* userdata)
-{
-    return fread(buf, 1, size, (FILE*)userdata);
+#pragma mark - Service connections
+
+/**
+ * Every service connection of every device is driven by one non-blocking loop, so a long
+ * transfer (such as an image upload) never holds a thread and other operations on the same
+ * device keep making progress next to it.
+ */
+static service_loop_t shared_service_loop(void) {
+    static service_loop_t loop;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        loop = serviceLoopNew();
+        serviceLoopStart(loop);
+    });
+    return loop;
 }
 
-- (BOOL)mountImageForUrl:(NSURL *)url signatureUrl:(NSURL *)signatureUrl error:(NSError **)error {
-    mobile_image_mounter_error_t merr = MOBILE_IMAGE_MOUNTER_E_SUCCESS;
-    mobile_image_mounter_client_t mim = NULL;
-    BOOL res = NO;
-    const char *image_path = url.path.UTF8String;
-    size_t image_size = 0;
-    const char *image_sig_path = signatureUrl.path.UTF8String;
-    const char *imagetype = "Developer";
-
-    service_client_factory_start_service_with_lockdown(self.lockdown, self.device, MOBILE_IMAGE_MOUNTER_SERVICE_NAME, (void**)&mim, TOOL_NAME, SERVICE_CONSTRUCTOR(mobile_image_mounter_new), &merr);
-    if (merr != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
-        [self createError:error withString:NSLocalizedString(@"Could not connect to mobile_image_mounter!", @"JBHostDevice") code:merr];
-        return NO;
-    }
-    
-    // Check if image is already mounted
-    plist_t result = NULL;
-    BOOL needsMount = YES;
-    
-    merr = mobile_image_mounter_lookup_image(mim, imagetype, &result);
-    if (merr == MOBILE_IMAGE_MOUNTER_E_SUCCESS && result) {
-        plist_t node = plist_dict_get_item(result, "ImageSignature");
-        if (node && plist_array_get_size(node) > 0) {
-            DEBUG_PRINT("Device already has DDI mounted\n");
-            needsMount = NO;
-        }
-        
-        plist_free(result);
-    }
-    
-    if (!needsMount) {
-        // Bail out here if there's already a DDI mounted
-        res = YES;
-        goto error_out;
-    }
+static void service_loop_block(void *ctx) {
+    dispatch_block_t block = (__bridge_transfer dispatch_block_t)ctx;
+    block();
+}
 
-    struct stat fst;
-    if (stat(image_path, &fst) != 0) {
-        [self createError:error withString:NSLocalizedString(@"Cannot stat image file!", @"JBHostDevice") code:-errno];
-        goto error_out;
-    }
-    image_size = fst.st_size;
-    if (stat(image_sig_path, &fst) != 0) {
-        [self createError:error withString:NSLocalizedString(@"Cannot stat signature file!", @"JBHostDevice") code:-errno];
-        goto error_out;
-    }
+static void service_loop_run(dispatch_block_t block) {
+    serviceLoopAsync(shared_service_loop(), service_loop_block, (__bridge_retained void *)block);
+}
+
+/**
+ * Completion handlers are called on a global queue, never on the loop thread or the operation
+ * queue, so they are free to call the synchronous methods.
+ */
+static void call_completion(dispatch_block_t block) {
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), block);
+}
 
-    mobile_image_mounter_error_t err = MOBILE_IMAGE_MOUNTER_E_UNKNOWN_ERROR;
-    result = NULL;
+typedef void (^JBServiceResultHandler)(int error, const char * _Nullable message);
+typedef void (^JBServicePlistHandler)(int error, const char * _Nullable message, plist_t _Nullable reply);
+typedef void (^JBServiceIconHandler)(NSString *bundleIdentifier, NSData * _Nullable png);
 
-    char sig[8192];
-    size_t sig_length = 0;
-    FILE *f = fopen(image_sig_path, "rb");
-    if (!f) {
-        [self createError:error withString:NSLocalizedString(@"Error opening signature file.", @"JBHostDevice") code:-errno];
-        goto error_out;
-    }
-    sig_length = fread(sig, 1, sizeof(sig), f);
-    fclose(f);
-    if (sig_length == 0) {
-        [self createError:error withString:NSLocalizedString(@"Could not read signature from file.", @"JBHostDevice") code:-errno];
-        goto error_out;
-    }
+@interface JBServiceIconRequest : NSObject
+
+@property (nonatomic, copy) JBServiceIconHandler icon;
+@property (nonatomic, copy) JBServiceResultHandler done;
 
-    f = fopen(image_path, "rb");
-    if (!f) {
-        [self createError:error withString:NSLocalizedString(@"Error opening image file.", @"JBHostDevice") code:-errno];
-        goto error_out;
+@end
+
+@implementation JBServiceIconRequest
+@end
+
+static void service_result_callback(int error, const char *message, void *ctx) {
+    JBServiceResultHandler handler = (__bridge_transfer JBServiceResultHandler)ctx;
+    handler(error, message);
+}
+
+static void service_plist_callback(int error, const char *message, plist_t reply, void *ctx) {
+    JBServicePlistHandler handler = (__bridge_transfer JBServicePlistHandler)ctx;
+    handler(error, message, reply);
+}
+
+static void service_icon_callback(const char *bundle_id, const void *png, size_t length, void *ctx) {
+    JBServiceIconRequest *request = (__bridge JBServiceIconRequest *)ctx;
+    request.icon([NSString stringWithUTF8String:bundle_id], png ? [NSData dataWithBytes:png length:length] : nil);
+}
+
+static void service_icons_done_callback(int error, const char *message, void *ctx) {
+    JBServiceIconRequest *request = (__bridge_transfer JBServiceIconRequest *)ctx;
+    request.done(error, message);
+}
+
+- (NSError *)serviceError:(int)error message:(nullable const char *)message description:(NSString *)description {
+    NSString *string = description;
+    if (error == kServiceOperationDeviceLocked) {
+        string = NSLocalizedString(@"Device is locked, can't mount. Unlock device and try again.", @"JBHostDevice");
+    } else if (message) {
+        string = [NSString stringWithUTF8String:message];
     }
+    return [NSError errorWithDomain:kJBErrorDomain code:error userInfo:@{NSLocalizedDescriptionKey: string}];
+}
 
-    char *targetname = NULL;
-    if (asprintf(&targetname, "%s/%s", PKG_PATH, "staging.dimage") < 0) {
-        [self createError:error withString:NSLocalizedString(@"Out of memory!?", @"JBHostDevice")];
-        goto error_out;
+/**
+ * Starts `service_name` with lockdown and returns a socket connected to it, or -1. This is the
+ * only part of a service operation that blocks and it runs on the operation queue.
+ */
+- (int)connectService:(const char *)service_name ssl:(BOOL *)ssl error:(NSError **)error {
+    __block lockdownd_service_descriptor_t service = NULL;
+    idevice_connection_t connection = NULL;
+    lockdownd_error_t lerr = LOCKDOWN_E_SUCCESS;
+    idevice_error_t derr = IDEVICE_E_SUCCESS;
+    uint64_t start = metricsNow();
+    int fd = -1;
+    
+    lerr = [self performLockdownRequest:^lockdownd_error_t(lockdownd_client_t lockdown) {
+        return lockdownd_start_service(lockdown, service_name, &service);
+    }];
+    if (lerr != LOCKDOWN_E_SUCCESS || !service || service->port == 0) {
+        DEBUG_PRINT("Could not start service %s!", service_name);
+        [self createError:error withString:NSLocalizedString(@"Failed to start service on device. Make sure the device is connected to the network and unlocked and that the pairing is valid.", @"JBHostDevice") code:lerr];
+        goto end;
     }
-    char *mountname = NULL;
-    if (asprintf(&mountname, "%s/%s", PATH_PREFIX, targetname) < 0) {
-        [self createError:error withString:NSLocalizedString(@"Out of memory!?", @"JBHostDevice")];
-        goto error_out;
+    if ((derr = idevice_connect(self.device, service->port, &connection)) != IDEVICE_E_SUCCESS) {
+        DEBUG_PRINT("Could not connect to service %s! Port: %i, error: %i", service_name, service->port, derr);
+        [self createError:error withString:NSLocalizedString(@"Failed to connect to service on device.", @"JBHostDevice") code:derr];
+        goto end;
     }
+    // the loop owns its own copy of the socket, the connection object is not thread safe
+    if (idevice_connection_get_fd(connection, &fd) != IDEVICE_E_SUCCESS || (fd = dup(fd)) < 0) {
+        [self createError:error withString:NSLocalizedString(@"Failed to connect to service on device.", @"JBHostDevice") code:-errno];
+        fd = -1;
+    }
+    idevice_disconnect(connection);
+    *ssl = service->ssl_enabled ? YES : NO;
+    
+end:
+    metricsRecord(self.udid.UTF8String, kMetricsServiceStart, start, fd >= 0);
+    lockdownd_service_descriptor_free(service);
+    return fd;
+}
 
-    DEBUG_PRINT("Uploading %s\n", image_path);
-    err = mobile_image_mounter_upload_image(mim, imagetype, image_size, sig, sig_length, mim_upload_cb, f);
-
-    fclose(f);
+- (BOOL)readRootCertificate:(NSData **)certificate key:(NSData **)key error:(NSError **)error {
+    plist_t pair_record = NULL;
+    char *data = NULL;
+    uint64_t length = 0;
+    
+    if (userpref_read_pair_record(self.udid.UTF8String, &pair_record) != USERPREF_E_SUCCESS) {
+        [self createError:error withString:NSLocalizedString(@"Failed to find pairing record.", @"JBHostDevice")];
+        return NO;
+    }
+    plist_get_data_val(plist_dict_get_item(pair_record, USERPREF_ROOT_CERTIFICATE_KEY), &data, &length);
+    *certificate = data ? [NSData dataWithBytesNoCopy:data length:length freeWhenDone:YES] : nil;
+    data = NULL;
+    plist_get_data_val(plist_dict_get_item(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY), &data, &length);
+    *key = data ? [NSData dataWithBytesNoCopy:data length:length freeWhenDone:YES] : nil;
+    plist_free(pair_record);
+    if (!*certificate || !*key) {
+        [self createError:error withString:NSLocalizedString(@"Pairing record is missing the root certificate.", @"JBHostDevice")];
+        return NO;
+    }
+    return YES;
+}
 
-    if (err != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
-        if (err == MOBILE_IMAGE_MOUNTER_E_DEVICE_LOCKED) {
-            [self createError:error withString:NSLocalizedString(@"Device is locked, can't mount. Unlock device and try again.", @"JBHostDevice") code:err];
-        } else {
-            [self createError:error withString:NSLocalizedString(@"Unknown error occurred, can't mount.", @"JBHostDevice") code:err];
+/**
+ * Connects to `service_name` on the operation queue and then calls `start` on the loop thread
+ * with the connection, which `start` must close when it is done. Only the short setup holds up
+ * the queue, the operation itself can take as long as it needs.
+ */
+- (void)startService:(const char *)service_name failure:(JBHostDeviceCompletionHandler)failure start:(void (^)(service_connection_t conn))start {
+    dispatch_async(self.operationQueue, ^{
+        NSError *error = nil;
+        NSData *certificate = nil;
+        NSData *key = nil;
+        BOOL ssl = NO;
+        int fd = [self connectService:service_name ssl:&ssl error:&error];
+        if (fd < 0) {
+            call_completion(^{ failure(error); });
+            return;
         }
-        goto error_out;
-    }
-    DEBUG_PRINT("done.\n");
-
-    DEBUG_PRINT("Mounting...\n");
-    err = mobile_image_mounter_mount_image(mim, mountname, sig, sig_length, imagetype, &result);
-    if (err == MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
-        if (result) {
-            plist_t node = plist_dict_get_item(result, "Status");
-            if (node) {
-                char *status = NULL;
-                plist_get_string_val(node, &status);
-                if (status) {
-                    if (!strcmp(status, "Complete")) {
-                        DEBUG_PRINT("Done.\n");
-                        res = YES;
-                    } else {
-                        DEBUG_PRINT("unexpected status value:\n");
-                        plist_print_to_stream(result, stderr);
-                    }
-                    free(status);
-                } else {
-                    DEBUG_PRINT("unexpected result:\n");
-                    plist_print_to_stream(result, stderr);
-                }
+        if (ssl && ![self readRootCertificate:&certificate key:&key error:&error]) {
+            close(fd);
+            call_completion(^{ failure(error); });
+            return;
+        }
+        service_loop_run(^{
+            service_connection_t conn = serviceConnectionNew(shared_service_loop(), fd);
+            serviceConnectionSetTimeout(conn, kServiceTimeoutMs);
+            if (ssl) {
+                serviceConnectionStartTLS(conn, certificate.bytes, certificate.length, key.bytes, key.length, NULL, NULL);
             }
-            node = plist_dict_get_item(result, "Error");
-            if (node) {
-                char *errstr = NULL;
-                plist_get_string_val(node, &errstr);
-                if (error) {
-                    DEBUG_PRINT("Error: %s\n", errstr);
-                    [self createError:error withString:[NSString stringWithUTF8String:errstr]];
-                    free(errstr);
-                } else {
-                    DEBUG_PRINT("unexpected result:\n");
-                    plist_print_to_stream(result, stderr);
-                }
+            start(conn);
+        });
+    });
+}
 
-            } else {
-                plist_print_to_stream(result, stderr);
-            }
+- (void)fetchIconsForApps:(NSArray<JBApp *> *)apps completion:(dispatch_block_t)completion {
+    NSString *host = self.identifier;
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_queue_t storeQueue = dispatch_get_global_queue(QOS_CLASS_UTILITY, 0);
+    
+    [self startService:SBSERVICES_SERVICE_NAME failure:^(NSError *error) {
+        DEBUG_PRINT("ignoring sbservices error, no icons generated");
+        completion();
+    } start:^(service_connection_t conn) {
+        NSMutableDictionary<NSString *, JBApp *> *appsByIdentifier = [NSMutableDictionary dictionaryWithCapacity:apps.count];
+        const char **bundleIds = calloc(apps.count ? apps.count : 1, sizeof(char *));
+        size_t count = 0;
+        for (JBApp *app in apps) {
+            appsByIdentifier[app.bundleIdentifier] = app;
+            bundleIds[count++] = app.bundleIdentifier.UTF8String;
         }
-    } else {
-        [self createError:error withString:NSLocalizedString(@"Mount image failed.", @"JBHostDevice") code:err];
-    }
+        JBServiceIconRequest *request = [JBServiceIconRequest new];
+        request.icon = ^(NSString *bundleIdentifier, NSData *png) {
+            JBApp *app = appsByIdentifier[bundleIdentifier];
+            if (!png) {
+                DEBUG_PRINT("failed to get icon for '%s'", bundleIdentifier.UTF8String);
+                return;
+            }
+            // keep disk writes off the loop
+            dispatch_group_async(group, storeQueue, ^{
+                app.iconKey = [JBIconCache.sharedCache storeIconData:png forHost:host bundleIdentifier:bundleIdentifier];
+            });
+        };
+        request.done = ^(int error, const char *message) {
+            serviceConnectionClose(conn);
+            dispatch_group_notify(group, storeQueue, ^{
+                // drop icons of apps that were uninstalled since the last lookup
+                [JBIconCache.sharedCache removeIconsForHost:host exceptBundleIdentifiers:[NSSet setWithArray:appsByIdentifier.allKeys]];
+                completion();
+            });
+        };
+        sbservicesGetIconsAsync(conn, bundleIds, count, service_icon_callback, service_icons_done_callback, (__bridge_retained void *)request);
+        free(bundleIds);
+    }];
+}
 
-    if (result) {
-        plist_free(result);
-    }
+#pragma mark - Asynchronous operations
 
-error_out:
-    /* perform hangup command */
-    mobile_image_mounter_hangup(mim);
-    /* free client */
-    mobile_image_mounter_free(mim);
+- (void)startLockdownWithPairingUrl:(NSURL *)url completion:(JBHostDeviceCompletionHandler)completion {
+    [self startLockdownWithPairingUrl:url udid:nil completion:completion];
+}
 
-    return res;
+- (void)startLockdownWithPairingUrl:(NSURL *)url udid:(NSString *)udid completion:(JBHostDeviceCompletionHandler)completion {
+    dispatch_barrier_async(self.operationQueue, ^{
+        NSError *error = nil;
+        BOOL success = [self startLockdownOnQueueWithPairingUrl:url udid:udid error:&error];
+        call_completion(^{ completion(success ? nil : error); });
+    });
 }
 
-- (BOOL)launchApplication:(JBApp *)application error:(NSError **)error {
-    int res = NO;
-    debugserver_client_t debugserver_client = NULL;
-    char* response = NULL;
-    debugserver_command_t command = NULL;
-    debugserver_error_t dres = DEBUGSERVER_E_UNKNOWN_ERROR;
-    
-    /* start and connect to debugserver */
-    service_client_factory_start_service_with_lockdown(self.lockdown, self.device, DEBUGSERVER_SECURE_SERVICE_NAME, (void**)&debugserver_client, TOOL_NAME, SERVICE_CONSTRUCTOR(debugserver_client_new), &dres);
-    if (dres != DEBUGSERVER_E_SUCCESS) {
-        [self createError:error withString:NSLocalizedString(@"Failed to start debugserver. Make sure DeveloperDiskImage.dmg is mounted.", @"JBHostDevice") code:kJBHostImageNotMounted];
-        goto cleanup;
-    }
-    
-    /* set arguments and run app */
-    DEBUG_PRINT("Setting argv...");
-    int app_argc = 1;
-    const char *app_argv[] = { application.executablePath.UTF8String, NULL };
-    DEBUG_PRINT("app_argv[%d] = %s", 0, app_argv[0]);
-    debugserver_client_set_argv(debugserver_client, app_argc, (char **)app_argv, NULL);
-    
-    /* check if launch succeeded */
-    DEBUG_PRINT("Checking if launch succeeded...");
-    debugserver_command_new("qLaunchSuccess", 0, NULL, &command);
-    dres = debugserver_client_send_command(debugserver_client, command, &response, NULL);
-    debugserver_command_free(command);
-    command = NULL;
-    if (response) {
-        if (strncmp(response, "OK", 2)) {
-            [self createError:error withString:[NSString stringWithUTF8String:&response[1]]];
-            goto cleanup;
-        }
-        free(response);
-        response = NULL;
-    }
+- (void)startLockdownWithCompletion:(JBHostDeviceCompletionHandler)completion {
+    dispatch_barrier_async(self.operationQueue, ^{
+        NSError *error = nil;
+        BOOL success = [self startLockdownOnQueueWithError:&error];
+        call_completion(^{ completion(success ? nil : error); });
+    });
+}
 
-    /* continue running process */
-    DEBUG_PRINT("Continue running process...");
-    debugserver_command_new("c", 0, NULL, &command);
-    dres = debugserver_client_send_command(debugserver_client, command, NULL, NULL);
-    debugserver_command_free(command);
-    
-    DEBUG_PRINT("Getting threads info...");
-    char three = 3;
-    debugserver_client_send(debugserver_client, &three, sizeof(three), NULL);
-    debugserver_command_new("jThreadsInfo", 0, NULL, &command);
-    dres = debugserver_client_send_command(debugserver_client, command, NULL, NULL);
-    debugserver_command_free(command);
-    
-    DEBUG_PRINT("Detaching from app...");
-    debugserver_command_new("D", 0, NULL, &command);
-    dres = debugserver_client_send_command(debugserver_client, command, NULL, NULL);
-    debugserver_command_free(command);
+- (void)stopLockdownWithCompletion:(dispatch_block_t)completion {
+    dispatch_barrier_async(self.operationQueue, ^{
+        [self stopLockdownOnQueue];
+        call_completion(completion);
+    });
+}
 
-    res = (dres == DEBUGSERVER_E_SUCCESS) ? YES : NO;
-    if (!res) {
-        [self createError:error withString:NSLocalizedString(@"Failed to start application.", @"JBHostDevice") code:dres];
-    }
-    
-cleanup:
-    /* cleanup the house */
+- (void)updateDeviceInfoWithCompletion:(JBHostDeviceCompletionHandler)completion {
+    dispatch_async(self.operationQueue, ^{
+        NSError *error = nil;
+        BOOL success = [self updateDeviceInfoOnQueueWithError:&error];
+        call_completion(^{ completion(success ? nil : error); });
+    });
+}
 
-    if (response)
-        free(response);
+- (void)resetPairingWithCompletion:(JBHostDeviceCompletionHandler)completion {
+    dispatch_barrier_async(self.operationQueue, ^{
+        NSError *error = nil;
+        BOOL success = [self resetPairingOnQueueWithError:&error];
+        call_completion(^{ completion(success ? nil : error); });
+    });
+}
 
-    if (debugserver_client)
-        debugserver_client_free(debugserver_client);
+- (void)exportPairingWithCompletion:(JBHostDeviceDataCompletionHandler)completion {
+    dispatch_async(self.operationQueue, ^{
+        NSError *error = nil;
+        NSData *data = [self exportPairingOnQueueWithError:&error];
+        call_completion(^{ completion(data, data ? nil : error); });
+    });
+}
 
-    return res;
+- (void)installedAppsWithCompletion:(JBHostDeviceAppsCompletionHandler)completion {
+    [self startService:INSTPROXY_SERVICE_NAME failure:^(NSError *error) {
+        completion(nil, error);
+    } start:^(service_connection_t conn) {
+        plist_t client_opts = instproxy_client_options_new();
+        instproxy_client_options_add(client_opts, "ApplicationType", "Any", NULL);
+        instproxy_client_options_set_return_attributes(client_opts, "CFBundleName", "CFBundleIdentifier", "CFBundleExecutable", "Path", "Container", NULL);
+        JBServicePlistHandler handler = ^(int error, const char *message, plist_t reply) {
+            serviceConnectionClose(conn);
+            if (error) {
+                NSError *err = [self serviceError:error message:message description:NSLocalizedString(@"Failed to lookup installed apps.", @"JBHostDevice")];
+                call_completion(^{ completion(nil, err); });
+                return;
+            }
+            NSArray<JBApp *> *apps = [self parseLookupResult:reply];
+            [self fetchIconsForApps:apps completion:^{
+                completion(apps, nil);
+            }];
+        };
+        instproxyLookupAsync(conn, client_opts, service_plist_callback, (__bridge_retained void *)handler);
+        instproxy_client_options_free(client_opts);
+    }];
 }
 
-- (BOOL)resetPairingWithError:(NSError **)error {
-    lockdownd_error_t lerr = LOCKDOWN_E_SUCCESS;
+- (void)mountImageForUrl:(NSURL *)url signatureUrl:(NSURL *)signatureUrl completion:(JBHostDeviceCompletionHandler)completion {
+    NSError *error = nil;
+    NSData *signature = [NSData dataWithContentsOfURL:signatureUrl options:0 error:&error];
     
-    assert(self.lockdown);
-    lerr = lockdownd_unpair(self.lockdown, NULL);
-    if (lerr != LOCKDOWN_E_SUCCESS) {
-        [self createError:error withString:NSLocalizedString(@"Failed to reset pairing.", @"JBHostDevice") code:lerr];
-        return NO;
+    if (!signature) {
+        call_completion(^{ completion(error); });
+        return;
     }
+    [self mountImageForUrl:url signature:signature completion:completion];
+}
+
+/**
+ * Copies the image file into `pipeFd` on its own queue so the loop thread never waits on the disk.
+ * The loop closes the other end when the mount finishes, which ends the copy early if the device
+ * did not need the image.
+ */
+- (void)feedImage:(int)image toPipe:(int)pipeFd {
+    dispatch_queue_t readerQueue = dispatch_queue_create("imageReaderQueue", DISPATCH_QUEUE_SERIAL);
     
-    [self stopLockdown];
-    return YES;
+#ifdef F_SETNOSIGPIPE
+    fcntl(pipeFd, F_SETNOSIGPIPE, 1);
+#endif
+    dispatch_async(readerQueue, ^{
+        char *buf = malloc(kImageReadChunk);
+        ssize_t length = 0;
+        
+        while (buf && (length = read(image, buf, kImageReadChunk)) > 0) {
+            ssize_t offset = 0;
+            while (offset < length) {
+                ssize_t written = write(pipeFd, buf + offset, length - offset);
+                if (written <= 0) {
+                    DEBUG_PRINT("image upload stopped reading: %s", strerror(errno));
+                    goto done;
+                }
+                offset += written;
+            }
+        }
+        if (length < 0) {
+            DEBUG_PRINT("failed to read image: %s", strerror(errno));
+        }
+    done:
+        free(buf);
+        close(image);
+        close(pipeFd);
+    });
 }
 
-- (NSData *)exportPairingWithError:(NSError **)error {
-    lockdownd_error_t lerr = LOCKDOWN_E_SUCCESS;
-    userpref_error_t err = USERPREF_E_SUCCESS;
-    plist_t pair_record = NULL;
-    char *plist_xml = NULL;
-    uint32_t length;
-    NSData *data = NULL;
+- (void)mountImageForUrl:(NSURL *)url signature:(NSData *)signature completion:(JBHostDeviceCompletionHandler)completion {
+    NSString *udid = self.udid;
     
-    assert(self.udid);
-    assert(self.lockdown);
+    // a multi-GB image on a slow disk must not hold up the loop thread shared by all devices
+    dispatch_async(self.operationQueue, ^{
+        NSError *error = nil;
+        struct stat fst;
+        int image = -1;
+        uint64_t imageSize = 0;
+        
+        if (signature.length == 0) {
+            [self createError:&error withString:NSLocalizedString(@"Could not read signature from file.", @"JBHostDevice")];
+            call_completion(^{ completion(error); });
+            return;
+        }
+        if ((image = open(url.path.UTF8String, O_RDONLY)) < 0) {
+            [self createError:&error withString:NSLocalizedString(@"Error opening image file.", @"JBHostDevice") code:-errno];
+            call_completion(^{ completion(error); });
+            return;
+        }
+        if (fstat(image, &fst) != 0) {
+            [self createError:&error withString:NSLocalizedString(@"Cannot stat image file!", @"JBHostDevice") code:-errno];
+            close(image);
+            call_completion(^{ completion(error); });
+            return;
+        }
+        imageSize = (uint64_t)fst.st_size;
+        
+        [self startService:MOBILE_IMAGE_MOUNTER_SERVICE_NAME failure:^(NSError *error) {
+            close(image);
+            completion([NSError errorWithDomain:kJBErrorDomain code:error.code userInfo:@{NSLocalizedDescriptionKey: NSLocalizedString(@"Could not connect to mobile_image_mounter!", @"JBHostDevice")}]);
+        } start:^(service_connection_t conn) {
+            NSError *error = nil;
+            int fds[2];
+            char *mountname = NULL;
+            JBServiceResultHandler handler = nil;
+            
+            if (pipe(fds) != 0) {
+                [self createError:&error withString:NSLocalizedString(@"Error opening image file.", @"JBHostDevice") code:-errno];
+                close(image);
+                serviceConnectionClose(conn);
+                call_completion(^{ completion(error); });
+                return;
+            }
+            if (asprintf(&mountname, "%s/%s/%s", PATH_PREFIX, PKG_PATH, "staging.dimage") < 0) {
+                [self createError:&error withString:NSLocalizedString(@"Out of memory!?", @"JBHostDevice")];
+                close(image);
+                close(fds[0]);
+                close(fds[1]);
+                serviceConnectionClose(conn);
+                call_completion(^{ completion(error); });
+                return;
+            }
+            
+            DEBUG_PRINT("Uploading %s\n", url.path.UTF8String);
+            [self feedImage:image toPipe:fds[1]];
+            handler = ^(int err, const char *message) {
+                NSError *mountError = nil;
+                serviceConnectionClose(conn);
+                if (err) {
+                    mountError = [self serviceError:err message:message description:NSLocalizedString(@"Unknown error occurred, can't mount.", @"JBHostDevice")];
+                } else {
+                    DEBUG_PRINT("Done.\n");
+                }
+                call_completion(^{ completion(mountError); });
+            };
+            imageMounterMountAsync(conn, udid.UTF8String, "Developer", fds[0], imageSize, signature.bytes, signature.length, mountname, service_result_callback, (__bridge_retained void *)handler);
+            free(mountname);
+        }];
+    });
+}
+
+- (void)launchApplication:(JBApp *)application completion:(JBHostDeviceCompletionHandler)completion {
+    NSString *udid = self.udid;
+    NSString *executablePath = application.executablePath;
+    uint64_t start = metricsNow();
     
-    if (self.isUsbDevice) {
-        lerr = lockdownd_set_value(self.lockdown, "com.apple.mobile.wireless_lockdown", "EnableWifiDebugging", plist_new_bool(1));
-        if (lerr != LOCKDOWN_E_SUCCESS) {
-            if (lerr == LOCKDOWN_E_UNKNOWN_ERROR) {
-                [self createError:error withString:NSLocalizedString(@"You must set up a passcode to enable wireless pairing.", @"JBHostDevice")];
-            } else {
-                [self createError:error withString:NSLocalizedString(@"Error setting up Wifi debugging.", @"JBHostDevice") code:lerr];
+    [self startService:DEBUGSERVER_SECURE_SERVICE_NAME failure:^(NSError *error) {
+        metricsRecord(udid.UTF8String, kMetricsAppLaunch, start, 0);
+        completion([NSError errorWithDomain:kJBErrorDomain code:kJBHostImageNotMounted userInfo:@{NSLocalizedDescriptionKey: NSLocalizedString(@"Failed to start debugserver. Make sure DeveloperDiskImage.dmg is mounted.", @"JBHostDevice")}]);
+    } start:^(service_connection_t conn) {
+        DEBUG_PRINT("Launching %s", executablePath.UTF8String);
+        JBServiceResultHandler handler = ^(int error, const char *message) {
+            NSError *launchError = nil;
+            serviceConnectionClose(conn);
+            metricsRecord(udid.UTF8String, kMetricsAppLaunch, start, error == 0);
+            if (error) {
+                // debugserver errors are "E" followed by the message
+                launchError = [self serviceError:error message:(message && message[0] == 'E' ? &message[1] : message) description:NSLocalizedString(@"Failed to start application.", @"JBHostDevice")];
             }
-            return nil;
-        }
-    }
+            call_completion(^{ completion(launchError); });
+        };
+        debugserverLaunchAsync(conn, executablePath.UTF8String, service_result_callback, (__bridge_retained void *)handler);
+    }];
+}
+
+#pragma mark - Synchronous operations
+
+- (BOOL)waitForOperation:(void (^)(JBHostDeviceCompletionHandler completion))operation error:(NSError **)error {
+    __block NSError *operationError = nil;
+    dispatch_semaphore_t done = dispatch_semaphore_create(0);
     
-    err = userpref_read_pair_record(self.udid.UTF8String, &pair_record);
-    if (err != USERPREF_E_SUCCESS) {
-        [self createError:error withString:NSLocalizedString(@"Failed to find pairing record.", @"JBHostDevice") code:err];
-        return nil;
+    operation(^(NSError *err) {
+        operationError = err;
+        dispatch_semaphore_signal(done);
+    });
+    dispatch_semaphore_wait(done, DISPATCH_TIME_FOREVER);
+    if (operationError && error) {
+        *error = operationError;
     }
-    plist_dict_set_item(pair_record, "UDID", plist_new_string(self.udid.UTF8String));
-    plist_to_xml(pair_record, &plist_xml, &length);
-    data = [NSData dataWithBytes:plist_xml length:length];
-    free(plist_xml);
-    plist_free(pair_record);
+    return operationError == nil;
+}
+
+- (BOOL)startLockdownWithPairingUrl:(NSURL *)url error:(NSError **)error {
+    return [self waitForOperation:^(JBHostDeviceCompletionHandler completion) {
+        [self startLockdownWithPairingUrl:url completion:completion];
+    } error:error];
+}
+
+- (BOOL)startLockdownWithError:(NSError **)error {
+    return [self waitForOperation:^(JBHostDeviceCompletionHandler completion) {
+        [self startLockdownWithCompletion:completion];
+    } error:error];
+}
+
+- (void)stopLockdown {
+    dispatch_barrier_sync(self.operationQueue, ^{
+        [self stopLockdownOnQueue];
+    });
+}
+
+- (BOOL)updateDeviceInfoWithError:(NSError **)error {
+    return [self waitForOperation:^(JBHostDeviceCompletionHandler completion) {
+        [self updateDeviceInfoWithCompletion:completion];
+    } error:error];
+}
+
+- (NSArray<JBApp *> *)installedAppsWithError:(NSError **)error {
+    __block NSArray<JBApp *> *apps = nil;
+    [self waitForOperation:^(JBHostDeviceCompletionHandler completion) {
+        [self installedAppsWithCompletion:^(NSArray<JBApp *> *result, NSError *err) {
+            apps = result;
+            completion(err);
+        }];
+    } error:error];
+    return apps;
+}
+
+- (BOOL)mountImageForUrl:(NSURL *)url signatureUrl:(NSURL *)signatureUrl error:(NSError **)error {
+    return [self waitForOperation:^(JBHostDeviceCompletionHandler completion) {
+        [self mountImageForUrl:url signatureUrl:signatureUrl completion:completion];
+    } error:error];
+}
+
+- (BOOL)launchApplication:(JBApp *)application error:(NSError **)error {
+    return [self waitForOperation:^(JBHostDeviceCompletionHandler completion) {
+        [self launchApplication:application completion:completion];
+    } error:error];
+}
+
+- (BOOL)resetPairingWithError:(NSError **)error {
+    return [self waitForOperation:^(JBHostDeviceCompletionHandler completion) {
+        [self resetPairingWithCompletion:completion];
+    } error:error];
+}
+
+- (NSData *)exportPairingWithError:(NSError **)error {
+    __block NSData *data = nil;
+    [self waitForOperation:^(JBHostDeviceCompletionHandler completion) {
+        [self exportPairingWithCompletion:^(NSData *result, NSError *err) {
+            data = result;
+            completion(err);
+        }];
+    } error:error];
     return data;
 }
 
@@ -0,0 +1,53 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <Foundation/Foundation.h>
+#import <CoreGraphics/CoreGraphics.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+/**
+ * Keeps app icons as compressed PNG files on disk and a bounded set of
+ * decoded, downsampled thumbnails in memory. Thumbnails are decoded in the
+ * background on first access and the least recently used ones are evicted once
+ * the decoded total goes over `byteBudget` or when the system is low on memory.
+ * The files, budget and LRU list are kept by IconStore.c, this adds the
+ * ImageIO decode and main queue completions.
+ */
+@interface JBIconCache : NSObject
+
+@property (class, nonatomic, readonly) JBIconCache *sharedCache;
+@property (nonatomic) NSUInteger byteBudget;
+@property (nonatomic) NSUInteger thumbnailPixelSize;
+@property (nonatomic, readonly) NSUInteger currentBytes;
+@property (nonatomic, readonly) NSUInteger hits;
+@property (nonatomic, readonly) NSUInteger misses;
+
+- (instancetype)init NS_UNAVAILABLE;
+- (instancetype)initWithDirectory:(NSURL *)directory NS_DESIGNATED_INITIALIZER;
+
+- (nullable NSString *)storeIconData:(NSData *)data forHost:(NSString *)host bundleIdentifier:(NSString *)bundleIdentifier;
+/// Returns the thumbnail only if it is already decoded, never touches the disk.
+- (nullable CGImageRef)cachedThumbnailForKey:(NSString *)key CF_RETURNS_NOT_RETAINED;
+/// Decodes the thumbnail in the background if needed, `completion` is called on the main queue.
+- (void)loadThumbnailForKey:(NSString *)key completion:(void (^)(CGImageRef _Nullable image))completion;
+/// Deletes the icon files of `host` except for the listed apps, or all of them if `bundleIdentifiers` is nil. Performs file I/O.
+- (void)removeIconsForHost:(NSString *)host exceptBundleIdentifiers:(nullable NSSet<NSString *> *)bundleIdentifiers;
+- (void)removeAllThumbnails;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,208 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#import <ImageIO/ImageIO.h>
+#import "JBIconCache.h"
+#import "IconStore.h"
+#import "Jitterbug.h"
+
+static const NSUInteger kDefaultByteBudget = 8 * 1024 * 1024;
+static const NSUInteger kDefaultThumbnailPixelSize = 96;
+
+#pragma mark - Store callbacks
+
+static void *create_thumbnail(const char *path, unsigned int pixel_size, size_t *cost, void *ctx) {
+    CFURLRef url = CFURLCreateFromFileSystemRepresentation(kCFAllocatorDefault, (const UInt8 *)path, strlen(path), false);
+    CGImageSourceRef source = CGImageSourceCreateWithURL(url, NULL);
+    CFRelease(url);
+    if (!source) {
+        return NULL;
+    }
+    NSDictionary *options = @{
+        (__bridge NSString *)kCGImageSourceCreateThumbnailFromImageAlways: @YES,
+        (__bridge NSString *)kCGImageSourceCreateThumbnailWithTransform: @YES,
+        (__bridge NSString *)kCGImageSourceShouldCacheImmediately: @YES,
+        (__bridge NSString *)kCGImageSourceThumbnailMaxPixelSize: @(pixel_size),
+    };
+    CGImageRef image = CGImageSourceCreateThumbnailAtIndex(source, 0, (__bridge CFDictionaryRef)options);
+    CFRelease(source);
+    if (image) {
+        *cost = CGImageGetBytesPerRow(image) * CGImageGetHeight(image);
+    }
+    return (void *)image;
+}
+
+static void retain_thumbnail(void *image, void *ctx) {
+    CGImageRetain((CGImageRef)image);
+}
+
+static void release_thumbnail(void *image, void *ctx) {
+    CGImageRelease((CGImageRef)image);
+}
+
+@interface JBIconCache ()
+
+@property (nonatomic) icon_store_t store;
+@property (nonatomic) dispatch_queue_t queue;
+@property (nonatomic) dispatch_source_t memoryPressure;
+@property (nonatomic) NSMutableDictionary<NSString *, NSMutableArray *> *pendingLoads;
+
+@end
+
+@implementation JBIconCache
+
+#pragma mark - Properties and initializers
+
++ (JBIconCache *)sharedCache {
+    static JBIconCache *cache;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        NSURL *caches = [NSFileManager.defaultManager URLsForDirectory:NSCachesDirectory inDomains:NSUserDomainMask][0];
+        cache = [[JBIconCache alloc] initWithDirectory:[caches URLByAppendingPathComponent:@"Icons" isDirectory:YES]];
+    });
+    return cache;
+}
+
+- (instancetype)initWithDirectory:(NSURL *)directory {
+    if (self = [super init]) {
+        self.store = iconStoreNew(directory.fileSystemRepresentation, create_thumbnail, retain_thumbnail, release_thumbnail, NULL);
+        self.queue = dispatch_queue_create("com.osy86.Jitterbug.IconCache", DISPATCH_QUEUE_SERIAL);
+        self.pendingLoads = [NSMutableDictionary dictionary];
+        iconStoreSetByteBudget(self.store, kDefaultByteBudget);
+        iconStoreSetThumbnailPixelSize(self.store, kDefaultThumbnailPixelSize);
+        self.memoryPressure = dispatch_source_create(DISPATCH_SOURCE_TYPE_MEMORYPRESSURE, 0, DISPATCH_MEMORYPRESSURE_WARN | DISPATCH_MEMORYPRESSURE_CRITICAL, self.queue);
+        __weak JBIconCache *weakSelf = self;
+        dispatch_source_set_event_handler(self.memoryPressure, ^{
+            JBIconCache *cache = weakSelf;
+            if (!cache) {
+                return;
+            }
+            unsigned long level = dispatch_source_get_data(cache.memoryPressure);
+            icon_store_stats_t stats;
+            iconStoreGetStats(cache.store, &stats);
+            DEBUG_PRINT("memory pressure %lu, trimming %lu bytes of icons (%lu hits, %lu misses)", level, (unsigned long)stats.current_bytes, stats.hits, stats.misses);
+            iconStoreTrim(cache.store, (level & DISPATCH_MEMORYPRESSURE_CRITICAL) ? 0 : stats.current_bytes / 2);
+        });
+        dispatch_resume(self.memoryPressure);
+    }
+    return self;
+}
+
+- (void)dealloc {
+    dispatch_source_cancel(self.memoryPressure);
+    iconStoreFree(self.store);
+}
+
+- (NSUInteger)byteBudget {
+    return iconStoreGetByteBudget(self.store);
+}
+
+- (void)setByteBudget:(NSUInteger)byteBudget {
+    iconStoreSetByteBudget(self.store, byteBudget);
+}
+
+- (NSUInteger)thumbnailPixelSize {
+    return iconStoreGetThumbnailPixelSize(self.store);
+}
+
+- (void)setThumbnailPixelSize:(NSUInteger)thumbnailPixelSize {
+    iconStoreSetThumbnailPixelSize(self.store, (unsigned int)thumbnailPixelSize);
+}
+
+- (NSUInteger)currentBytes {
+    icon_store_stats_t stats;
+    iconStoreGetStats(self.store, &stats);
+    return stats.current_bytes;
+}
+
+- (NSUInteger)hits {
+    icon_store_stats_t stats;
+    iconStoreGetStats(self.store, &stats);
+    return stats.hits;
+}
+
+- (NSUInteger)misses {
+    icon_store_stats_t stats;
+    iconStoreGetStats(self.store, &stats);
+    return stats.misses;
+}
+
+#pragma mark - Icons
+
+- (nullable NSString *)storeIconData:(NSData *)data forHost:(NSString *)host bundleIdentifier:(NSString *)bundleIdentifier {
+    char *key = NULL;
+    if (iconStoreStoreIcon(self.store, host.UTF8String, bundleIdentifier.UTF8String, data.bytes, data.length, &key) < 0) {
+        return nil;
+    }
+    NSString *result = [NSString stringWithUTF8String:key];
+    free(key);
+    return result;
+}
+
+- (nullable CGImageRef)cachedThumbnailForKey:(NSString *)key {
+    CGImageRef image = iconStoreCopyCachedThumbnail(self.store, key.UTF8String);
+    return image ? (CGImageRef)CFAutorelease(image) : NULL;
+}
+
+- (void)loadThumbnailForKey:(NSString *)key completion:(void (^)(CGImageRef _Nullable image))completion {
+    dispatch_async(self.queue, ^{
+        CGImageRef image = iconStoreCopyCachedThumbnail(self.store, key.UTF8String);
+        if (image) {
+            dispatch_async(dispatch_get_main_queue(), ^{
+                completion(image);
+                CGImageRelease(image);
+            });
+            return;
+        }
+        // several views may ask for the same icon, decode it only once
+        NSMutableArray *pending = self.pendingLoads[key];
+        if (pending) {
+            [pending addObject:completion];
+            return;
+        }
+        self.pendingLoads[key] = [NSMutableArray arrayWithObject:completion];
+        // decode outside the queue so other lookups are not blocked
+        dispatch_async(dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+            CGImageRef image = iconStoreLoadThumbnail(self.store, key.UTF8String);
+            dispatch_async(self.queue, ^{
+                NSArray *completions = self.pendingLoads[key];
+                [self.pendingLoads removeObjectForKey:key];
+                dispatch_async(dispatch_get_main_queue(), ^{
+                    for (void (^callback)(CGImageRef) in completions) {
+                        callback(image);
+                    }
+                    CGImageRelease(image);
+                });
+            });
+        });
+    });
+}
+
+- (void)removeIconsForHost:(NSString *)host exceptBundleIdentifiers:(nullable NSSet<NSString *> *)bundleIdentifiers {
+    NSArray<NSString *> *keep = bundleIdentifiers.allObjects;
+    const char **names = keep ? calloc(keep.count + 1, sizeof(char *)) : NULL;
+    for (NSUInteger i = 0; i < keep.count; i++) {
+        names[i] = keep[i].UTF8String;
+    }
+    iconStoreRemoveHost(self.store, host.UTF8String, names, keep.count);
+    free(names);
+}
+
+- (void)removeAllThumbnails {
+    iconStoreTrim(self.store, 0);
+}
+
+@end
@@ -19,10 +19,13 @@
 
 #import <TargetConditionals.h>
 #import "JBHostDevice.h"
+#import "JBIconCache.h"
 #if TARGET_OS_OSX
 #import "JBHostFinder.h"
 #import "JBHostFinderDelegate.h"
 #endif
 #import "AddressUtils.h"
+#import "DirectoryIndex.h"
+#import "Metrics.h"
 
 #endif /* Jitterbug_Bridging_Header_h */
@@ -62,6 +62,18 @@ class Main: NSObject, ObservableObject {
         documentsURL.appendingPathComponent("SupportImages", isDirectory: true)
     }
     
+    private var indexesURL: URL {
+        fileManager.urls(for: .cachesDirectory, in: .userDomainMask)[0].appendingPathComponent("Indexes", isDirectory: true)
+    }
+    
+    private lazy var pairingsIndex = DirectoryIndex(directory: pairingsURL, indexURL: indexesURL.appendingPathComponent("Pairings.index"), parse: Main.parsePairing)
+    
+    private lazy var supportImagesIndex = DirectoryIndex(directory: supportImagesURL, indexURL: indexesURL.appendingPathComponent("SupportImages.index"), parse: Main.parseSupportImage)
+    
+    private var metricsURL: URL {
+        documentsURL.appendingPathComponent("metrics.prom")
+    }
+    
     var tunnelDeviceIp: String {
         UserDefaults.standard.string(forKey: "TunnelDeviceIP") ?? "10.8.0.1"
     }
@@ -81,8 +93,16 @@ class Main: NSObject, ObservableObject {
     override init() {
         super.init()
         hostFinder.delegate = self
+        pairings = pairingsIndex.files
+        supportImages = supportImagesIndex.files
         refreshPairings()
         refreshSupportImages()
+        pairingsIndex.startWatching { files in
+            self.pairings = files
+        }
+        supportImagesIndex.startWatching { files in
+            self.supportImages = files
+        }
         unarchiveSavedHosts()
         #if WITH_VPN
         initTunnel()
@@ -102,6 +122,7 @@ class Main: NSObject, ObservableObject {
                     #if canImport(UIKit)
                     app.endBackgroundTask(bgtask)
                     #endif
+                    metricsWriteToFile(self.metricsURL.path)
                     DispatchQueue.main.async {
                         self.busy = false
                         self.busyMessage = nil
@@ -119,9 +140,38 @@ class Main: NSObject, ObservableObject {
         }
     }
     
+    /// Like `backgroundTask` for device operations that call back when they finish.
+    /// `task` must call `done` exactly once, from any thread.
+    func deviceTask(message: String?, task: @escaping (_ done: @escaping (Error?) -> Void) -> Void, onComplete: @escaping () -> Void = {}) {
+        DispatchQueue.main.async {
+            self.busy = true
+            self.busyMessage = message
+            #if canImport(UIKit)
+            let app = UIApplication.shared
+            let bgtask = app.beginBackgroundTask()
+            #endif
+            task { error in
+                DispatchQueue.main.async {
+                    #if canImport(UIKit)
+                    app.endBackgroundTask(bgtask)
+                    #endif
+                    if let error = error {
+                        self.alertMessage = error.localizedDescription
+                    }
+                    self.busy = false
+                    self.busyMessage = nil
+                    onComplete()
+                }
+                DispatchQueue.global(qos: .background).async {
+                    metricsWriteToFile(self.metricsURL.path)
+                }
+            }
+        }
+    }
+    
     // MARK: - File management
     
-    private func importFile(_ file: URL, toDirectory: URL, onComplete: @escaping () -> Void) throws {
+    private func importFile(_ file: URL, toDirectory: URL, onComplete: @escaping (URL) -> Void) throws {
         let name = file.lastPathComponent
         guard name.count > 0 else {
             throw NSLocalizedString("Invalid filename.", comment: "Main")
@@ -138,43 +188,72 @@ class Main: NSObject, ObservableObject {
             try self.fileManager.removeItem(at: dest)
         }
         try self.fileManager.copyItem(at: file, to: dest)
-        onComplete()
+        onComplete(dest)
     }
     
     func importPairing(_ pairing: URL) throws {
-        try importFile(pairing, toDirectory: pairingsURL) {
-            DispatchQueue.main.async {
-                self.refreshPairings()
-            }
+        try importFile(pairing, toDirectory: pairingsURL) { dest in
+            // the name may already be indexed for the file we just replaced
+            self.refreshPairings(replacing: [dest])
         }
     }
     
     func importSupportImage(_ support: URL) throws {
-        try importFile(support, toDirectory: supportImagesURL) {
-            DispatchQueue.main.async {
-                self.refreshSupportImages()
+        try importFile(support, toDirectory: supportImagesURL) { dest in
+            self.refreshSupportImages(replacing: [dest])
+        }
+    }
+    
+    func refreshPairings(replacing replaced: [URL] = []) {
+        pairingsIndex.refresh(replacing: replaced) { files in
+            if self.pairings != files {
+                self.pairings = files
             }
         }
     }
     
-    private func refresh(directory: URL, list: inout [URL]) {
-        guard let contents = try? fileManager.contentsOfDirectory(at: directory, includingPropertiesForKeys: nil) else {
-            return
+    func refreshSupportImages(replacing replaced: [URL] = []) {
+        supportImagesIndex.refresh(replacing: replaced) { files in
+            if self.supportImages != files {
+                self.supportImages = files
+            }
         }
-        let filtered = contents.filter { newFile in
-            !list.contains(newFile)
+    }
+    
+    private static func parsePairing(_ file: URL) -> [String: String] {
+        guard let data = try? Data(contentsOf: file) else {
+            return [:]
+        }
+        guard let plist = try? PropertyListSerialization.propertyList(from: data, format: nil) as? [String: Any] else {
+            return [:]
         }
-        if !filtered.isEmpty {
-            list = contents
+        guard let udid = plist["UDID"] as? String else {
+            return [:]
         }
+        return ["UDID": udid]
     }
     
-    func refreshPairings() {
-        refresh(directory: pairingsURL, list: &pairings)
+    private static func parseSupportImage(_ file: URL) -> [String: String] {
+        guard file.pathExtension == "signature" else {
+            return [:]
+        }
+        guard let data = try? Data(contentsOf: file) else {
+            return [:]
+        }
+        return ["ImageSignature": data.base64EncodedString()]
     }
     
-    func refreshSupportImages() {
-        refresh(directory: supportImagesURL, list: &supportImages)
+    /// UDID of an imported pairing from the index, nil if it is not indexed yet.
+    func pairingUdid(_ pairing: URL) -> String? {
+        pairingsIndex.metadata(for: pairing, key: "UDID")
+    }
+    
+    /// Contents of an imported signature file from the index, nil if it is not indexed yet.
+    func supportImageSignature(_ signature: URL) -> Data? {
+        guard let encoded = supportImagesIndex.metadata(for: signature, key: "ImageSignature") else {
+            return nil
+        }
+        return Data(base64Encoded: encoded)
     }
     
     func deletePairing(_ pairing: URL) throws {
@@ -322,6 +401,10 @@ class Main: NSObject, ObservableObject {
     func removeSavedHost(_ host: JBHostDevice) {
         savedHosts.removeAll(where: {$0.identifier == host.identifier})
         foundHosts.append(host)
+        let identifier = host.identifier
+        DispatchQueue.global(qos: .utility).async {
+            JBIconCache.shared.removeIcons(forHost: identifier, exceptBundleIdentifiers: nil)
+        }
     }
 }
 
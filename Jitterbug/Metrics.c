@@ -0,0 +1,311 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "Metrics.h"
+#include "Jitterbug.h"
+
+/**
+ * Histograms are log-linear like HdrHistogram: values below SUB_BUCKETS
+ * microseconds are exact and every power of two above that is split into
+ * SUB_BUCKETS linear buckets, covering up to ~71 minutes.
+ */
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define MAX_VALUE_BITS 32
+#define NUM_BUCKETS ((MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+/**
+ * The table only holds pointers, series are allocated on first use. 8192 slots
+ * cover over a thousand devices with every operation before probing degrades.
+ */
+#define MAX_SERIES 8192
+#define MAX_DEVICE_LEN 64
+
+typedef struct {
+    metrics_operation_t op;
+    char device[MAX_DEVICE_LEN];
+    atomic_uint_fast64_t failures;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t bytes;
+    atomic_uint_fast64_t buckets[NUM_BUCKETS];
+} series_t;
+
+static _Atomic(series_t *) g_series[MAX_SERIES];
+static atomic_uint_fast64_t g_dropped;
+
+static const char *g_operation_names[kMetricsOperationCount] = {
+    [kMetricsLockdownStart] = "lockdown_start",
+    [kMetricsServiceStart] = "service_start",
+    [kMetricsHeartbeatWait] = "heartbeat_wait",
+    [kMetricsImageUpload] = "image_upload",
+    [kMetricsAppLaunch] = "app_launch",
+    [kMetricsDeviceLookup] = "device_lookup",
+    [kMetricsPairRecordRead] = "pair_record_read",
+};
+
+// MARK: - Buckets
+
+static unsigned int bucketIndex(uint64_t value) {
+    unsigned int msb, shift, index;
+
+    if (value < SUB_BUCKETS) {
+        return (unsigned int)value;
+    }
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - SUB_BUCKET_BITS;
+    index = (shift + 1) * SUB_BUCKETS + (unsigned int)((value >> shift) & (SUB_BUCKETS - 1));
+    return index < NUM_BUCKETS ? index : NUM_BUCKETS - 1;
+}
+
+static uint64_t bucketUpperBound(unsigned int index) {
+    unsigned int shift;
+
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    shift = index / SUB_BUCKETS - 1;
+    return (((uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) + 1) << shift) - 1;
+}
+
+// MARK: - Series lookup
+
+static uint32_t seriesHash(const char *device, metrics_operation_t op) {
+    uint32_t hash = 2166136261u;
+    for (const char *p = device; *p; p++) {
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    }
+    return (hash ^ op) * 16777619u;
+}
+
+static int seriesMatches(const series_t *series, const char *device, metrics_operation_t op) {
+    return series->op == op && strncmp(series->device, device, MAX_DEVICE_LEN - 1) == 0;
+}
+
+/**
+ * Open addressing over series pointers. A new series is filled in before it is
+ * published with CAS, and the loser of a race frees its copy. Series are never
+ * removed so a published pointer stays valid forever and readers need no
+ * locks.
+ */
+static series_t *seriesGet(const char *device, metrics_operation_t op, int create) {
+    series_t *created = NULL;
+    uint32_t start;
+
+    if (!device || op >= kMetricsOperationCount) {
+        return NULL;
+    }
+    start = seriesHash(device, op) % MAX_SERIES;
+    for (uint32_t i = 0; i < MAX_SERIES; i++) {
+        _Atomic(series_t *) *slot = &g_series[(start + i) % MAX_SERIES];
+        series_t *series = atomic_load_explicit(slot, memory_order_acquire);
+        if (!series) {
+            if (!create) {
+                return NULL;
+            }
+            if (!created && !(created = calloc(1, sizeof(series_t)))) {
+                break;
+            }
+            created->op = op;
+            strncpy(created->device, device, MAX_DEVICE_LEN - 1);
+            if (atomic_compare_exchange_strong_explicit(slot, &series, created, memory_order_release, memory_order_acquire)) {
+                return created;
+            }
+        }
+        if (seriesMatches(series, device, op)) {
+            free(created);
+            return series;
+        }
+    }
+    free(created);
+    atomic_fetch_add_explicit(&g_dropped, 1, memory_order_relaxed);
+    return NULL;
+}
+
+// MARK: - Recording
+
+uint64_t metricsNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metricsRecord(const char *device, metrics_operation_t op, uint64_t start, int success) {
+    series_t *series = seriesGet(device, op, 1);
+    uint64_t elapsed = metricsNow() - start;
+
+    if (!series) {
+        return;
+    }
+    atomic_fetch_add_explicit(&series->buckets[bucketIndex(elapsed)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&series->sum, elapsed, memory_order_relaxed);
+    if (!success) {
+        atomic_fetch_add_explicit(&series->failures, 1, memory_order_relaxed);
+    }
+}
+
+void metricsAddBytes(const char *device, metrics_operation_t op, uint64_t bytes) {
+    series_t *series = seriesGet(device, op, 1);
+
+    if (series) {
+        atomic_fetch_add_explicit(&series->bytes, bytes, memory_order_relaxed);
+    }
+}
+
+static double seriesQuantile(series_t *series, double quantile) {
+    uint64_t total = 0;
+    uint64_t seen = 0;
+    uint64_t rank;
+
+    for (unsigned int i = 0; i < NUM_BUCKETS; i++) {
+        total += atomic_load_explicit(&series->buckets[i], memory_order_relaxed);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    rank = (uint64_t)(quantile * total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (unsigned int i = 0; i < NUM_BUCKETS; i++) {
+        seen += atomic_load_explicit(&series->buckets[i], memory_order_relaxed);
+        if (seen >= rank) {
+            return bucketUpperBound(i) / 1000000.0;
+        }
+    }
+    return bucketUpperBound(NUM_BUCKETS - 1) / 1000000.0;
+}
+
+double metricsQuantile(const char *device, metrics_operation_t op, double quantile) {
+    series_t *series = seriesGet(device, op, 0);
+
+    return series ? seriesQuantile(series, quantile) : 0;
+}
+
+// MARK: - Export
+
+static void writeLabels(FILE *file, series_t *series) {
+    fprintf(file, "device=\"");
+    for (const char *p = series->device; *p; p++) {
+        if (*p == '\\' || *p == '"') {
+            fputc('\\', file);
+            fputc(*p, file);
+        } else if (*p == '\n') {
+            fputs("\\n", file);
+        } else {
+            fputc(*p, file);
+        }
+    }
+    fprintf(file, "\",operation=\"%s\"", g_operation_names[series->op]);
+}
+
+#define FOREACH_SERIES(series) \
+    for (size_t slot_ = 0; slot_ < MAX_SERIES; slot_++) \
+        for (series_t *series = atomic_load_explicit(&g_series[slot_], memory_order_acquire); series; series = NULL)
+
+int metricsWritePrometheus(FILE *file) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99 };
+
+    fprintf(file, "# HELP jitterbug_operation_duration_seconds Duration of device operations.\n");
+    fprintf(file, "# TYPE jitterbug_operation_duration_seconds histogram\n");
+    FOREACH_SERIES(series) {
+        uint64_t cumulative = 0;
+        for (unsigned int i = 0; i < NUM_BUCKETS; i++) {
+            cumulative += atomic_load_explicit(&series->buckets[i], memory_order_relaxed);
+            // export one boundary per power of two to keep the output small
+            if (i % SUB_BUCKETS == SUB_BUCKETS - 1) {
+                fprintf(file, "jitterbug_operation_duration_seconds_bucket{");
+                writeLabels(file, series);
+                fprintf(file, ",le=\"%g\"} %llu\n", bucketUpperBound(i) / 1000000.0, (unsigned long long)cumulative);
+            }
+        }
+        fprintf(file, "jitterbug_operation_duration_seconds_bucket{");
+        writeLabels(file, series);
+        fprintf(file, ",le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+        fprintf(file, "jitterbug_operation_duration_seconds_sum{");
+        writeLabels(file, series);
+        fprintf(file, "} %g\n", atomic_load_explicit(&series->sum, memory_order_relaxed) / 1000000.0);
+        fprintf(file, "jitterbug_operation_duration_seconds_count{");
+        writeLabels(file, series);
+        fprintf(file, "} %llu\n", (unsigned long long)cumulative);
+    }
+
+    fprintf(file, "# HELP jitterbug_operation_duration_quantile_seconds Estimated quantiles of device operation duration.\n");
+    fprintf(file, "# TYPE jitterbug_operation_duration_quantile_seconds gauge\n");
+    FOREACH_SERIES(series) {
+        for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+            fprintf(file, "jitterbug_operation_duration_quantile_seconds{");
+            writeLabels(file, series);
+            fprintf(file, ",quantile=\"%g\"} %g\n", quantiles[i], seriesQuantile(series, quantiles[i]));
+        }
+    }
+
+    fprintf(file, "# HELP jitterbug_operation_failures_total Number of failed device operations.\n");
+    fprintf(file, "# TYPE jitterbug_operation_failures_total counter\n");
+    FOREACH_SERIES(series) {
+        fprintf(file, "jitterbug_operation_failures_total{");
+        writeLabels(file, series);
+        fprintf(file, "} %llu\n", (unsigned long long)atomic_load_explicit(&series->failures, memory_order_relaxed));
+    }
+
+    fprintf(file, "# HELP jitterbug_operation_bytes_total Bytes transferred by device operations.\n");
+    fprintf(file, "# TYPE jitterbug_operation_bytes_total counter\n");
+    FOREACH_SERIES(series) {
+        uint64_t bytes = atomic_load_explicit(&series->bytes, memory_order_relaxed);
+        if (bytes > 0) {
+            fprintf(file, "jitterbug_operation_bytes_total{");
+            writeLabels(file, series);
+            fprintf(file, "} %llu\n", (unsigned long long)bytes);
+        }
+    }
+
+    fprintf(file, "# HELP jitterbug_metrics_dropped_total Samples dropped because the registry is full.\n");
+    fprintf(file, "# TYPE jitterbug_metrics_dropped_total counter\n");
+    fprintf(file, "jitterbug_metrics_dropped_total %llu\n", (unsigned long long)atomic_load_explicit(&g_dropped, memory_order_relaxed));
+    return ferror(file) ? 0 : 1;
+}
+
+int metricsWriteToFile(const char *path) {
+    char *tmp = NULL;
+    FILE *file = NULL;
+    int ret = 0;
+
+    if (asprintf(&tmp, "%s.tmp", path) < 0) {
+        return 0;
+    }
+    if (!(file = fopen(tmp, "w"))) {
+        DEBUG_PRINT("cannot open %s", tmp);
+        goto end;
+    }
+    ret = metricsWritePrometheus(file);
+    if (fclose(file) != 0) {
+        ret = 0;
+    }
+    if (ret && rename(tmp, path) != 0) {
+        DEBUG_PRINT("cannot rename %s to %s", tmp, path);
+        ret = 0;
+    }
+
+end:
+    if (!ret) {
+        unlink(tmp);
+    }
+    free(tmp);
+    return ret;
+}
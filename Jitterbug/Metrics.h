@@ -0,0 +1,47 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef Metrics_h
+#define Metrics_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+    kMetricsLockdownStart,
+    kMetricsServiceStart,
+    kMetricsHeartbeatWait, // from timer fire until the device's ping arrives
+    kMetricsImageUpload,
+    kMetricsAppLaunch,
+    kMetricsDeviceLookup,
+    kMetricsPairRecordRead,
+    kMetricsOperationCount
+} metrics_operation_t;
+
+/**
+ * Recording is lock-free and safe from any thread. Each device and operation
+ * pair gets a latency histogram with about 6% relative error, a failure
+ * counter, and a byte counter.
+ */
+uint64_t metricsNow(void);
+void metricsRecord(const char *device, metrics_operation_t op, uint64_t start, int success);
+void metricsAddBytes(const char *device, metrics_operation_t op, uint64_t bytes);
+double metricsQuantile(const char *device, metrics_operation_t op, double quantile);
+
+int metricsWritePrometheus(FILE *file);
+int metricsWriteToFile(const char *path);
+
+#endif /* Metrics_h */
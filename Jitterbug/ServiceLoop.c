@@ -0,0 +1,765 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include "ServiceLoop.h"
+
+#define READ_CHUNK 65536
+#define STREAM_CHUNK 65536
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+typedef enum {
+    kRequestSend,
+    kRequestStream,
+    kRequestReceive
+} request_type_t;
+
+typedef struct service_request {
+    struct service_request *next;
+    request_type_t type;
+    uint8_t *data;
+    size_t length;
+    size_t offset;
+    uint64_t remaining;
+    service_read_cb_t read;
+    void *read_ctx;
+    int source_fd;
+    service_framer_t framer;
+    service_done_cb_t done;
+    service_receive_cb_t received;
+    void *ctx;
+} service_request_t;
+
+struct service_connection {
+    service_loop_t loop;
+    struct service_connection *prev;
+    struct service_connection *next;
+    int fd;
+    SSL_CTX *ssl_ctx;
+    SSL *ssl;
+    int handshaking;
+    service_done_cb_t handshake_done;
+    void *handshake_ctx;
+    int want_read;
+    int want_write;
+    int want_source;
+    service_request_t *sends;
+    service_request_t **sends_tail;
+    service_request_t *receives;
+    service_request_t **receives_tail;
+    uint8_t *rbuf;
+    size_t rlen;
+    size_t rcap;
+    int error;
+    int closed;
+    int draining;
+    int dirty;
+    unsigned int timeout_ms;
+    uint64_t last_progress;
+};
+
+typedef struct service_task {
+    struct service_task *next;
+    service_loop_fn_t fn;
+    void *ctx;
+} service_task_t;
+
+struct service_loop {
+    struct service_connection *connections;
+    pthread_mutex_t lock;
+    service_task_t *tasks;
+    service_task_t **tasks_tail;
+    int wake[2];
+    pthread_t thread;
+    int running;
+    atomic_int stopping;
+    struct pollfd *fds;
+    struct service_connection **fd_conns;
+    size_t fds_capacity;
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// MARK: - Loop
+
+service_loop_t serviceLoopNew(void)
+{
+    service_loop_t loop = calloc(1, sizeof(struct service_loop));
+    if (!loop) {
+        return NULL;
+    }
+    if (pipe(loop->wake) < 0) {
+        free(loop);
+        return NULL;
+    }
+    set_nonblocking(loop->wake[0]);
+    set_nonblocking(loop->wake[1]);
+    pthread_mutex_init(&loop->lock, NULL);
+    loop->tasks_tail = &loop->tasks;
+    return loop;
+}
+
+static void sweep_connections(service_loop_t loop);
+
+void serviceLoopFree(service_loop_t loop)
+{
+    service_task_t *task;
+
+    if (!loop) {
+        return;
+    }
+    serviceLoopStop(loop);
+    for (service_connection_t conn = loop->connections; conn; conn = conn->next) {
+        conn->closed = 1;
+    }
+    sweep_connections(loop);
+    while ((task = loop->tasks)) {
+        loop->tasks = task->next;
+        free(task);
+    }
+    close(loop->wake[0]);
+    close(loop->wake[1]);
+    pthread_mutex_destroy(&loop->lock);
+    free(loop->fds);
+    free(loop->fd_conns);
+    free(loop);
+}
+
+static void *loop_thread(void *arg)
+{
+    service_loop_t loop = arg;
+    while (!atomic_load(&loop->stopping)) {
+        serviceLoopRunOnce(loop, -1);
+    }
+    return NULL;
+}
+
+int serviceLoopStart(service_loop_t loop)
+{
+    if (loop->running) {
+        return 1;
+    }
+    atomic_store(&loop->stopping, 0);
+    if (pthread_create(&loop->thread, NULL, loop_thread, loop) != 0) {
+        return 0;
+    }
+    loop->running = 1;
+    return 1;
+}
+
+static void wake_loop(service_loop_t loop)
+{
+    char c = 0;
+    // a full pipe already guarantees a wakeup
+    (void)!write(loop->wake[1], &c, 1);
+}
+
+void serviceLoopStop(service_loop_t loop)
+{
+    if (!loop->running) {
+        return;
+    }
+    atomic_store(&loop->stopping, 1);
+    wake_loop(loop);
+    pthread_join(loop->thread, NULL);
+    loop->running = 0;
+}
+
+void serviceLoopAsync(service_loop_t loop, service_loop_fn_t fn, void *ctx)
+{
+    service_task_t *task = calloc(1, sizeof(service_task_t));
+    task->fn = fn;
+    task->ctx = ctx;
+    pthread_mutex_lock(&loop->lock);
+    *loop->tasks_tail = task;
+    loop->tasks_tail = &task->next;
+    pthread_mutex_unlock(&loop->lock);
+    wake_loop(loop);
+}
+
+static void run_tasks(service_loop_t loop)
+{
+    service_task_t *tasks;
+    char buf[64];
+
+    while (read(loop->wake[0], buf, sizeof(buf)) > 0);
+    pthread_mutex_lock(&loop->lock);
+    tasks = loop->tasks;
+    loop->tasks = NULL;
+    loop->tasks_tail = &loop->tasks;
+    pthread_mutex_unlock(&loop->lock);
+    while (tasks) {
+        service_task_t *task = tasks;
+        tasks = task->next;
+        task->fn(task->ctx);
+        free(task);
+    }
+}
+
+// MARK: - Transport
+
+static ssize_t conn_read(service_connection_t conn, void *buf, size_t len)
+{
+    if (conn->ssl) {
+        int ret = SSL_read(conn->ssl, buf, (int)len);
+        if (ret > 0) {
+            return ret;
+        }
+        switch (SSL_get_error(conn->ssl, ret)) {
+            case SSL_ERROR_WANT_READ: conn->want_read = 1; return -EAGAIN;
+            case SSL_ERROR_WANT_WRITE: conn->want_write = 1; return -EAGAIN;
+            case SSL_ERROR_ZERO_RETURN: return 0;
+            default: return -EPROTO;
+        }
+    } else {
+        ssize_t ret = recv(conn->fd, buf, len, 0);
+        if (ret < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? -EAGAIN : -errno;
+        }
+        return ret;
+    }
+}
+
+static ssize_t conn_write(service_connection_t conn, const void *buf, size_t len)
+{
+    if (conn->ssl) {
+        int ret = SSL_write(conn->ssl, buf, (int)len);
+        if (ret > 0) {
+            return ret;
+        }
+        switch (SSL_get_error(conn->ssl, ret)) {
+            case SSL_ERROR_WANT_READ: conn->want_read = 1; return -EAGAIN;
+            case SSL_ERROR_WANT_WRITE: conn->want_write = 1; return -EAGAIN;
+            default: return -EPROTO;
+        }
+    } else {
+        ssize_t ret = send(conn->fd, buf, len, SEND_FLAGS);
+        if (ret < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? -EAGAIN : -errno;
+        }
+        return ret;
+    }
+}
+
+static void fail_connection(service_connection_t conn, int error)
+{
+    if (!conn->error) {
+        conn->error = error;
+    }
+    conn->dirty = 1;
+}
+
+// MARK: - Connections
+
+service_connection_t serviceConnectionNew(service_loop_t loop, int fd)
+{
+    service_connection_t conn = calloc(1, sizeof(struct service_connection));
+    if (!conn) {
+        return NULL;
+    }
+    set_nonblocking(fd);
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    conn->loop = loop;
+    conn->fd = fd;
+    conn->sends_tail = &conn->sends;
+    conn->receives_tail = &conn->receives;
+    conn->next = loop->connections;
+    if (loop->connections) {
+        loop->connections->prev = conn;
+    }
+    loop->connections = conn;
+    return conn;
+}
+
+void serviceConnectionClose(service_connection_t conn)
+{
+    conn->closed = 1;
+}
+
+void serviceConnectionSetTimeout(service_connection_t conn, unsigned int timeout_ms)
+{
+    conn->timeout_ms = timeout_ms;
+}
+
+static int conn_stopped(service_connection_t conn)
+{
+    return conn->closed && !conn->draining;
+}
+
+static int conn_idle(service_connection_t conn)
+{
+    return !conn->sends && !conn->receives && !conn->handshaking;
+}
+
+static void enqueue(service_connection_t conn, service_request_t *req)
+{
+    if (conn_idle(conn)) {
+        conn->last_progress = now_ms();
+    }
+    if (req->type == kRequestReceive) {
+        *conn->receives_tail = req;
+        conn->receives_tail = &req->next;
+    } else {
+        *conn->sends_tail = req;
+        conn->sends_tail = &req->next;
+    }
+    conn->dirty = 1;
+}
+
+void serviceConnectionStartTLS(service_connection_t conn, const void *cert, size_t cert_length, const void *key, size_t key_length, service_done_cb_t cb, void *ctx)
+{
+    BIO *bio = NULL;
+    X509 *x509 = NULL;
+    EVP_PKEY *pkey = NULL;
+    int ok = 0;
+
+    if (conn_idle(conn)) {
+        conn->last_progress = now_ms();
+    }
+    conn->handshaking = 1;
+    conn->handshake_done = cb;
+    conn->handshake_ctx = ctx;
+    conn->dirty = 1;
+    if (!(conn->ssl_ctx = SSL_CTX_new(TLS_client_method()))) {
+        goto end;
+    }
+    // devices are not verified, lockdownd trusts us by our certificate
+    SSL_CTX_set_verify(conn->ssl_ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_security_level(conn->ssl_ctx, 0);
+    SSL_CTX_set_min_proto_version(conn->ssl_ctx, TLS1_VERSION);
+    if ((bio = BIO_new_mem_buf(cert, (int)cert_length)) && (x509 = PEM_read_bio_X509(bio, NULL, NULL, NULL))) {
+        SSL_CTX_use_certificate(conn->ssl_ctx, x509);
+    }
+    BIO_free(bio);
+    if ((bio = BIO_new_mem_buf(key, (int)key_length)) && (pkey = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL))) {
+        SSL_CTX_use_PrivateKey(conn->ssl_ctx, pkey);
+    }
+    BIO_free(bio);
+    if (!x509 || !pkey || !(conn->ssl = SSL_new(conn->ssl_ctx))) {
+        goto end;
+    }
+    SSL_set_fd(conn->ssl, conn->fd);
+    SSL_set_connect_state(conn->ssl);
+    SSL_set_mode(conn->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    ok = 1;
+
+end:
+    X509_free(x509);
+    EVP_PKEY_free(pkey);
+    if (!ok) {
+        ERR_clear_error();
+        fail_connection(conn, -EPROTO);
+    }
+}
+
+void serviceConnectionSend(service_connection_t conn, const void *data, size_t length, service_done_cb_t cb, void *ctx)
+{
+    service_request_t *req = calloc(1, sizeof(service_request_t));
+    req->type = kRequestSend;
+    req->data = malloc(length ? length : 1);
+    memcpy(req->data, data, length);
+    req->length = length;
+    req->done = cb;
+    req->ctx = ctx;
+    enqueue(conn, req);
+}
+
+void serviceConnectionSendMessage(service_connection_t conn, const void *data, uint32_t length, service_done_cb_t cb, void *ctx)
+{
+    service_request_t *req = calloc(1, sizeof(service_request_t));
+    req->type = kRequestSend;
+    req->data = malloc(length + 4);
+    req->data[0] = (uint8_t)(length >> 24);
+    req->data[1] = (uint8_t)(length >> 16);
+    req->data[2] = (uint8_t)(length >> 8);
+    req->data[3] = (uint8_t)length;
+    memcpy(req->data + 4, data, length);
+    req->length = length + 4;
+    req->done = cb;
+    req->ctx = ctx;
+    enqueue(conn, req);
+}
+
+void serviceConnectionSendStream(service_connection_t conn, uint64_t length, service_read_cb_t read, void *read_ctx, service_done_cb_t cb, void *ctx)
+{
+    service_request_t *req = calloc(1, sizeof(service_request_t));
+    req->type = kRequestStream;
+    req->data = malloc(STREAM_CHUNK);
+    req->remaining = length;
+    req->read = read;
+    req->read_ctx = read_ctx;
+    req->done = cb;
+    req->ctx = ctx;
+    enqueue(conn, req);
+}
+
+void serviceConnectionSendPipe(service_connection_t conn, uint64_t length, int source_fd, service_done_cb_t cb, void *ctx)
+{
+    service_request_t *req = calloc(1, sizeof(service_request_t));
+    set_nonblocking(source_fd);
+    req->type = kRequestStream;
+    req->data = malloc(STREAM_CHUNK);
+    req->remaining = length;
+    req->source_fd = source_fd;
+    req->done = cb;
+    req->ctx = ctx;
+    enqueue(conn, req);
+}
+
+void serviceConnectionReceive(service_connection_t conn, service_framer_t framer, service_receive_cb_t cb, void *ctx)
+{
+    service_request_t *req = calloc(1, sizeof(service_request_t));
+    req->type = kRequestReceive;
+    req->framer = framer;
+    req->received = cb;
+    req->ctx = ctx;
+    enqueue(conn, req);
+}
+
+ssize_t serviceFrameMessage(const uint8_t *buf, size_t length, size_t *payload_offset, size_t *payload_length)
+{
+    uint32_t size;
+    if (length < 4) {
+        return 0;
+    }
+    size = ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+    if (length - 4 < size) {
+        return 0;
+    }
+    *payload_offset = 4;
+    *payload_length = size;
+    return (ssize_t)size + 4;
+}
+
+// MARK: - Processing
+
+static service_request_t *pop_send(service_connection_t conn)
+{
+    service_request_t *req = conn->sends;
+    if ((conn->sends = req->next) == NULL) {
+        conn->sends_tail = &conn->sends;
+    }
+    return req;
+}
+
+static service_request_t *pop_receive(service_connection_t conn)
+{
+    service_request_t *req = conn->receives;
+    if ((conn->receives = req->next) == NULL) {
+        conn->receives_tail = &conn->receives;
+    }
+    return req;
+}
+
+static void free_request(service_request_t *req)
+{
+    free(req->data);
+    free(req);
+}
+
+static void process_handshake(service_connection_t conn)
+{
+    int ret;
+    service_done_cb_t cb = conn->handshake_done;
+
+    if (!conn->handshaking) {
+        return;
+    }
+    if (!conn->error) {
+        if ((ret = SSL_do_handshake(conn->ssl)) == 1) {
+            conn->last_progress = now_ms();
+        } else {
+            switch (SSL_get_error(conn->ssl, ret)) {
+                case SSL_ERROR_WANT_READ: conn->want_read = 1; return;
+                case SSL_ERROR_WANT_WRITE: conn->want_write = 1; return;
+                default: ERR_clear_error(); fail_connection(conn, -EPROTO); break;
+            }
+        }
+    }
+    conn->handshaking = 0;
+    if (cb) {
+        cb(conn, conn->error, conn->handshake_ctx);
+    }
+}
+
+static void process_sends(service_connection_t conn)
+{
+    while (conn->sends && !conn_stopped(conn)) {
+        service_request_t *req = conn->sends;
+        ssize_t ret;
+
+        if (conn->error) {
+            pop_send(conn);
+            if (req->done) {
+                req->done(conn, conn->error, req->ctx);
+            }
+            free_request(req);
+            continue;
+        }
+        if (conn->handshaking) {
+            return;
+        }
+        if (req->type == kRequestStream && req->offset == req->length && req->remaining > 0) {
+            size_t want = req->remaining < STREAM_CHUNK ? (size_t)req->remaining : STREAM_CHUNK;
+            if (req->read) {
+                ret = req->read(req->data, want, req->read_ctx);
+            } else if ((ret = read(req->source_fd, req->data, want)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // wait for the producer instead of the socket
+                conn->want_source = 1;
+                return;
+            }
+            if (ret <= 0) {
+                // the stream is cut short so the framing is lost
+                fail_connection(conn, -EIO);
+                continue;
+            }
+            req->length = (size_t)ret;
+            req->offset = 0;
+            req->remaining -= (uint64_t)ret;
+        }
+        if (req->offset < req->length) {
+            if ((ret = conn_write(conn, req->data + req->offset, req->length - req->offset)) == -EAGAIN) {
+                return;
+            } else if (ret < 0) {
+                fail_connection(conn, (int)ret);
+                continue;
+            }
+            req->offset += (size_t)ret;
+            conn->last_progress = now_ms();
+        }
+        if (req->offset == req->length && (req->type == kRequestSend || req->remaining == 0)) {
+            pop_send(conn);
+            if (req->done) {
+                req->done(conn, 0, req->ctx);
+            }
+            free_request(req);
+        }
+    }
+}
+
+static void process_receives(service_connection_t conn)
+{
+    while (conn->receives && !conn_stopped(conn)) {
+        service_request_t *req = conn->receives;
+        size_t offset = 0;
+        size_t length = 0;
+        ssize_t frame = 0;
+        ssize_t ret;
+
+        if (conn->rlen > 0 && (frame = req->framer(conn->rbuf, conn->rlen, &offset, &length)) < 0) {
+            fail_connection(conn, -EBADMSG);
+            conn->rlen = 0;
+        }
+        if (frame > 0) {
+            pop_receive(conn);
+            req->received(conn, 0, conn->rbuf + offset, length, req->ctx);
+            memmove(conn->rbuf, conn->rbuf + frame, conn->rlen - (size_t)frame);
+            conn->rlen -= (size_t)frame;
+            free_request(req);
+            continue;
+        }
+        if (conn->error) {
+            pop_receive(conn);
+            req->received(conn, conn->error, NULL, 0, req->ctx);
+            free_request(req);
+            continue;
+        }
+        if (conn->handshaking) {
+            return;
+        }
+        if (conn->rcap - conn->rlen < READ_CHUNK) {
+            uint8_t *rbuf = realloc(conn->rbuf, conn->rlen + READ_CHUNK);
+            if (!rbuf) {
+                fail_connection(conn, -ENOMEM);
+                continue;
+            }
+            conn->rbuf = rbuf;
+            conn->rcap = conn->rlen + READ_CHUNK;
+        }
+        if ((ret = conn_read(conn, conn->rbuf + conn->rlen, conn->rcap - conn->rlen)) == -EAGAIN) {
+            return;
+        } else if (ret <= 0) {
+            fail_connection(conn, ret == 0 ? -ECONNRESET : (int)ret);
+            continue;
+        }
+        conn->rlen += (size_t)ret;
+        conn->last_progress = now_ms();
+    }
+}
+
+static void process_connection(service_connection_t conn)
+{
+    conn->dirty = 0;
+    conn->want_read = 0;
+    conn->want_write = 0;
+    conn->want_source = 0;
+    process_handshake(conn);
+    if (!conn_stopped(conn)) {
+        process_sends(conn);
+    }
+    if (!conn_stopped(conn)) {
+        process_receives(conn);
+    }
+}
+
+static void sweep_connections(service_loop_t loop)
+{
+    service_connection_t conn = loop->connections;
+
+    while (conn) {
+        service_connection_t next = conn->next;
+        if (!conn->closed) {
+            conn = next;
+            continue;
+        }
+        // callbacks may queue more requests while we drain
+        fail_connection(conn, -ECANCELED);
+        conn->draining = 1;
+        conn->rlen = 0;
+        while (!conn_idle(conn)) {
+            process_connection(conn);
+        }
+        if (conn->prev) {
+            conn->prev->next = conn->next;
+        } else {
+            loop->connections = conn->next;
+        }
+        if (conn->next) {
+            conn->next->prev = conn->prev;
+        }
+        next = conn->next;
+        if (conn->ssl) {
+            SSL_free(conn->ssl);
+        }
+        if (conn->ssl_ctx) {
+            SSL_CTX_free(conn->ssl_ctx);
+        }
+        close(conn->fd);
+        free(conn->rbuf);
+        free(conn);
+        conn = next;
+    }
+}
+
+int serviceLoopRunOnce(service_loop_t loop, int timeout_ms)
+{
+    uint64_t now = now_ms();
+    size_t count = 1;
+    int ret;
+
+    // new requests and failures are handled before waiting
+    for (service_connection_t conn = loop->connections; conn; conn = conn->next) {
+        if (!conn->closed && conn->timeout_ms && !conn_idle(conn) && !conn->error) {
+            uint64_t deadline = conn->last_progress + conn->timeout_ms;
+            if (now >= deadline) {
+                fail_connection(conn, -ETIMEDOUT);
+            } else if (timeout_ms < 0 || deadline - now < (uint64_t)timeout_ms) {
+                timeout_ms = (int)(deadline - now);
+            }
+        }
+        if (!conn->closed && conn->dirty) {
+            process_connection(conn);
+        }
+    }
+    sweep_connections(loop);
+    for (service_connection_t conn = loop->connections; conn; conn = conn->next) {
+        if (conn->dirty) {
+            timeout_ms = 0;
+        }
+        // the socket and possibly a pipe feeding a stream
+        count += 2;
+    }
+
+    if (count > loop->fds_capacity) {
+        loop->fds_capacity = count * 2;
+        loop->fds = realloc(loop->fds, loop->fds_capacity * sizeof(struct pollfd));
+        loop->fd_conns = realloc(loop->fd_conns, loop->fds_capacity * sizeof(service_connection_t));
+    }
+    loop->fds[0].fd = loop->wake[0];
+    loop->fds[0].events = POLLIN;
+    loop->fds[0].revents = 0;
+    count = 1;
+    for (service_connection_t conn = loop->connections; conn; conn = conn->next) {
+        short events = 0;
+        if (conn->want_read || (conn->receives && !conn->error)) {
+            events |= POLLIN;
+        }
+        if (conn->want_write || (conn->sends && !conn->error && !conn->handshaking && !conn->want_source)) {
+            events |= POLLOUT;
+        }
+        if (conn->want_source) {
+            loop->fds[count].fd = conn->sends->source_fd;
+            loop->fds[count].events = POLLIN;
+            loop->fds[count].revents = 0;
+            loop->fd_conns[count] = conn;
+            count++;
+        }
+        if (!events) {
+            continue;
+        }
+        loop->fds[count].fd = conn->fd;
+        loop->fds[count].events = events;
+        loop->fds[count].revents = 0;
+        loop->fd_conns[count] = conn;
+        count++;
+    }
+
+    if ((ret = poll(loop->fds, (nfds_t)count, timeout_ms)) < 0) {
+        return errno == EINTR ? 0 : -errno;
+    }
+    for (size_t i = 1; i < count; i++) {
+        service_connection_t conn = loop->fd_conns[i];
+        if (loop->fds[i].revents && !conn->closed) {
+            process_connection(conn);
+        }
+    }
+    if (loop->fds[0].revents) {
+        run_tasks(loop);
+    }
+    sweep_connections(loop);
+    return 0;
+}
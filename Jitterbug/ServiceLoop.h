@@ -0,0 +1,98 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef ServiceLoop_h
+#define ServiceLoop_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Single threaded event loop for device service connections. Every service
+ * connection is a non-blocking socket (optionally wrapped in TLS) with a queue
+ * of pending sends and a queue of pending receives, so any number of
+ * operations on any number of devices can be in flight at once without a
+ * thread each. Completion callbacks run on the loop thread.
+ *
+ * Except for serviceLoopAsync() and serviceLoopStop(), functions must be
+ * called on the loop thread (from a callback or a function passed to
+ * serviceLoopAsync()), or before the loop is started.
+ */
+typedef struct service_loop *service_loop_t;
+typedef struct service_connection *service_connection_t;
+
+typedef void (*service_loop_fn_t)(void *ctx);
+typedef void (*service_done_cb_t)(service_connection_t conn, int error, void *ctx);
+typedef void (*service_receive_cb_t)(service_connection_t conn, int error, const uint8_t *data, size_t length, void *ctx);
+
+/**
+ * Fills `buf` with up to `size` bytes of a stream being sent. Returns the
+ * number of bytes read or a value <= 0 if the source failed.
+ */
+typedef ssize_t (*service_read_cb_t)(void *buf, size_t size, void *ctx);
+
+/**
+ * Finds the first frame in `buf`. Returns the total size of the frame and sets
+ * the payload location, returns 0 if more data is needed, or returns -1 if the
+ * data is malformed.
+ */
+typedef ssize_t (*service_framer_t)(const uint8_t *buf, size_t length, size_t *payload_offset, size_t *payload_length);
+
+service_loop_t serviceLoopNew(void);
+void serviceLoopFree(service_loop_t loop);
+int serviceLoopStart(service_loop_t loop);
+void serviceLoopStop(service_loop_t loop);
+int serviceLoopRunOnce(service_loop_t loop, int timeout_ms);
+void serviceLoopAsync(service_loop_t loop, service_loop_fn_t fn, void *ctx);
+
+/**
+ * Takes ownership of the connected socket `fd`. Errors are reported as
+ * negative errno values: -ETIMEDOUT if the connection made no progress within
+ * its timeout, -ECONNRESET if the device closed it, -EPROTO if TLS failed and
+ * -ECANCELED for requests still pending when it was closed.
+ */
+service_connection_t serviceConnectionNew(service_loop_t loop, int fd);
+void serviceConnectionClose(service_connection_t conn);
+void serviceConnectionSetTimeout(service_connection_t conn, unsigned int timeout_ms);
+
+/**
+ * Starts a TLS client session using the PEM encoded certificate and key (the
+ * pair record's root certificate for lockdown services). Requests queued
+ * before the handshake finishes are sent over TLS afterwards.
+ */
+void serviceConnectionStartTLS(service_connection_t conn, const void *cert, size_t cert_length, const void *key, size_t key_length, service_done_cb_t cb, void *ctx);
+
+void serviceConnectionSend(service_connection_t conn, const void *data, size_t length, service_done_cb_t cb, void *ctx);
+void serviceConnectionSendMessage(service_connection_t conn, const void *data, uint32_t length, service_done_cb_t cb, void *ctx);
+void serviceConnectionSendStream(service_connection_t conn, uint64_t length, service_read_cb_t read, void *read_ctx, service_done_cb_t cb, void *ctx);
+
+/**
+ * Sends `length` bytes read from `source_fd`, usually the read end of a pipe
+ * filled by another thread, so slow sources such as disk reads never block the
+ * loop. The fd is made non-blocking and stays owned by the caller, who must
+ * keep it open until the stream is sent or has failed.
+ */
+void serviceConnectionSendPipe(service_connection_t conn, uint64_t length, int source_fd, service_done_cb_t cb, void *ctx);
+void serviceConnectionReceive(service_connection_t conn, service_framer_t framer, service_receive_cb_t cb, void *ctx);
+
+/**
+ * Frames used by lockdown services: a 32-bit big endian length followed by
+ * that many bytes.
+ */
+ssize_t serviceFrameMessage(const uint8_t *buf, size_t length, size_t *payload_offset, size_t *payload_length);
+
+#endif /* ServiceLoop_h */
@@ -0,0 +1,533 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ServiceOperations.h"
+#include "Metrics.h"
+
+#define ICON_WINDOW 8
+
+static const char *dict_get_string(plist_t dict, const char *key)
+{
+    plist_t node = plist_dict_get_item(dict, key);
+    if (node && plist_get_node_type(node) == PLIST_STRING) {
+        return plist_get_string_ptr(node, NULL);
+    }
+    return NULL;
+}
+
+static int status_is(plist_t reply, const char *status)
+{
+    const char *value = dict_get_string(reply, "Status");
+    return value && strcmp(value, status) == 0;
+}
+
+// MARK: - Property list messages
+
+typedef struct {
+    service_plist_cb_t cb;
+    void *ctx;
+} plist_request_t;
+
+static void plist_request_received(service_connection_t conn, int error, const uint8_t *data, size_t length, void *ctx)
+{
+    plist_request_t *req = ctx;
+    plist_t reply = NULL;
+    (void)conn;
+
+    if (!error) {
+        if (plist_is_binary((const char *)data, (uint32_t)length)) {
+            plist_from_bin((const char *)data, (uint32_t)length, &reply);
+        } else {
+            plist_from_xml((const char *)data, (uint32_t)length, &reply);
+        }
+        if (!reply || plist_get_node_type(reply) != PLIST_DICT) {
+            error = kServiceOperationBadReply;
+        }
+    }
+    req->cb(error, error ? NULL : dict_get_string(reply, "Error"), reply, req->ctx);
+    if (reply) {
+        plist_free(reply);
+    }
+    free(req);
+}
+
+static void receive_plist(service_connection_t conn, service_plist_cb_t cb, void *ctx)
+{
+    plist_request_t *req = calloc(1, sizeof(plist_request_t));
+    req->cb = cb;
+    req->ctx = ctx;
+    serviceConnectionReceive(conn, serviceFrameMessage, plist_request_received, req);
+}
+
+void servicePlistRequest(service_connection_t conn, plist_t request, int binary, service_plist_cb_t cb, void *ctx)
+{
+    char *data = NULL;
+    uint32_t length = 0;
+
+    if (binary) {
+        plist_to_bin(request, &data, &length);
+    } else {
+        plist_to_xml(request, &data, &length);
+    }
+    serviceConnectionSendMessage(conn, data, length, NULL, NULL);
+    receive_plist(conn, cb, ctx);
+    free(data);
+}
+
+// MARK: - installation_proxy
+
+typedef struct {
+    service_plist_cb_t cb;
+    void *ctx;
+} lookup_t;
+
+static void lookup_received(int error, const char *message, plist_t reply, void *ctx)
+{
+    lookup_t *lookup = ctx;
+    plist_t result = NULL;
+
+    if (!error && message) {
+        error = kServiceOperationFailed;
+    } else if (!error && !(result = plist_dict_get_item(reply, "LookupResult"))) {
+        error = kServiceOperationBadReply;
+    }
+    lookup->cb(error, message, result, lookup->ctx);
+    free(lookup);
+}
+
+void instproxyLookupAsync(service_connection_t conn, plist_t client_options, service_plist_cb_t cb, void *ctx)
+{
+    lookup_t *lookup = calloc(1, sizeof(lookup_t));
+    plist_t command = plist_new_dict();
+
+    lookup->cb = cb;
+    lookup->ctx = ctx;
+    plist_dict_set_item(command, "Command", plist_new_string("Lookup"));
+    if (client_options) {
+        plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
+    }
+    servicePlistRequest(conn, command, 0, lookup_received, lookup);
+    plist_free(command);
+}
+
+// MARK: - springboardservices
+
+typedef struct {
+    service_connection_t conn;
+    char **bundle_ids;
+    size_t count;
+    size_t sent;
+    size_t received;
+    size_t outstanding;
+    int finished;
+    service_icon_cb_t icon_cb;
+    service_result_cb_t cb;
+    void *ctx;
+} icons_t;
+
+static void icons_send_more(icons_t *icons);
+
+static void icons_release(icons_t *icons)
+{
+    if (!icons->finished || icons->outstanding > 0) {
+        return;
+    }
+    for (size_t i = 0; i < icons->count; i++) {
+        free(icons->bundle_ids[i]);
+    }
+    free(icons->bundle_ids);
+    free(icons);
+}
+
+static void icons_finish(icons_t *icons, int error)
+{
+    if (!icons->finished) {
+        icons->finished = 1;
+        icons->cb(error, NULL, icons->ctx);
+    }
+}
+
+static void icon_received(int error, const char *message, plist_t reply, void *ctx)
+{
+    icons_t *icons = ctx;
+    const char *bundle_id = icons->bundle_ids[icons->received++];
+    plist_t node;
+    (void)message;
+
+    icons->outstanding--;
+    if (icons->finished) {
+        icons_release(icons);
+        return;
+    }
+    if (error < 0) {
+        icons_finish(icons, error);
+        icons_release(icons);
+        return;
+    }
+    if (!error && (node = plist_dict_get_item(reply, "pngData")) && plist_get_node_type(node) == PLIST_DATA) {
+        uint64_t length = 0;
+        const char *png = plist_get_data_ptr(node, &length);
+        icons->icon_cb(bundle_id, png, (size_t)length, icons->ctx);
+    } else {
+        icons->icon_cb(bundle_id, NULL, 0, icons->ctx);
+    }
+    if (icons->received == icons->count) {
+        icons_finish(icons, 0);
+        icons_release(icons);
+    } else {
+        icons_send_more(icons);
+    }
+}
+
+static void icons_send_more(icons_t *icons)
+{
+    while (icons->sent < icons->count && icons->sent - icons->received < ICON_WINDOW) {
+        plist_t command = plist_new_dict();
+        plist_dict_set_item(command, "command", plist_new_string("getIconPNGData"));
+        plist_dict_set_item(command, "bundleId", plist_new_string(icons->bundle_ids[icons->sent]));
+        icons->sent++;
+        icons->outstanding++;
+        servicePlistRequest(icons->conn, command, 1, icon_received, icons);
+        plist_free(command);
+    }
+}
+
+void sbservicesGetIconsAsync(service_connection_t conn, const char *const *bundle_ids, size_t count, service_icon_cb_t icon_cb, service_result_cb_t cb, void *ctx)
+{
+    icons_t *icons = calloc(1, sizeof(icons_t));
+
+    icons->conn = conn;
+    icons->bundle_ids = calloc(count ? count : 1, sizeof(char *));
+    for (size_t i = 0; i < count; i++) {
+        icons->bundle_ids[i] = strdup(bundle_ids[i]);
+    }
+    icons->count = count;
+    icons->icon_cb = icon_cb;
+    icons->cb = cb;
+    icons->ctx = ctx;
+    if (count == 0) {
+        icons_finish(icons, 0);
+        icons_release(icons);
+        return;
+    }
+    icons_send_more(icons);
+}
+
+// MARK: - mobile_image_mounter
+
+typedef struct {
+    service_connection_t conn;
+    char *device;
+    char *image_type;
+    int image_fd;
+    uint64_t image_size;
+    char *signature;
+    size_t signature_length;
+    char *mount_path;
+    uint64_t upload_start;
+    int error;
+    char *message;
+    service_result_cb_t cb;
+    void *ctx;
+} mount_t;
+
+static void mount_send(mount_t *mount, const char *command, service_plist_cb_t next);
+
+static void mount_done(int error, const char *message, plist_t reply, void *ctx)
+{
+    mount_t *mount = ctx;
+    (void)error;
+    (void)message;
+    (void)reply;
+
+    // hangup result does not matter, report the mount result
+    close(mount->image_fd);
+    mount->cb(mount->error, mount->message, mount->ctx);
+    free(mount->device);
+    free(mount->image_type);
+    free(mount->signature);
+    free(mount->mount_path);
+    free(mount->message);
+    free(mount);
+}
+
+static void mount_finish(mount_t *mount, int error, const char *message)
+{
+    mount->error = error;
+    mount->message = message ? strdup(message) : NULL;
+    if (error < 0) {
+        mount_done(error, NULL, NULL, mount);
+    } else {
+        mount_send(mount, "Hangup", mount_done);
+    }
+}
+
+static int mount_check_reply(mount_t *mount, int error, const char *message, plist_t reply, const char *status)
+{
+    if (!error && message) {
+        error = strcmp(message, "DeviceLocked") == 0 ? kServiceOperationDeviceLocked : kServiceOperationFailed;
+    } else if (!error && !status_is(reply, status)) {
+        error = kServiceOperationBadReply;
+    }
+    if (error) {
+        mount_finish(mount, error, message);
+        return 0;
+    }
+    return 1;
+}
+
+static void mount_mounted(int error, const char *message, plist_t reply, void *ctx)
+{
+    mount_t *mount = ctx;
+    if (mount_check_reply(mount, error, message, reply, "Complete")) {
+        mount_finish(mount, 0, NULL);
+    }
+}
+
+static void mount_uploaded(int error, const char *message, plist_t reply, void *ctx)
+{
+    mount_t *mount = ctx;
+
+    // record before checking, a failed check can free the request
+    metricsRecord(mount->device, kMetricsImageUpload, mount->upload_start, !error && !message && status_is(reply, "Complete"));
+    if (mount_check_reply(mount, error, message, reply, "Complete")) {
+        metricsAddBytes(mount->device, kMetricsImageUpload, mount->image_size);
+        mount_send(mount, "MountImage", mount_mounted);
+    }
+}
+
+static void mount_acknowledged(int error, const char *message, plist_t reply, void *ctx)
+{
+    mount_t *mount = ctx;
+    if (error || message || !status_is(reply, "ReceiveBytesAck")) {
+        metricsRecord(mount->device, kMetricsImageUpload, mount->upload_start, 0);
+    }
+    if (!mount_check_reply(mount, error, message, reply, "ReceiveBytesAck")) {
+        return;
+    }
+    serviceConnectionSendPipe(mount->conn, mount->image_size, mount->image_fd, NULL, NULL);
+    receive_plist(mount->conn, mount_uploaded, mount);
+}
+
+static void mount_looked_up(int error, const char *message, plist_t reply, void *ctx)
+{
+    mount_t *mount = ctx;
+    plist_t signatures;
+
+    if (error < 0) {
+        // the connection is gone, an upload would fail the same way
+        mount_finish(mount, error, message);
+        return;
+    }
+    // older iOS versions fail LookupImage, in that case just try to mount
+    signatures = error ? NULL : plist_dict_get_item(reply, "ImageSignature");
+    if (signatures && plist_get_node_type(signatures) == PLIST_ARRAY && plist_array_get_size(signatures) > 0) {
+        mount_finish(mount, 0, NULL);
+        return;
+    }
+    mount->upload_start = metricsNow();
+    mount_send(mount, "ReceiveBytes", mount_acknowledged);
+}
+
+static void mount_send(mount_t *mount, const char *command, service_plist_cb_t next)
+{
+    plist_t request = plist_new_dict();
+
+    plist_dict_set_item(request, "Command", plist_new_string(command));
+    if (strcmp(command, "Hangup") != 0) {
+        plist_dict_set_item(request, "ImageType", plist_new_string(mount->image_type));
+    }
+    if (strcmp(command, "ReceiveBytes") == 0) {
+        plist_dict_set_item(request, "ImageSize", plist_new_uint(mount->image_size));
+        plist_dict_set_item(request, "ImageSignature", plist_new_data(mount->signature, mount->signature_length));
+    } else if (strcmp(command, "MountImage") == 0) {
+        plist_dict_set_item(request, "ImagePath", plist_new_string(mount->mount_path));
+        plist_dict_set_item(request, "ImageSignature", plist_new_data(mount->signature, mount->signature_length));
+    }
+    servicePlistRequest(mount->conn, request, 0, next, mount);
+    plist_free(request);
+}
+
+void imageMounterMountAsync(service_connection_t conn, const char *device, const char *image_type, int image_fd, uint64_t image_size, const void *signature, size_t signature_length, const char *mount_path, service_result_cb_t cb, void *ctx)
+{
+    mount_t *mount = calloc(1, sizeof(mount_t));
+
+    mount->conn = conn;
+    mount->device = strdup(device);
+    mount->image_type = strdup(image_type);
+    mount->image_fd = image_fd;
+    mount->image_size = image_size;
+    mount->signature = malloc(signature_length);
+    memcpy(mount->signature, signature, signature_length);
+    mount->signature_length = signature_length;
+    mount->mount_path = strdup(mount_path);
+    mount->cb = cb;
+    mount->ctx = ctx;
+    mount_send(mount, "LookupImage", mount_looked_up);
+}
+
+// MARK: - debugserver
+
+typedef struct {
+    service_connection_t conn;
+    int step;
+    char *arguments;
+    size_t arguments_length;
+    service_result_cb_t cb;
+    void *ctx;
+} launch_t;
+
+enum {
+    kLaunchNoAck,
+    kLaunchSetArgs,
+    kLaunchCheck,
+    kLaunchInterrupt,
+    kLaunchDetach
+};
+
+/**
+ * GDB remote packets are "$payload#checksum". Acknowledgements before the
+ * packet are skipped and the checksum is not verified, TCP already does that.
+ */
+static ssize_t frame_gdb_packet(const uint8_t *buf, size_t length, size_t *payload_offset, size_t *payload_length)
+{
+    size_t start = 0;
+    const uint8_t *end;
+
+    while (start < length && (buf[start] == '+' || buf[start] == '-')) {
+        start++;
+    }
+    if (start == length) {
+        return 0;
+    }
+    if (buf[start] != '$') {
+        return -1;
+    }
+    if (!(end = memchr(buf + start, '#', length - start))) {
+        return 0;
+    }
+    if ((size_t)(end - buf) + 3 > length) {
+        return 0;
+    }
+    *payload_offset = start + 1;
+    *payload_length = (size_t)(end - buf) - start - 1;
+    return (end - buf) + 3;
+}
+
+static void send_gdb_packet(service_connection_t conn, const char *payload, size_t length)
+{
+    char *packet = malloc(length + 5);
+    uint8_t checksum = 0;
+
+    packet[0] = '$';
+    memcpy(packet + 1, payload, length);
+    for (size_t i = 0; i < length; i++) {
+        checksum += (uint8_t)payload[i];
+    }
+    snprintf(packet + length + 1, 4, "#%02x", checksum);
+    serviceConnectionSend(conn, packet, length + 4, NULL, NULL);
+    free(packet);
+}
+
+static void launch_received(service_connection_t conn, int error, const uint8_t *data, size_t length, void *ctx)
+{
+    launch_t *launch = ctx;
+    char *message = NULL;
+    int ok = !error && length >= 2 && memcmp(data, "OK", 2) == 0;
+
+    if (!error && !ok && length > 0 && data[0] == 'O' && launch->step >= kLaunchInterrupt) {
+        // console output from the running app
+        serviceConnectionReceive(conn, frame_gdb_packet, launch_received, launch);
+        return;
+    }
+    switch (launch->step) {
+        case kLaunchNoAck:
+            if (ok) {
+                // acknowledge the reply, from now on there are none
+                serviceConnectionSend(conn, "+", 1, NULL, NULL);
+                send_gdb_packet(conn, launch->arguments, launch->arguments_length);
+                serviceConnectionReceive(conn, frame_gdb_packet, launch_received, launch);
+                launch->step = kLaunchSetArgs;
+                return;
+            }
+            break;
+        case kLaunchSetArgs:
+            if (ok) {
+                send_gdb_packet(conn, "qLaunchSuccess", 14);
+                serviceConnectionReceive(conn, frame_gdb_packet, launch_received, launch);
+                launch->step = kLaunchCheck;
+                return;
+            }
+            break;
+        case kLaunchCheck:
+            if (ok) {
+                // resume, then stop again so we can detach
+                send_gdb_packet(conn, "c", 1);
+                serviceConnectionSend(conn, "\x03", 1, NULL, NULL);
+                serviceConnectionReceive(conn, frame_gdb_packet, launch_received, launch);
+                launch->step = kLaunchInterrupt;
+                return;
+            }
+            break;
+        case kLaunchInterrupt:
+            if (!error) {
+                send_gdb_packet(conn, "D", 1);
+                serviceConnectionReceive(conn, frame_gdb_packet, launch_received, launch);
+                launch->step = kLaunchDetach;
+                return;
+            }
+            break;
+        case kLaunchDetach:
+            break;
+    }
+    if (!error && !ok) {
+        // error replies are "Exx" optionally followed by a description
+        message = strndup((const char *)data, length);
+        error = kServiceOperationFailed;
+    }
+    launch->cb(error, message, launch->ctx);
+    free(message);
+    free(launch->arguments);
+    free(launch);
+}
+
+void debugserverLaunchAsync(service_connection_t conn, const char *executable_path, service_result_cb_t cb, void *ctx)
+{
+    launch_t *launch = calloc(1, sizeof(launch_t));
+    size_t path_length = strlen(executable_path);
+    size_t length = 0;
+    char *packet = malloc(path_length * 2 + 32);
+    static const char hex[] = "0123456789abcdef";
+
+    // argv[0] is the executable, hex encoded
+    length = (size_t)sprintf(packet, "A%zu,0,", path_length * 2);
+    for (size_t i = 0; i < path_length; i++) {
+        packet[length++] = hex[(uint8_t)executable_path[i] >> 4];
+        packet[length++] = hex[(uint8_t)executable_path[i] & 0xf];
+    }
+    launch->conn = conn;
+    launch->arguments = packet;
+    launch->arguments_length = length;
+    launch->cb = cb;
+    launch->ctx = ctx;
+    send_gdb_packet(conn, "QStartNoAckMode", 15);
+    serviceConnectionReceive(conn, frame_gdb_packet, launch_received, launch);
+}
@@ -0,0 +1,62 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef ServiceOperations_h
+#define ServiceOperations_h
+
+#include <plist/plist.h>
+#include "ServiceLoop.h"
+
+/**
+ * Lockdown service protocols implemented on top of ServiceLoop so they never
+ * block a thread. Each operation takes a connected service connection and
+ * reports through its callback on the loop thread. `error` is 0 on success, a
+ * negative errno from the connection, or one of the codes below with the
+ * device's `message` if it sent one. Closing the connection is left to the
+ * caller.
+ */
+typedef enum {
+    kServiceOperationFailed = 1,
+    kServiceOperationBadReply,
+    kServiceOperationDeviceLocked
+} service_operation_error_t;
+
+typedef void (*service_result_cb_t)(int error, const char *message, void *ctx);
+typedef void (*service_plist_cb_t)(int error, const char *message, plist_t reply, void *ctx);
+typedef void (*service_icon_cb_t)(const char *bundle_id, const void *png, size_t length, void *ctx);
+
+void servicePlistRequest(service_connection_t conn, plist_t request, int binary, service_plist_cb_t cb, void *ctx);
+
+/** Reply is the LookupResult dictionary. */
+void instproxyLookupAsync(service_connection_t conn, plist_t client_options, service_plist_cb_t cb, void *ctx);
+
+/** Requests are pipelined. `icon_cb` gets NULL for apps without an icon. */
+void sbservicesGetIconsAsync(service_connection_t conn, const char *const *bundle_ids, size_t count, service_icon_cb_t icon_cb, service_result_cb_t cb, void *ctx);
+
+/**
+ * Uploads and mounts the image unless an image of `image_type` is already
+ * mounted. The image is read from `image_fd`, the read end of a pipe that
+ * another thread fills from the file, so disk reads never block the loop.
+ * `image_fd` is closed before `cb` runs, which makes a writer still blocked on
+ * the pipe fail with EPIPE if no upload was needed. `device` labels the upload
+ * metrics.
+ */
+void imageMounterMountAsync(service_connection_t conn, const char *device, const char *image_type, int image_fd, uint64_t image_size, const void *signature, size_t signature_length, const char *mount_path, service_result_cb_t cb, void *ctx);
+
+/** Launches the app with debugserver and detaches. */
+void debugserverLaunchAsync(service_connection_t conn, const char *executable_path, service_result_cb_t cb, void *ctx);
+
+#endif /* ServiceOperations_h */
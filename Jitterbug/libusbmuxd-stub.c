@@ -33,6 +33,7 @@
 // custom functions
 #include "common/userpref.h"
 #include "CacheStorage.h"
+#include "Metrics.h"
 #include "Jitterbug.h"
 
 #pragma mark - Device listing
@@ -47,10 +48,13 @@ USBMUXD_API int usbmuxd_get_device_by_udid(const char *udid, usbmuxd_device_info
         DEBUG_PRINT("device cannot be null!");
         return -EINVAL;
     }
+    uint64_t start = metricsNow();
     if (!cachePairingGetAddress(udid, device->conn_data)) {
         DEBUG_PRINT("no cache entry for %s", udid);
+        metricsRecord(udid, kMetricsDeviceLookup, start, 0);
         return -ENOENT;
     }
+    metricsRecord(udid, kMetricsDeviceLookup, start, 1);
     strcpy(device->udid, udid);
     device->conn_type = CONNECTION_TYPE_NETWORK;
     return 1;
@@ -78,10 +82,13 @@ USBMUXD_API int usbmuxd_read_pair_record(const char* record_id, char **record_da
 {
     void *data;
     size_t len;
+    uint64_t start = metricsNow();
     if (!cachePairingGetData(record_id, &data, &len)) {
         DEBUG_PRINT("no cache entry for %s", record_id);
+        metricsRecord(record_id, kMetricsPairRecordRead, start, 0);
         return -ENOENT;
     }
+    metricsRecord(record_id, kMetricsPairRecordRead, start, 1);
     *record_data = data;
     *record_size = (uint32_t)len;
     return 0;
@@ -119,37 +119,73 @@ struct DeviceDetailsView: View {
     }
     
     private func refreshAppsList() {
-        main.backgroundTask(message: NSLocalizedString("Querying installed apps...", comment: "DeviceDetailsView")) {
-            try host.startLockdown()
-            try host.updateInfo()
-            apps = try host.installedApps()
-            main.archiveSavedHosts()
+        main.deviceTask(message: NSLocalizedString("Querying installed apps...", comment: "DeviceDetailsView")) { done in
+            host.startLockdown { error in
+                guard error == nil else {
+                    done(error)
+                    return
+                }
+                host.updateInfo { error in
+                    guard error == nil else {
+                        done(error)
+                        return
+                    }
+                    host.installedApps { result, error in
+                        guard let result = result else {
+                            done(error)
+                            return
+                        }
+                        DispatchQueue.main.async {
+                            apps = result
+                            main.archiveSavedHosts()
+                            done(nil)
+                        }
+                    }
+                }
+            }
         }
     }
     
     private func mountImage(_ supportImage: URL) {
-        main.backgroundTask(message: NSLocalizedString("Mounting disk image...", comment: "DeviceDetailsView")) {
+        main.deviceTask(message: NSLocalizedString("Mounting disk image...", comment: "DeviceDetailsView")) { done in
             let supportImageSignature = supportImage.appendingPathExtension("signature")
             main.saveDiskImage(nil, signature: nil, forHostIdentifier: host.identifier)
-            try host.mountImage(for: supportImage, signatureUrl: supportImageSignature)
-            main.saveDiskImage(supportImage, signature: supportImageSignature, forHostIdentifier: host.identifier)
+            host.mountImage(for: supportImage, signatureUrl: supportImageSignature) { error in
+                if error == nil {
+                    main.saveDiskImage(supportImage, signature: supportImageSignature, forHostIdentifier: host.identifier)
+                }
+                done(error)
+            }
         }
     }
     
     private func launchApplication(_ app: JBApp) {
-        main.backgroundTask(message: NSLocalizedString("Launching...", comment: "DeviceDetailsView")) {
-            try host.launchApplication(app)
+        main.deviceTask(message: NSLocalizedString("Launching...", comment: "DeviceDetailsView")) { done in
+            host.launchApplication(app) { error in
+                done(error)
+            }
         }
     }
     
     private func exportPairing() {
-        main.backgroundTask(message: NSLocalizedString("Exporting...", comment: "DeviceDetailsView")) {
-            let data = try host.exportPairing()
-            let path = FileManager.default.temporaryDirectory.appendingPathComponent("\(host.udid).mobiledevicepairing")
-            try data.write(to: path)
-            DispatchQueue.main.async {
-                shareFileUrl = path
-                shareFilePresented.toggle()
+        main.deviceTask(message: NSLocalizedString("Exporting...", comment: "DeviceDetailsView")) { done in
+            host.exportPairing { data, error in
+                guard let data = data else {
+                    done(error)
+                    return
+                }
+                let path = FileManager.default.temporaryDirectory.appendingPathComponent("\(host.udid).mobiledevicepairing")
+                do {
+                    try data.write(to: path)
+                } catch {
+                    done(error)
+                    return
+                }
+                DispatchQueue.main.async {
+                    shareFileUrl = path
+                    shareFilePresented.toggle()
+                    done(nil)
+                }
             }
         }
     }
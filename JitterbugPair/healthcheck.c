@@ -0,0 +1,962 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#define mock_close closesocket
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#define mock_close close
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#include <libimobiledevice-glue/utils.h>
+#include <usbmuxd-proto.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+
+#include "healthcheck.h"
+#include "mdns.h"
+
+#define TOOL_NAME "jitterbugpair"
+#define PAIRING_EXTENSION ".mobiledevicepairing"
+#define MAX_MESSAGE_SIZE (1024 * 1024)
+#define LOCKDOWN_PORT 62078
+#define MOCK_IO_TIMEOUT_MS 5000
+#define MOCK_IDLE_TIMEOUT_MS 30000
+
+typedef struct {
+    char *udid;
+    char *serial;
+    char *path;
+    char *wifi_mac;
+    char *address;
+    char *host;
+    uint16_t port;
+    char *record;
+    uint64_t record_len;
+    uint8_t netaddr[28];
+    size_t netaddr_len;
+    int alive;
+    double latency_ms;
+    char error[128];
+} pairing_entry_t;
+
+typedef struct {
+    pairing_entry_t *entries;
+    size_t count;
+    size_t next;
+    size_t unresolved;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    unsigned int connections;
+    int discover;
+    int listen_fd;
+    uint16_t port;
+    volatile int done;
+} health_check_t;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int ends_with(const char *str, const char *suffix)
+{
+    size_t len = strlen(str);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(str + len - suffix_len, suffix) == 0;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    return strcmp(((const pairing_entry_t *)a)->path, ((const pairing_entry_t *)b)->path);
+}
+
+static char *copy_string(const char *str, size_t len)
+{
+    char *copy = malloc(len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// MARK: - Address encoding
+
+/**
+ * usbmuxd reports network addresses as a BSD style sockaddr (length byte
+ * followed by the family byte) which is what libimobiledevice expects to find
+ * in the device's connection data.
+ */
+static size_t encode_address(const char *address, uint8_t netaddr[static 28])
+{
+    struct in_addr addr4;
+    struct in6_addr addr6;
+
+    memset(netaddr, 0, 28);
+    if (inet_pton(AF_INET, address, &addr4) == 1) {
+        netaddr[0] = 16;
+        netaddr[1] = 0x02;
+        memcpy(&netaddr[4], &addr4, sizeof(addr4));
+        return 16;
+    } else if (inet_pton(AF_INET6, address, &addr6) == 1) {
+        netaddr[0] = 28;
+        netaddr[1] = 0x1E;
+        memcpy(&netaddr[8], &addr6, sizeof(addr6));
+        return 28;
+    } else {
+        return 0;
+    }
+}
+
+/**
+ * Parses "ADDRESS", "IPV4:PORT" or "[IPV6]:PORT". A bare IPv6 address has no
+ * port. `port` is 0 when the device's lockdown port is used.
+ */
+static int parse_address(const char *text, char **host, uint16_t *port)
+{
+    const char *colon = strrchr(text, ':');
+    char *end = NULL;
+    unsigned long value;
+
+    *port = 0;
+    if (text[0] == '[') {
+        const char *bracket = strchr(text, ']');
+        if (!bracket || (bracket[1] != '\0' && bracket[1] != ':')) {
+            return 0;
+        }
+        *host = copy_string(text + 1, (size_t)(bracket - text - 1));
+        colon = bracket[1] == ':' ? bracket + 1 : NULL;
+    } else if (colon && strchr(text, ':') == colon) {
+        *host = copy_string(text, (size_t)(colon - text));
+    } else {
+        *host = strdup(text);
+        colon = NULL;
+    }
+    if (colon) {
+        value = strtoul(colon + 1, &end, 10);
+        if (end == colon + 1 || *end != '\0' || value == 0 || value > 65535) {
+            free(*host);
+            *host = NULL;
+            return 0;
+        }
+        *port = (uint16_t)value;
+    }
+    return 1;
+}
+
+// MARK: - Loading pairings
+
+/**
+ * The responder lists every pairing file as its own device and libimobiledevice
+ * asks for the pair record by serial number, so files sharing a UDID (a stale
+ * and a fresh pairing of the same device) each need a serial number of their
+ * own. The first file keeps the UDID, later ones get "UDID#N".
+ */
+static void assign_serials(health_check_t *hc)
+{
+    for (size_t i = 0; i < hc->count; i++) {
+        pairing_entry_t *entry = &hc->entries[i];
+        size_t len = strlen(entry->udid) + 24;
+        size_t j;
+
+        for (j = 0; j < i && strcmp(hc->entries[j].udid, entry->udid) != 0; j++);
+        if (j == i) {
+            entry->serial = strdup(entry->udid);
+            continue;
+        }
+        entry->serial = malloc(len);
+        snprintf(entry->serial, len, "%s#%zu", entry->udid, i + 1);
+    }
+}
+
+static int load_pairings(health_check_t *hc, const char *pairing_dir)
+{
+    DIR *dir;
+    struct dirent *ent;
+    size_t capacity = 16;
+
+    if (!(dir = opendir(pairing_dir))) {
+        fprintf(stderr, "ERROR: Cannot open directory %s\n", pairing_dir);
+        return 0;
+    }
+    hc->entries = calloc(capacity, sizeof(pairing_entry_t));
+    while ((ent = readdir(dir)) != NULL) {
+        pairing_entry_t *entry;
+        plist_t pair_record = NULL;
+        char *path = NULL;
+        char *udid = NULL;
+
+        if (!ends_with(ent->d_name, PAIRING_EXTENSION)) {
+            continue;
+        }
+        asprintf(&path, "%s/%s", pairing_dir, ent->d_name);
+        plist_read_from_filename(&pair_record, path);
+        if (pair_record) {
+            plist_get_string_val(plist_dict_get_item(pair_record, "UDID"), &udid);
+        }
+        if (!udid) {
+            fprintf(stderr, "WARNING: Skipping %s, pairing data missing key 'UDID'\n", path);
+            plist_free(pair_record);
+            free(path);
+            continue;
+        }
+        if (hc->count == capacity) {
+            capacity *= 2;
+            hc->entries = realloc(hc->entries, capacity * sizeof(pairing_entry_t));
+            memset(&hc->entries[hc->count], 0, (capacity - hc->count) * sizeof(pairing_entry_t));
+        }
+        entry = &hc->entries[hc->count++];
+        entry->udid = udid;
+        entry->path = path;
+        plist_get_string_val(plist_dict_get_item(pair_record, "WiFiMACAddress"), &entry->wifi_mac);
+        plist_free(pair_record);
+        buffer_read_from_filename(path, &entry->record, &entry->record_len);
+    }
+    closedir(dir);
+    qsort(hc->entries, hc->count, sizeof(pairing_entry_t), compare_entries);
+    assign_serials(hc);
+    return 1;
+}
+
+static int load_address_map(health_check_t *hc, const char *address_map)
+{
+    FILE *f;
+    char line[512];
+
+    if (!(f = fopen(address_map, "r"))) {
+        fprintf(stderr, "ERROR: Cannot open address map %s\n", address_map);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *save = NULL;
+        char *udid = strtok_r(line, " \t\r\n", &save);
+        char *address = strtok_r(NULL, " \t\r\n", &save);
+        if (!udid || udid[0] == '#') {
+            continue;
+        }
+        if (!address) {
+            fprintf(stderr, "WARNING: No address given for %s\n", udid);
+            continue;
+        }
+        for (size_t i = 0; i < hc->count; i++) {
+            pairing_entry_t *entry = &hc->entries[i];
+            if (strcmp(entry->udid, udid) != 0) {
+                continue;
+            }
+            free(entry->address);
+            free(entry->host);
+            entry->address = strdup(address);
+            entry->host = NULL;
+            entry->netaddr_len = 0;
+            if (parse_address(address, &entry->host, &entry->port)) {
+                entry->netaddr_len = encode_address(entry->host, entry->netaddr);
+            }
+            if (entry->netaddr_len == 0) {
+                fprintf(stderr, "WARNING: Invalid address %s for %s\n", address, udid);
+            }
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+// MARK: - Discovery
+
+/**
+ * Instances of _apple-mobdev2._tcp are named "MAC@IPv6" where MAC is the
+ * device's Wi-Fi address, which is also saved in the pair record.
+ */
+static int discovered_device(const char *instance, const char *address, int added, void *user_data)
+{
+    health_check_t *hc = user_data;
+    const char *at = strchr(instance, '@');
+    size_t mac_len = at ? (size_t)(at - instance) : 0;
+
+    if (!added || mac_len == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < hc->count; i++) {
+        pairing_entry_t *entry = &hc->entries[i];
+        if (entry->address || !entry->wifi_mac) {
+            continue;
+        }
+        if (strlen(entry->wifi_mac) != mac_len || strncasecmp(entry->wifi_mac, instance, mac_len) != 0) {
+            continue;
+        }
+        entry->address = strdup(address);
+        entry->host = strdup(address);
+        entry->netaddr_len = encode_address(address, entry->netaddr);
+        hc->unresolved--;
+    }
+    return hc->unresolved == 0;
+}
+
+/**
+ * Looks up devices missing from the address map. With `cache_path`, records
+ * from the last run that are still within their TTL are loaded first, so a
+ * repeated scan can skip the network entirely.
+ */
+static void discover_addresses(health_check_t *hc, const char *cache_path)
+{
+    mdns_browser_t browser;
+
+    for (size_t i = 0; i < hc->count; i++) {
+        if (!hc->entries[i].address && hc->entries[i].wifi_mac) {
+            hc->unresolved++;
+        }
+    }
+    if (hc->unresolved == 0) {
+        return;
+    }
+    if (!(browser = mdns_browser_new(MDNS_SERVICE_MOBDEV2, MDNS_GROUP, MDNS_PORT, NULL))) {
+        fprintf(stderr, "WARNING: Failed to start mDNS browser\n");
+        return;
+    }
+    if (cache_path) {
+        mdns_browser_load(browser, cache_path);
+    }
+    mdns_browser_run(browser, HEALTH_CHECK_BROWSE_TIMEOUT, discovered_device, hc);
+    if (cache_path && !mdns_browser_save(browser, cache_path)) {
+        fprintf(stderr, "WARNING: Cannot write mDNS cache %s\n", cache_path);
+    }
+    mdns_browser_free(browser);
+}
+
+// MARK: - Mock usbmuxd
+
+/**
+ * libusbmuxd connects to `USBMUXD_SOCKET_ADDRESS` when it is set, so we answer
+ * device lookups and pair record reads from the files we were given. This lets
+ * us connect to any device in the address map without a running usbmuxd and
+ * without touching the system's pairing records. Devices mapped to a custom
+ * port (such as a forwarded lockdown port) are listed as USB devices and
+ * their "Connect" requests are proxied to that port.
+ *
+ * Each connection is served on its own thread with I/O timeouts so one stuck
+ * client cannot hold up the others.
+ */
+static void mock_set_socket_options(int fd)
+{
+#ifdef WIN32
+    DWORD timeout = MOCK_IO_TIMEOUT_MS;
+#else
+    struct timeval timeout = { MOCK_IO_TIMEOUT_MS / 1000, (MOCK_IO_TIMEOUT_MS % 1000) * 1000 };
+#endif
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+static int mock_send_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return 0;
+        }
+        p += sent;
+        len -= sent;
+    }
+    return 1;
+}
+
+static int mock_recv_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t got = recv(fd, p, len, 0);
+        if (got <= 0) {
+            return 0;
+        }
+        p += got;
+        len -= got;
+    }
+    return 1;
+}
+
+static int mock_send_plist(int fd, uint32_t tag, plist_t reply)
+{
+    struct usbmuxd_header hdr;
+    char *xml = NULL;
+    uint32_t xml_len = 0;
+    int ret;
+
+    plist_to_xml(reply, &xml, &xml_len);
+    hdr.length = sizeof(hdr) + xml_len;
+    hdr.version = 1;
+    hdr.message = MESSAGE_PLIST;
+    hdr.tag = tag;
+    ret = mock_send_all(fd, &hdr, sizeof(hdr)) && mock_send_all(fd, xml, xml_len);
+    free(xml);
+    return ret;
+}
+
+static plist_t mock_result(uint32_t number)
+{
+    plist_t reply = plist_new_dict();
+    plist_dict_set_item(reply, "MessageType", plist_new_string("Result"));
+    plist_dict_set_item(reply, "Number", plist_new_uint(number));
+    return reply;
+}
+
+static plist_t mock_list_devices(health_check_t *hc)
+{
+    plist_t reply = plist_new_dict();
+    plist_t list = plist_new_array();
+    for (size_t i = 0; i < hc->count; i++) {
+        pairing_entry_t *entry = &hc->entries[i];
+        if (entry->netaddr_len == 0) {
+            continue;
+        }
+        plist_t props = plist_new_dict();
+        plist_dict_set_item(props, "DeviceID", plist_new_uint(i + 1));
+        plist_dict_set_item(props, "SerialNumber", plist_new_string(entry->serial));
+        if (entry->port) {
+            // connections go through us, see mock_connect_device()
+            plist_dict_set_item(props, "ConnectionType", plist_new_string("USB"));
+            plist_dict_set_item(props, "ProductID", plist_new_uint(0));
+            plist_dict_set_item(props, "LocationID", plist_new_uint(0));
+        } else {
+            plist_dict_set_item(props, "ConnectionType", plist_new_string("Network"));
+            plist_dict_set_item(props, "NetworkAddress", plist_new_data((const char *)entry->netaddr, entry->netaddr_len));
+        }
+        plist_t device = plist_new_dict();
+        plist_dict_set_item(device, "MessageType", plist_new_string("Attached"));
+        plist_dict_set_item(device, "DeviceID", plist_new_uint(i + 1));
+        plist_dict_set_item(device, "Properties", props);
+        plist_array_append_item(list, device);
+    }
+    plist_dict_set_item(reply, "DeviceList", list);
+    return reply;
+}
+
+static plist_t mock_read_pair_record(health_check_t *hc, plist_t request)
+{
+    char *udid = NULL;
+    plist_t reply = NULL;
+
+    plist_get_string_val(plist_dict_get_item(request, "PairRecordID"), &udid);
+    if (!udid) {
+        return mock_result(RESULT_BADDEV);
+    }
+    for (size_t i = 0; i < hc->count; i++) {
+        pairing_entry_t *entry = &hc->entries[i];
+        if (entry->record && strcmp(entry->serial, udid) == 0) {
+            reply = plist_new_dict();
+            plist_dict_set_item(reply, "PairRecordData", plist_new_data(entry->record, entry->record_len));
+            break;
+        }
+    }
+    free(udid);
+    return reply ? reply : mock_result(RESULT_BADDEV);
+}
+
+static int connect_with_timeout(const char *host, uint16_t port)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo *res = NULL;
+    char service[8];
+    int fd = -1;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    snprintf(service, sizeof(service), "%u", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        return -1;
+    }
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd_set fds;
+        struct timeval tv = { MOCK_IO_TIMEOUT_MS / 1000, (MOCK_IO_TIMEOUT_MS % 1000) * 1000 };
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+
+        if ((fd = (int)socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+            continue;
+        }
+#ifdef WIN32
+        u_long mode = 1;
+        ioctlsocket(fd, FIONBIO, &mode);
+#else
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+        connect(fd, ai->ai_addr, (socklen_t)ai->ai_addrlen);
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        if (select(fd + 1, NULL, &fds, NULL, &tv) != 1 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, (char *)&err, &err_len) != 0 || err != 0) {
+            mock_close(fd);
+            fd = -1;
+            continue;
+        }
+#ifdef WIN32
+        mode = 0;
+        ioctlsocket(fd, FIONBIO, &mode);
+#else
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+#endif
+        mock_set_socket_options(fd);
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/**
+ * Connects to the device for a "Connect" request. Requests for the lockdown
+ * port go to the port from the address map, others to the same port on the
+ * mapped host. Returns the socket or -1.
+ */
+static int mock_connect_device(health_check_t *hc, plist_t request)
+{
+    uint64_t device_id = 0;
+    uint64_t port_number = 0;
+    uint16_t port;
+    pairing_entry_t *entry;
+
+    plist_get_uint_val(plist_dict_get_item(request, "DeviceID"), &device_id);
+    plist_get_uint_val(plist_dict_get_item(request, "PortNumber"), &port_number);
+    if (device_id == 0 || device_id > hc->count) {
+        return -1;
+    }
+    entry = &hc->entries[device_id - 1];
+    if (!entry->port || !entry->host) {
+        return -1;
+    }
+    // libusbmuxd sends the port in network byte order
+    port = ntohs((uint16_t)port_number);
+    return connect_with_timeout(entry->host, port == LOCKDOWN_PORT ? entry->port : port);
+}
+
+static int mock_forward(int from, int to)
+{
+    char buf[16384];
+    ssize_t got = recv(from, buf, sizeof(buf), 0);
+    return got > 0 && mock_send_all(to, buf, (size_t)got);
+}
+
+static void mock_splice(int client, int device)
+{
+    for (;;) {
+        fd_set fds;
+        struct timeval tv = { MOCK_IDLE_TIMEOUT_MS / 1000, (MOCK_IDLE_TIMEOUT_MS % 1000) * 1000 };
+
+        FD_ZERO(&fds);
+        FD_SET(client, &fds);
+        FD_SET(device, &fds);
+        if (select((client > device ? client : device) + 1, &fds, NULL, NULL, &tv) <= 0) {
+            break;
+        }
+        if (FD_ISSET(client, &fds) && !mock_forward(client, device)) {
+            break;
+        }
+        if (FD_ISSET(device, &fds) && !mock_forward(device, client)) {
+            break;
+        }
+    }
+}
+
+static void mock_handle_connection(health_check_t *hc, int fd)
+{
+    struct usbmuxd_header hdr;
+    char *payload = NULL;
+    plist_t request = NULL;
+    plist_t reply = NULL;
+    char *type = NULL;
+    int device_fd = -1;
+
+    if (!mock_recv_all(fd, &hdr, sizeof(hdr))) {
+        return;
+    }
+    if (hdr.length < sizeof(hdr) || hdr.length > MAX_MESSAGE_SIZE) {
+        return;
+    }
+    if (hdr.message != MESSAGE_PLIST) {
+        // tell libusbmuxd to use the plist protocol
+        reply = mock_result(RESULT_BADVERSION);
+        goto send;
+    }
+    payload = malloc(hdr.length - sizeof(hdr));
+    if (!mock_recv_all(fd, payload, hdr.length - sizeof(hdr))) {
+        goto end;
+    }
+    plist_from_xml(payload, hdr.length - sizeof(hdr), &request);
+    plist_get_string_val(plist_dict_get_item(request, "MessageType"), &type);
+    if (type && strcmp(type, "ListDevices") == 0) {
+        reply = mock_list_devices(hc);
+    } else if (type && strcmp(type, "ReadPairRecord") == 0) {
+        reply = mock_read_pair_record(hc, request);
+    } else if (type && strcmp(type, "Connect") == 0) {
+        device_fd = mock_connect_device(hc, request);
+        reply = mock_result(device_fd >= 0 ? RESULT_OK : RESULT_CONNREFUSED);
+    } else {
+        reply = mock_result(RESULT_BADCOMMAND);
+    }
+
+send:
+    if (mock_send_plist(fd, hdr.tag, reply) && device_fd >= 0) {
+        // from here on the connection belongs to the device
+        mock_splice(fd, device_fd);
+    }
+end:
+    if (device_fd >= 0) {
+        mock_close(device_fd);
+    }
+    if (reply) {
+        plist_free(reply);
+    }
+    if (request) {
+        plist_free(request);
+    }
+    free(type);
+    free(payload);
+}
+
+typedef struct {
+    health_check_t *hc;
+    int fd;
+} mock_connection_t;
+
+static void *mock_connection_thread(void *arg)
+{
+    mock_connection_t *conn = arg;
+    health_check_t *hc = conn->hc;
+
+    mock_handle_connection(hc, conn->fd);
+    mock_close(conn->fd);
+    free(conn);
+    pthread_mutex_lock(&hc->lock);
+    hc->connections--;
+    pthread_cond_signal(&hc->idle);
+    pthread_mutex_unlock(&hc->lock);
+    return NULL;
+}
+
+static void *mock_usbmuxd_thread(void *arg)
+{
+    health_check_t *hc = arg;
+
+    while (!hc->done) {
+        mock_connection_t *conn;
+        pthread_t thread;
+        int fd = (int)accept(hc->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            break;
+        }
+        if (hc->done) {
+            mock_close(fd);
+            break;
+        }
+        mock_set_socket_options(fd);
+        conn = calloc(1, sizeof(mock_connection_t));
+        conn->hc = hc;
+        conn->fd = fd;
+        pthread_mutex_lock(&hc->lock);
+        hc->connections++;
+        pthread_mutex_unlock(&hc->lock);
+        if (pthread_create(&thread, NULL, mock_connection_thread, conn) == 0) {
+            pthread_detach(thread);
+        } else {
+            mock_connection_thread(conn);
+        }
+    }
+    return NULL;
+}
+
+static int mock_usbmuxd_start(health_check_t *hc, pthread_t *thread)
+{
+    struct sockaddr_in addr = {0};
+    socklen_t addr_len = sizeof(addr);
+    char *env = NULL;
+
+#ifdef WIN32
+    WSADATA wsa_data;
+    WSAStartup(MAKEWORD(2, 2), &wsa_data);
+#endif
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    hc->listen_fd = (int)socket(AF_INET, SOCK_STREAM, 0);
+    if (hc->listen_fd < 0) {
+        return 0;
+    }
+    if (bind(hc->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(hc->listen_fd, 128) != 0 ||
+        getsockname(hc->listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        mock_close(hc->listen_fd);
+        return 0;
+    }
+    hc->port = ntohs(addr.sin_port);
+    asprintf(&env, "127.0.0.1:%u", hc->port);
+#ifdef WIN32
+    _putenv_s("USBMUXD_SOCKET_ADDRESS", env);
+#else
+    setenv("USBMUXD_SOCKET_ADDRESS", env, 1);
+#endif
+    free(env);
+    if (pthread_create(thread, NULL, mock_usbmuxd_thread, hc) != 0) {
+        mock_close(hc->listen_fd);
+        return 0;
+    }
+    return 1;
+}
+
+static void mock_usbmuxd_stop(health_check_t *hc, pthread_t thread)
+{
+    struct sockaddr_in addr = {0};
+    int fd;
+
+    // wake up the listener thread so it sees the done flag
+    hc->done = 1;
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(hc->port);
+    fd = (int)socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0) {
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+        mock_close(fd);
+    }
+    pthread_join(thread, NULL);
+    mock_close(hc->listen_fd);
+    // connection threads end on their own once the clients hang up or time out
+    pthread_mutex_lock(&hc->lock);
+    while (hc->connections > 0) {
+        pthread_cond_wait(&hc->idle, &hc->lock);
+    }
+    pthread_mutex_unlock(&hc->lock);
+}
+
+// MARK: - Checking devices
+
+static const char *lockdown_error_string(lockdownd_error_t err)
+{
+    switch (err) {
+        case LOCKDOWN_E_PASSWORD_PROTECTED:
+            return "Passcode is set, device must be unlocked";
+        case LOCKDOWN_E_INVALID_CONF:
+        case LOCKDOWN_E_INVALID_HOST_ID:
+            return "Device is not paired with this host";
+        case LOCKDOWN_E_SSL_ERROR:
+            return "SSL handshake failed, pairing may be revoked";
+        case LOCKDOWN_E_MUX_ERROR:
+            return "Cannot connect to device";
+        case LOCKDOWN_E_RECEIVE_TIMEOUT:
+            return "Timed out waiting for device";
+        default:
+            return NULL;
+    }
+}
+
+static void check_device(health_check_t *hc, pairing_entry_t *entry)
+{
+    idevice_t device = NULL;
+    lockdownd_client_t client = NULL;
+    idevice_error_t derr;
+    lockdownd_error_t lerr;
+    const char *reason;
+    double start;
+
+    if (!entry->address && hc->discover && !entry->wifi_mac) {
+        snprintf(entry->error, sizeof(entry->error), "Not in address map and pairing has no WiFiMACAddress for mDNS");
+        return;
+    } else if (!entry->address && hc->discover) {
+        snprintf(entry->error, sizeof(entry->error), "Not found via mDNS");
+        return;
+    } else if (!entry->address) {
+        snprintf(entry->error, sizeof(entry->error), "No address in map");
+        return;
+    }
+    if (entry->netaddr_len == 0) {
+        snprintf(entry->error, sizeof(entry->error), "Invalid address");
+        return;
+    }
+    if (!entry->record) {
+        snprintf(entry->error, sizeof(entry->error), "Cannot read pairing file");
+        return;
+    }
+    start = now_ms();
+    derr = idevice_new_with_options(&device, entry->serial, entry->port ? IDEVICE_LOOKUP_USBMUX : IDEVICE_LOOKUP_NETWORK);
+    if (derr != IDEVICE_E_SUCCESS) {
+        snprintf(entry->error, sizeof(entry->error), "Failed to create device, error code %d", derr);
+        return;
+    }
+    lerr = lockdownd_client_new_with_handshake(device, &client, TOOL_NAME);
+    entry->latency_ms = now_ms() - start;
+    if (lerr == LOCKDOWN_E_SUCCESS) {
+        entry->alive = 1;
+        lockdownd_client_free(client);
+    } else if ((reason = lockdown_error_string(lerr)) != NULL) {
+        snprintf(entry->error, sizeof(entry->error), "%s", reason);
+    } else {
+        snprintf(entry->error, sizeof(entry->error), "Lockdown error code %d", lerr);
+    }
+    idevice_free(device);
+}
+
+static void *check_worker_thread(void *arg)
+{
+    health_check_t *hc = arg;
+
+    for (;;) {
+        size_t i;
+        pthread_mutex_lock(&hc->lock);
+        i = hc->next++;
+        pthread_mutex_unlock(&hc->lock);
+        if (i >= hc->count) {
+            break;
+        }
+        check_device(hc, &hc->entries[i]);
+    }
+    return NULL;
+}
+
+// MARK: - Report
+
+static void print_json_string(const char *str)
+{
+    if (!str) {
+        printf("null");
+        return;
+    }
+    putchar('"');
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        switch (*p) {
+            case '"': printf("\\\""); break;
+            case '\\': printf("\\\\"); break;
+            case '\n': printf("\\n"); break;
+            case '\r': printf("\\r"); break;
+            case '\t': printf("\\t"); break;
+            default:
+                if (*p < 0x20) {
+                    printf("\\u%04x", *p);
+                } else {
+                    putchar(*p);
+                }
+                break;
+        }
+    }
+    putchar('"');
+}
+
+static void print_report(health_check_t *hc)
+{
+    printf("[\n");
+    for (size_t i = 0; i < hc->count; i++) {
+        pairing_entry_t *entry = &hc->entries[i];
+        printf("  {\"udid\": ");
+        print_json_string(entry->udid);
+        printf(", \"file\": ");
+        print_json_string(entry->path);
+        printf(", \"address\": ");
+        print_json_string(entry->address);
+        printf(", \"alive\": %s", entry->alive ? "true" : "false");
+        if (entry->latency_ms > 0) {
+            printf(", \"latency_ms\": %.3f", entry->latency_ms);
+        } else {
+            printf(", \"latency_ms\": null");
+        }
+        printf(", \"error\": ");
+        print_json_string(entry->alive ? NULL : entry->error);
+        printf("}%s\n", i + 1 < hc->count ? "," : "");
+    }
+    printf("]\n");
+}
+
+int health_check(const char *pairing_dir, const char *address_map, int discover, const char *mdns_cache, unsigned int max_jobs)
+{
+    health_check_t hc = {0};
+    pthread_t mock_thread;
+    pthread_t *workers = NULL;
+    unsigned int jobs;
+    int result = EXIT_FAILURE;
+
+    pthread_mutex_init(&hc.lock, NULL);
+    pthread_cond_init(&hc.idle, NULL);
+    hc.discover = discover;
+#ifndef WIN32
+    // a device hanging up mid-write must not kill the whole scan
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    if (!load_pairings(&hc, pairing_dir)) {
+        goto leave;
+    }
+    if (address_map && !load_address_map(&hc, address_map)) {
+        goto leave;
+    }
+    if (discover) {
+        discover_addresses(&hc, mdns_cache);
+    }
+    if (!mock_usbmuxd_start(&hc, &mock_thread)) {
+        fprintf(stderr, "ERROR: Failed to start usbmuxd responder\n");
+        goto leave;
+    }
+
+    jobs = max_jobs > 0 ? max_jobs : HEALTH_CHECK_DEFAULT_JOBS;
+    if (jobs > hc.count) {
+        jobs = (unsigned int)hc.count;
+    }
+    workers = calloc(jobs, sizeof(pthread_t));
+    for (unsigned int i = 0; i < jobs; i++) {
+        pthread_create(&workers[i], NULL, check_worker_thread, &hc);
+    }
+    for (unsigned int i = 0; i < jobs; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    mock_usbmuxd_stop(&hc, mock_thread);
+
+    print_report(&hc);
+    result = EXIT_SUCCESS;
+
+leave:
+    for (size_t i = 0; i < hc.count; i++) {
+        free(hc.entries[i].udid);
+        free(hc.entries[i].serial);
+        free(hc.entries[i].path);
+        free(hc.entries[i].wifi_mac);
+        free(hc.entries[i].address);
+        free(hc.entries[i].host);
+        free(hc.entries[i].record);
+    }
+    free(hc.entries);
+    pthread_cond_destroy(&hc.idle);
+    pthread_mutex_destroy(&hc.lock);
+    return result;
+}
@@ -0,0 +1,34 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef healthcheck_h
+#define healthcheck_h
+
+#define HEALTH_CHECK_DEFAULT_JOBS 16
+#define HEALTH_CHECK_BROWSE_TIMEOUT 5000
+
+/**
+ * Connects to every device with a pairing in `pairing_dir` and validates the
+ * lockdown session, up to `max_jobs` at a time. `address_map` is a text file
+ * with one "UDID ADDRESS[:PORT]" pair per line (IPv6 with a port as
+ * "[ADDRESS]:PORT"), where PORT replaces the lockdown port. If `discover` is
+ * set, devices missing from the map are looked up with mDNS, reusing the
+ * records saved in `mdns_cache` (if not NULL) by the previous run while their
+ * TTLs last. Results are written to stdout as JSON.
+ */
+int health_check(const char *pairing_dir, const char *address_map, int discover, const char *mdns_cache, unsigned int max_jobs);
+
+#endif /* healthcheck_h */
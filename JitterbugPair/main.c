@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include <libimobiledevice-glue/utils.h>
 #include "common/userpref.h"
+#include "healthcheck.h"
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -72,6 +73,13 @@ int print_help(void) {
     fprintf(stderr, "  -u UDID  dump connected device with UDID (first device if unspecified)\n");
     fprintf(stderr, "  -c       dump to stdout instead of file\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "health check options:\n");
+    fprintf(stderr, "  -s DIR   check every .mobiledevicepairing in DIR and print a JSON report\n");
+    fprintf(stderr, "  -a FILE  file mapping each UDID to an address, one \"UDID ADDRESS[:PORT]\" per line\n");
+    fprintf(stderr, "  -m       find addresses not in the map with mDNS (_apple-mobdev2._tcp)\n");
+    fprintf(stderr, "  -M FILE  like -m, and keep mDNS records in FILE for the next run\n");
+    fprintf(stderr, "  -j N     check up to N devices at once (default %d)\n", HEALTH_CHECK_DEFAULT_JOBS);
+    fprintf(stderr, "\n");
     return EXIT_FAILURE;
 }
 
@@ -88,8 +96,13 @@ int main(int argc, const char * argv[]) {
     plist_t pair_record = NULL;
     char *host_id = NULL;
     char *session_id = NULL;
+    char *scan_dir = NULL;
+    char *address_map = NULL;
+    char *mdns_cache = NULL;
+    unsigned int jobs = HEALTH_CHECK_DEFAULT_JOBS;
+    int discover = 0;
     
-    while ((c = getopt(argc, argv, "lu:c")) != -1) {
+    while ((c = getopt(argc, argv, "lu:cs:a:mM:j:")) != -1) {
         switch (c) {
             case 'l': {
                 return print_udids();
@@ -102,6 +115,27 @@ int main(int argc, const char * argv[]) {
                 path = strdup("/dev/stdout");
                 break;
             }
+            case 's': {
+                scan_dir = strdup(optarg);
+                break;
+            }
+            case 'a': {
+                address_map = strdup(optarg);
+                break;
+            }
+            case 'm': {
+                discover = 1;
+                break;
+            }
+            case 'M': {
+                discover = 1;
+                mdns_cache = strdup(optarg);
+                break;
+            }
+            case 'j': {
+                jobs = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            }
             case '?':
             default: {
                 return print_help();
@@ -109,6 +143,17 @@ int main(int argc, const char * argv[]) {
         }
     }
     
+    if (scan_dir) {
+        if (!address_map && !discover) {
+            return print_help();
+        }
+        result = health_check(scan_dir, address_map, discover, mdns_cache, jobs);
+        free(scan_dir);
+        free(address_map);
+        free(mdns_cache);
+        return result;
+    }
+    
     ret = idevice_new(&device, udid);
     if (ret != IDEVICE_E_SUCCESS) {
         if (udid) {
@@ -0,0 +1,638 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#define mdns_close closesocket
+#define poll WSAPoll
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#define mdns_close close
+#endif
+
+#include "mdns.h"
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_PTR 12
+#define DNS_TYPE_AAAA 28
+#define DNS_TYPE_SRV 33
+#define DNS_CLASS_IN 1
+#define DNS_CLASS_MASK 0x7FFF
+#define DNS_CACHE_FLUSH 0x8000
+#define DNS_FLAG_RESPONSE 0x8000
+#define DNS_HEADER_SIZE 12
+
+#define MAX_NAME 256
+#define MAX_ADDRESS 46
+#define MAX_PACKET 9000
+#define QUERY_PACKET 1500
+#define MAX_QUERY_INTERVAL 8000
+#define RESOLVE_INTERVAL 250
+#define GOODBYE_DELAY 1000
+
+typedef struct {
+    char name[MAX_NAME];
+    uint16_t type;
+    char data[MAX_NAME];
+    uint64_t expires;
+} mdns_record_t;
+
+typedef struct {
+    char instance[MAX_NAME];
+    char address[MAX_ADDRESS];
+} mdns_instance_t;
+
+struct mdns_browser {
+    int fd;
+    char service[MAX_NAME];
+    struct sockaddr_in group;
+    mdns_record_t *records;
+    size_t record_count;
+    size_t record_capacity;
+    mdns_instance_t *reported;
+    size_t reported_count;
+    size_t reported_capacity;
+    int needs_resolve;
+};
+
+static uint64_t mdns_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t wall_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint16_t read16(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void write16(uint8_t *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xFF;
+}
+
+// MARK: - Names
+
+static int read_name(const uint8_t *packet, size_t len, size_t *offset, char name[static MAX_NAME])
+{
+    size_t pos = *offset;
+    size_t out = 0;
+    int jumped = 0;
+    int jumps = 0;
+
+    while (pos < len) {
+        uint8_t label = packet[pos];
+        if (label == 0) {
+            if (!jumped) {
+                *offset = pos + 1;
+            }
+            name[out > 0 ? out - 1 : 0] = '\0';
+            return 1;
+        }
+        if ((label & 0xC0) == 0xC0) {
+            if (pos + 1 >= len || ++jumps > 32) {
+                return 0;
+            }
+            if (!jumped) {
+                *offset = pos + 2;
+            }
+            jumped = 1;
+            pos = ((label & 0x3F) << 8) | packet[pos + 1];
+            continue;
+        }
+        if ((label & 0xC0) != 0 || pos + 1 + label > len || out + label + 1 >= MAX_NAME) {
+            return 0;
+        }
+        memcpy(&name[out], &packet[pos + 1], label);
+        out += label;
+        name[out++] = '.';
+        pos += 1 + label;
+    }
+    return 0;
+}
+
+static int write_name(uint8_t *packet, size_t len, size_t *offset, const char *name)
+{
+    const char *p = name;
+
+    while (*p) {
+        const char *dot = strchr(p, '.');
+        size_t label = dot ? (size_t)(dot - p) : strlen(p);
+        if (label == 0 || label > 63 || *offset + 1 + label >= len) {
+            return 0;
+        }
+        packet[(*offset)++] = (uint8_t)label;
+        memcpy(&packet[*offset], p, label);
+        *offset += label;
+        p += label;
+        if (*p == '.') {
+            p++;
+        }
+    }
+    if (*offset >= len) {
+        return 0;
+    }
+    packet[(*offset)++] = 0;
+    return 1;
+}
+
+static int write_question(uint8_t *packet, size_t len, size_t *offset, const char *name, uint16_t type)
+{
+    size_t start = *offset;
+
+    if (!write_name(packet, len, offset, name) || *offset + 4 > len) {
+        *offset = start;
+        return 0;
+    }
+    write16(&packet[*offset], type);
+    write16(&packet[*offset + 2], DNS_CLASS_IN);
+    *offset += 4;
+    return 1;
+}
+
+// MARK: - Cache
+
+static mdns_record_t *find_record(mdns_browser_t browser, const char *name, uint16_t type, uint64_t now)
+{
+    for (size_t i = 0; i < browser->record_count; i++) {
+        mdns_record_t *record = &browser->records[i];
+        if (record->type == type && record->expires > now && strcasecmp(record->name, name) == 0) {
+            return record;
+        }
+    }
+    return NULL;
+}
+
+static void cache_record(mdns_browser_t browser, const mdns_record_t *record, uint32_t ttl, int flush, uint64_t now)
+{
+    mdns_record_t *existing = NULL;
+
+    for (size_t i = 0; i < browser->record_count; i++) {
+        mdns_record_t *other = &browser->records[i];
+        if (other->type != record->type || strcasecmp(other->name, record->name) != 0) {
+            continue;
+        }
+        if (strcasecmp(other->data, record->data) == 0) {
+            existing = other;
+        } else if (flush && other->expires > now + GOODBYE_DELAY) {
+            // unique record set replaced by the sender (RFC 6762 section 10.2)
+            other->expires = now + GOODBYE_DELAY;
+        }
+    }
+    if (existing) {
+        // a TTL of zero is a goodbye, keep it around briefly in case of a refresh
+        existing->expires = ttl > 0 ? now + (uint64_t)ttl * 1000 : now + GOODBYE_DELAY;
+        return;
+    }
+    if (ttl == 0) {
+        return;
+    }
+    if (browser->record_count == browser->record_capacity) {
+        browser->record_capacity = browser->record_capacity ? browser->record_capacity * 2 : 32;
+        browser->records = realloc(browser->records, browser->record_capacity * sizeof(mdns_record_t));
+    }
+    existing = &browser->records[browser->record_count++];
+    *existing = *record;
+    existing->expires = now + (uint64_t)ttl * 1000;
+}
+
+static void expire_records(mdns_browser_t browser, uint64_t now)
+{
+    size_t i = 0;
+
+    while (i < browser->record_count) {
+        if (browser->records[i].expires <= now) {
+            browser->records[i] = browser->records[--browser->record_count];
+        } else {
+            i++;
+        }
+    }
+}
+
+static const char *resolve_instance(mdns_browser_t browser, const char *instance, uint64_t now)
+{
+    mdns_record_t *srv = find_record(browser, instance, DNS_TYPE_SRV, now);
+    mdns_record_t *addr;
+
+    if (!srv) {
+        return NULL;
+    }
+    // link-local IPv6 addresses are never cached, see handle_packet()
+    if ((addr = find_record(browser, srv->data, DNS_TYPE_A, now)) != NULL ||
+        (addr = find_record(browser, srv->data, DNS_TYPE_AAAA, now)) != NULL) {
+        return addr->data;
+    }
+    return NULL;
+}
+
+// MARK: - Network
+
+static void handle_packet(mdns_browser_t browser, const uint8_t *packet, size_t len, uint64_t now)
+{
+    size_t offset = DNS_HEADER_SIZE;
+    uint16_t questions, records;
+    char name[MAX_NAME];
+
+    if (len < DNS_HEADER_SIZE || (read16(&packet[2]) & DNS_FLAG_RESPONSE) == 0) {
+        return;
+    }
+    questions = read16(&packet[4]);
+    records = read16(&packet[6]) + read16(&packet[8]) + read16(&packet[10]);
+    for (uint16_t i = 0; i < questions; i++) {
+        if (!read_name(packet, len, &offset, name) || offset + 4 > len) {
+            return;
+        }
+        offset += 4;
+    }
+    for (uint16_t i = 0; i < records; i++) {
+        mdns_record_t record = {0};
+        uint16_t class, rdlength;
+        uint32_t ttl;
+        size_t rdata;
+
+        if (!read_name(packet, len, &offset, record.name) || offset + 10 > len) {
+            return;
+        }
+        record.type = read16(&packet[offset]);
+        class = read16(&packet[offset + 2]);
+        ttl = read32(&packet[offset + 4]);
+        rdlength = read16(&packet[offset + 8]);
+        offset += 10;
+        if (offset + rdlength > len) {
+            return;
+        }
+        rdata = offset;
+        offset += rdlength;
+        if ((class & DNS_CLASS_MASK) != DNS_CLASS_IN) {
+            continue;
+        }
+        switch (record.type) {
+            case DNS_TYPE_PTR: {
+                if (!read_name(packet, len, &rdata, record.data)) {
+                    continue;
+                }
+                break;
+            }
+            case DNS_TYPE_SRV: {
+                if (rdlength < 7) {
+                    continue;
+                }
+                rdata += 6; // priority, weight, port
+                if (!read_name(packet, len, &rdata, record.data)) {
+                    continue;
+                }
+                break;
+            }
+            case DNS_TYPE_A: {
+                if (rdlength != 4) {
+                    continue;
+                }
+                inet_ntop(AF_INET, &packet[rdata], record.data, MAX_ADDRESS);
+                break;
+            }
+            case DNS_TYPE_AAAA: {
+                if (rdlength != 16) {
+                    continue;
+                }
+                // fe80::/10 is useless without the interface scope, which we don't track
+                if (packet[rdata] == 0xFE && (packet[rdata + 1] & 0xC0) == 0x80) {
+                    continue;
+                }
+                inet_ntop(AF_INET6, &packet[rdata], record.data, MAX_ADDRESS);
+                break;
+            }
+            default: {
+                continue;
+            }
+        }
+        cache_record(browser, &record, ttl, (class & DNS_CACHE_FLUSH) != 0, now);
+        browser->needs_resolve = 1;
+    }
+}
+
+/**
+ * Sends one packet asking about everything we are missing: the service's PTR
+ * records (when browsing), the SRV record of every instance that has not been
+ * resolved, and the addresses of every SRV target we do not know yet.
+ */
+static int send_query(mdns_browser_t browser, int browse, uint64_t now)
+{
+    uint8_t packet[QUERY_PACKET] = {0};
+    size_t offset = DNS_HEADER_SIZE;
+    uint16_t count = 0;
+
+    if (browse && write_question(packet, sizeof(packet), &offset, browser->service, DNS_TYPE_PTR)) {
+        count++;
+    }
+    for (size_t i = 0; i < browser->record_count; i++) {
+        mdns_record_t *ptr = &browser->records[i];
+        mdns_record_t *srv;
+        if (ptr->type != DNS_TYPE_PTR || ptr->expires <= now || strcasecmp(ptr->name, browser->service) != 0) {
+            continue;
+        }
+        if (!(srv = find_record(browser, ptr->data, DNS_TYPE_SRV, now))) {
+            count += write_question(packet, sizeof(packet), &offset, ptr->data, DNS_TYPE_SRV);
+        } else if (!resolve_instance(browser, ptr->data, now)) {
+            count += write_question(packet, sizeof(packet), &offset, srv->data, DNS_TYPE_A);
+            count += write_question(packet, sizeof(packet), &offset, srv->data, DNS_TYPE_AAAA);
+        }
+    }
+    if (count == 0) {
+        return 1;
+    }
+    write16(&packet[4], count);
+    return sendto(browser->fd, (const char *)packet, (int)offset, 0, (struct sockaddr *)&browser->group, sizeof(browser->group)) == (int)offset;
+}
+
+// MARK: - Reporting
+
+static mdns_instance_t *find_reported(mdns_browser_t browser, const char *instance)
+{
+    for (size_t i = 0; i < browser->reported_count; i++) {
+        if (strcasecmp(browser->reported[i].instance, instance) == 0) {
+            return &browser->reported[i];
+        }
+    }
+    return NULL;
+}
+
+static int report_changes(mdns_browser_t browser, uint64_t now, mdns_browser_cb_t callback, void *user_data)
+{
+    int stop = 0;
+    size_t i = 0;
+
+    for (size_t j = 0; j < browser->record_count && !stop; j++) {
+        mdns_record_t *ptr = &browser->records[j];
+        mdns_instance_t *reported;
+        const char *address;
+        if (ptr->type != DNS_TYPE_PTR || ptr->expires <= now || strcasecmp(ptr->name, browser->service) != 0) {
+            continue;
+        }
+        if (!(address = resolve_instance(browser, ptr->data, now))) {
+            continue;
+        }
+        if ((reported = find_reported(browser, ptr->data)) == NULL) {
+            if (browser->reported_count == browser->reported_capacity) {
+                browser->reported_capacity = browser->reported_capacity ? browser->reported_capacity * 2 : 16;
+                browser->reported = realloc(browser->reported, browser->reported_capacity * sizeof(mdns_instance_t));
+            }
+            reported = &browser->reported[browser->reported_count++];
+            snprintf(reported->instance, sizeof(reported->instance), "%s", ptr->data);
+        } else if (strcmp(reported->address, address) == 0) {
+            continue;
+        }
+        snprintf(reported->address, sizeof(reported->address), "%s", address);
+        stop = callback(reported->instance, reported->address, 1, user_data);
+    }
+    while (i < browser->reported_count && !stop) {
+        mdns_instance_t *reported = &browser->reported[i];
+        mdns_record_t *ptr = NULL;
+        for (size_t j = 0; j < browser->record_count; j++) {
+            mdns_record_t *record = &browser->records[j];
+            if (record->type == DNS_TYPE_PTR && record->expires > now &&
+                strcasecmp(record->name, browser->service) == 0 &&
+                strcasecmp(record->data, reported->instance) == 0) {
+                ptr = record;
+                break;
+            }
+        }
+        if (ptr && resolve_instance(browser, reported->instance, now)) {
+            i++;
+            continue;
+        }
+        stop = callback(reported->instance, reported->address, 0, user_data);
+        browser->reported[i] = browser->reported[--browser->reported_count];
+    }
+    return stop;
+}
+
+// MARK: - Persistence
+
+int mdns_browser_save(mdns_browser_t browser, const char *path)
+{
+    uint64_t now = mdns_now();
+    uint64_t wall = wall_now();
+    size_t tmp_len = strlen(path) + sizeof(".tmp");
+    char *tmp = malloc(tmp_len);
+    FILE *f;
+    int ret;
+
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+    if (!(f = fopen(tmp, "w"))) {
+        free(tmp);
+        return 0;
+    }
+    for (size_t i = 0; i < browser->record_count; i++) {
+        mdns_record_t *record = &browser->records[i];
+        if (record->expires > now) {
+            fprintf(f, "%llu\t%u\t%s\t%s\n", (unsigned long long)(wall + record->expires - now), record->type, record->name, record->data);
+        }
+    }
+    ret = fclose(f) == 0;
+    if (ret) {
+#ifdef WIN32
+        remove(path);
+#endif
+        ret = rename(tmp, path) == 0;
+    }
+    if (!ret) {
+        remove(tmp);
+    }
+    free(tmp);
+    return ret;
+}
+
+int mdns_browser_load(mdns_browser_t browser, const char *path)
+{
+    uint64_t now = mdns_now();
+    uint64_t wall = wall_now();
+    char line[2 * MAX_NAME + 32];
+    FILE *f;
+
+    if (!(f = fopen(path, "r"))) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        mdns_record_t record = {0};
+        char *save = NULL;
+        char *expires = strtok_r(line, "\t", &save);
+        char *type = strtok_r(NULL, "\t", &save);
+        char *name = strtok_r(NULL, "\t", &save);
+        char *data = strtok_r(NULL, "\t\r\n", &save);
+        unsigned long long wall_expires;
+
+        if (!data) {
+            continue;
+        }
+        wall_expires = strtoull(expires, NULL, 10);
+        if (wall_expires <= wall) {
+            continue;
+        }
+        record.type = (uint16_t)strtoul(type, NULL, 10);
+        snprintf(record.name, sizeof(record.name), "%s", name);
+        snprintf(record.data, sizeof(record.data), "%s", data);
+        // round up so a record with less than a second left is still loaded
+        cache_record(browser, &record, (uint32_t)((wall_expires - wall + 999) / 1000), 0, now);
+    }
+    fclose(f);
+    return 1;
+}
+
+// MARK: - Browser
+
+mdns_browser_t mdns_browser_new(const char *service, const char *group, uint16_t port, const char *interface_addr)
+{
+    mdns_browser_t browser = NULL;
+    struct sockaddr_in bind_addr = {0};
+    struct ip_mreq mreq = {0};
+    int yes = 1;
+    unsigned char ttl = 255;
+
+#ifdef WIN32
+    WSADATA wsa_data;
+    WSAStartup(MAKEWORD(2, 2), &wsa_data);
+#endif
+    browser = calloc(1, sizeof(struct mdns_browser));
+    snprintf(browser->service, sizeof(browser->service), "%s", service);
+    browser->group.sin_family = AF_INET;
+    browser->group.sin_port = htons(port);
+    if (inet_pton(AF_INET, group, &browser->group.sin_addr) != 1) {
+        goto error;
+    }
+    mreq.imr_multiaddr = browser->group.sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (interface_addr && inet_pton(AF_INET, interface_addr, &mreq.imr_interface) != 1) {
+        goto error;
+    }
+
+    if ((browser->fd = (int)socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        goto error;
+    }
+    // share the port with any system mDNS responder
+    setsockopt(browser->fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&yes, sizeof(yes));
+#ifdef SO_REUSEPORT
+    setsockopt(browser->fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&yes, sizeof(yes));
+#endif
+    bind_addr.sin_family = AF_INET;
+    bind_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    bind_addr.sin_port = htons(port);
+    if (bind(browser->fd, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) != 0) {
+        fprintf(stderr, "ERROR: Cannot bind to mDNS port %u\n", port);
+        goto error_socket;
+    }
+    if (setsockopt(browser->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char *)&mreq, sizeof(mreq)) != 0) {
+        fprintf(stderr, "ERROR: Cannot join mDNS group %s\n", group);
+        goto error_socket;
+    }
+    if (interface_addr) {
+        setsockopt(browser->fd, IPPROTO_IP, IP_MULTICAST_IF, (const char *)&mreq.imr_interface, sizeof(mreq.imr_interface));
+    }
+    setsockopt(browser->fd, IPPROTO_IP, IP_MULTICAST_TTL, (const char *)&ttl, sizeof(ttl));
+    return browser;
+
+error_socket:
+    mdns_close(browser->fd);
+error:
+    free(browser);
+    return NULL;
+}
+
+int mdns_browser_run(mdns_browser_t browser, unsigned int timeout_ms, mdns_browser_cb_t callback, void *user_data)
+{
+    uint8_t packet[MAX_PACKET];
+    uint64_t now = mdns_now();
+    uint64_t deadline = now + timeout_ms;
+    uint64_t next_browse = now;
+    uint64_t last_query = 0;
+    uint64_t interval = 1000;
+
+    // report everything still cached to the new caller right away
+    browser->reported_count = 0;
+    expire_records(browser, now);
+    if (report_changes(browser, now, callback, user_data)) {
+        return 1;
+    }
+    browser->needs_resolve = 0;
+    while ((now = mdns_now()) < deadline) {
+        struct pollfd pfd = { .fd = browser->fd, .events = POLLIN };
+        uint64_t wake;
+
+        if (now >= next_browse) {
+            send_query(browser, 1, now);
+            last_query = now;
+            next_browse = now + interval;
+            interval = interval * 2 < MAX_QUERY_INTERVAL ? interval * 2 : MAX_QUERY_INTERVAL;
+            browser->needs_resolve = 0;
+        } else if (browser->needs_resolve && now - last_query >= RESOLVE_INTERVAL) {
+            send_query(browser, 0, now);
+            last_query = now;
+            browser->needs_resolve = 0;
+        }
+
+        wake = next_browse < deadline ? next_browse : deadline;
+        if (browser->needs_resolve && last_query + RESOLVE_INTERVAL < wake) {
+            wake = last_query + RESOLVE_INTERVAL;
+        }
+        if (poll(&pfd, 1, wake > now ? (int)(wake - now) : 0) < 0) {
+            return 0;
+        }
+        if (pfd.revents & POLLIN) {
+            int len = (int)recv(browser->fd, (char *)packet, sizeof(packet), 0);
+            if (len > 0) {
+                handle_packet(browser, packet, (size_t)len, mdns_now());
+            }
+        }
+        now = mdns_now();
+        expire_records(browser, now);
+        if (report_changes(browser, now, callback, user_data)) {
+            break;
+        }
+    }
+    return 1;
+}
+
+void mdns_browser_free(mdns_browser_t browser)
+{
+    mdns_close(browser->fd);
+    free(browser->records);
+    free(browser->reported);
+    free(browser);
+}
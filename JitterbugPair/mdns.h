@@ -0,0 +1,58 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef mdns_h
+#define mdns_h
+
+#include <stdint.h>
+
+#define MDNS_SERVICE_MOBDEV2 "_apple-mobdev2._tcp.local"
+#define MDNS_GROUP "224.0.0.251"
+#define MDNS_PORT 5353
+
+typedef struct mdns_browser *mdns_browser_t;
+
+/**
+ * Called when a service instance is resolved to an address (`added` is 1) or
+ * when its records expire or are withdrawn (`added` is 0). Return non-zero to
+ * stop browsing early.
+ */
+typedef int (*mdns_browser_cb_t)(const char *instance, const char *address, int added, void *user_data);
+
+/**
+ * Creates a browser for `service` using a single socket bound to `port` and
+ * joined to `group` on the interface with address `interface_addr` (any
+ * interface if NULL). Pass MDNS_GROUP and MDNS_PORT for normal use.
+ */
+mdns_browser_t mdns_browser_new(const char *service, const char *group, uint16_t port, const char *interface_addr);
+
+/**
+ * Browses for up to `timeout_ms`. Instances still valid in the cache from a
+ * previous call are reported immediately. Unresolved instances are resolved
+ * in parallel by batching their questions into the same query packets.
+ */
+int mdns_browser_run(mdns_browser_t browser, unsigned int timeout_ms, mdns_browser_cb_t callback, void *user_data);
+
+/**
+ * Saves the cached records to `path` so that a later process can load them
+ * with mdns_browser_load() and skip the network until their TTLs run out.
+ */
+int mdns_browser_save(mdns_browser_t browser, const char *path);
+int mdns_browser_load(mdns_browser_t browser, const char *path);
+
+void mdns_browser_free(mdns_browser_t browser);
+
+#endif /* mdns_h */
@@ -0,0 +1,364 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "DirectoryIndex.h"
+
+#define FILES 10000
+#define MODIFIED 10
+#define DELETED 5
+#define CREATED 5
+#define EVENT_TIMEOUT_MS 5000
+#define COMPACT_REWRITES 500
+#define MAX_COMPACT_SIZE (64 * 1024)
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+static char g_directory[64];
+static char g_index_path[128];
+static unsigned int g_parses;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/** Files look like a pairing reduced to its UDID line. */
+static void parse_file(directory_index_t index, const char *path, void *ctx)
+{
+    char line[512];
+    FILE *file = fopen(path, "r");
+
+    (void)ctx;
+    g_parses++;
+    if (!file) {
+        return;
+    }
+    if (fgets(line, sizeof(line), file) && strncmp(line, "UDID=", 5) == 0) {
+        line[strcspn(line, "\n")] = '\0';
+        directoryIndexSetMetadata(index, "UDID", line + 5);
+    }
+    fclose(file);
+}
+
+static void write_file(const char *name, const char *udid)
+{
+    char path[512];
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s/%s", g_directory, name);
+    CHECK((file = fopen(path, "w")) != NULL);
+    fprintf(file, "UDID=%s\n", udid);
+    fclose(file);
+}
+
+static void delete_file(const char *name)
+{
+    char path[512];
+
+    snprintf(path, sizeof(path), "%s/%s", g_directory, name);
+    CHECK(unlink(path) == 0);
+}
+
+static void file_name(char name[static 64], unsigned int i)
+{
+    snprintf(name, 64, "pairing-%05u.plist", i);
+}
+
+static void file_udid(char udid[static 64], unsigned int i, unsigned int version)
+{
+    snprintf(udid, 64, "%08X-%016X", version, i);
+}
+
+static size_t file_count(directory_index_t index)
+{
+    size_t count = 0;
+    char **files = directoryIndexCopyFiles(index, &count);
+
+    CHECK(files != NULL);
+    for (size_t i = 1; i < count; i++) {
+        CHECK(strcmp(files[i - 1], files[i]) < 0);
+    }
+    directoryIndexFreeFiles(files, count);
+    return count;
+}
+
+static void make_directory(void)
+{
+    strcpy(g_directory, "/tmp/directory_index_test.XXXXXX");
+    CHECK(mkdtemp(g_directory) != NULL);
+    snprintf(g_index_path, sizeof(g_index_path), "%s.index", g_directory);
+    unlink(g_index_path);
+}
+
+static void remove_directory(void)
+{
+    DIR *dir = opendir(g_directory);
+    struct dirent *ent;
+
+    CHECK(dir != NULL);
+    while ((ent = readdir(dir))) {
+        if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+            delete_file(ent->d_name);
+        }
+    }
+    closedir(dir);
+    CHECK(rmdir(g_directory) == 0);
+    unlink(g_index_path);
+}
+
+static directory_index_t open_index(void)
+{
+    directory_index_t index = directoryIndexNew(g_directory, g_index_path, parse_file, NULL);
+
+    CHECK(index != NULL);
+    return index;
+}
+
+static int has_udid(directory_index_t index, const char *name, const char *expected)
+{
+    char *udid = directoryIndexCopyMetadata(index, name, "UDID");
+    int found = udid && strcmp(udid, expected) == 0;
+
+    free(udid);
+    return found;
+}
+
+/**
+ * Applies watch events until the last file written has `udid` and `count`
+ * files are indexed, returns the time spent handling them.
+ */
+static double wait_for_events(directory_index_t index, const char *name, const char *udid, size_t count)
+{
+    struct pollfd pfd = { .fd = directoryIndexWatchDescriptor(index), .events = POLLIN };
+    double deadline = now_ms() + EVENT_TIMEOUT_MS;
+    double handling = 0;
+
+    while (!has_udid(index, name, udid) || file_count(index) != count) {
+        CHECK(now_ms() < deadline);
+        if (poll(&pfd, 1, 100) > 0) {
+            double start = now_ms();
+            directoryIndexHandleEvents(index);
+            handling += now_ms() - start;
+        }
+    }
+    return handling;
+}
+
+/** A saved index of 10k files is loaded and checked without parsing anything. */
+static void test_cold_and_warm(void)
+{
+    char name[64], udid[64];
+    directory_index_t index;
+    double start, cold, warm;
+
+    for (unsigned int i = 0; i < FILES; i++) {
+        file_name(name, i);
+        file_udid(udid, i, 0);
+        write_file(name, udid);
+    }
+    g_parses = 0;
+    start = now_ms();
+    index = open_index();
+    CHECK(directoryIndexReconcile(index, NULL, 0) == 1);
+    cold = now_ms() - start;
+    CHECK(g_parses == FILES);
+    CHECK(file_count(index) == FILES);
+    directoryIndexFree(index);
+
+    g_parses = 0;
+    start = now_ms();
+    index = open_index();
+    CHECK(file_count(index) == FILES);
+    CHECK(directoryIndexReconcile(index, NULL, 0) == 0);
+    warm = now_ms() - start;
+    CHECK(g_parses == 0);
+    file_name(name, 1234);
+    file_udid(udid, 1234, 0);
+    CHECK(has_udid(index, name, udid));
+    directoryIndexFree(index);
+    printf("ok - %u files: cold index %.1f ms, warm start %.1f ms with no parses\n", FILES, cold, warm);
+}
+
+/** Files rewritten while the index was not running are parsed again, and so are replaced ones. */
+static void test_changed_on_disk(void)
+{
+    char name[64], path[512], udid[64];
+    struct timespec times[2] = { { .tv_sec = 1000000000 }, { .tv_sec = 1000000000 } };
+    directory_index_t index;
+
+    file_name(name, 42);
+    file_udid(udid, 42, 1);
+    write_file(name, udid);
+    g_parses = 0;
+    index = open_index();
+    CHECK(directoryIndexReconcile(index, NULL, 0) == 1);
+    CHECK(g_parses == 1);
+    CHECK(has_udid(index, name, udid));
+
+    // same size and an old modification time, as a copy that keeps the original date would leave it
+    snprintf(path, sizeof(path), "%s/%s", g_directory, name);
+    file_udid(udid, 42, 2);
+    write_file(name, udid);
+    CHECK(utimensat(AT_FDCWD, path, times, 0) == 0);
+    CHECK(directoryIndexReconcile(index, NULL, 0) == 1);
+    CHECK(g_parses == 2);
+    CHECK(has_udid(index, name, udid));
+    file_udid(udid, 42, 3);
+    write_file(name, udid);
+    CHECK(utimensat(AT_FDCWD, path, times, 0) == 0);
+    CHECK(directoryIndexReconcile(index, NULL, 0) == 0);
+    CHECK(g_parses == 2);
+    const char *replaced[] = { name };
+    CHECK(directoryIndexReconcile(index, replaced, 1) == 1);
+    CHECK(g_parses == 3);
+    CHECK(has_udid(index, name, udid));
+    directoryIndexFree(index);
+    printf("ok - files changed on disk or replaced are parsed again\n");
+}
+
+/** Watch events only touch the files they name and the journal keeps up with them. */
+static void test_watch(void)
+{
+    char name[64], udid[64];
+    directory_index_t index = open_index();
+    double handling, full;
+
+    if (directoryIndexWatchDescriptor(index) < 0) {
+        directoryIndexFree(index);
+        printf("ok - watch # SKIP no watch backend\n");
+        return;
+    }
+    CHECK(directoryIndexReconcile(index, NULL, 0) == 0);
+    g_parses = 0;
+    for (unsigned int i = 0; i < MODIFIED; i++) {
+        file_name(name, i * 97);
+        file_udid(udid, i * 97, 4);
+        write_file(name, udid);
+    }
+    for (unsigned int i = 0; i < DELETED; i++) {
+        file_name(name, FILES - 1 - i);
+        delete_file(name);
+    }
+    for (unsigned int i = 0; i < CREATED; i++) {
+        file_name(name, FILES + i);
+        file_udid(udid, FILES + i, 4);
+        write_file(name, udid);
+    }
+    handling = wait_for_events(index, name, udid, FILES - DELETED + CREATED);
+#if defined(__linux__)
+    // a new file may be parsed on creation and again once it is closed, nothing else is
+    CHECK(g_parses >= MODIFIED + CREATED);
+    CHECK(g_parses <= MODIFIED + CREATED * 2);
+#endif
+    file_name(name, FILES - 1);
+    CHECK(directoryIndexCopyMetadata(index, name, "UDID") == NULL);
+    file_name(name, 97);
+    file_udid(udid, 97, 4);
+    CHECK(has_udid(index, name, udid));
+
+    full = now_ms();
+    CHECK(directoryIndexReconcile(index, NULL, 0) == 0);
+    full = now_ms() - full;
+    directoryIndexFree(index);
+
+    g_parses = 0;
+    index = open_index();
+    CHECK(file_count(index) == FILES - DELETED + CREATED);
+    CHECK(directoryIndexReconcile(index, NULL, 0) == 0);
+    CHECK(g_parses == 0);
+    CHECK(has_udid(index, name, udid));
+    directoryIndexFree(index);
+    printf("ok - %u changes handled from watch events in %.2f ms (full reconcile %.1f ms)\n", MODIFIED + DELETED + CREATED, handling, full);
+}
+
+/** A torn record at the end of the journal loses only that record. */
+static void test_torn_journal(void)
+{
+    directory_index_t index;
+    FILE *file;
+
+    CHECK((file = fopen(g_index_path, "ab")) != NULL);
+    fputs("+\x20", file);
+    fclose(file);
+    g_parses = 0;
+    index = open_index();
+    CHECK(file_count(index) == FILES - DELETED + CREATED);
+    CHECK(directoryIndexReconcile(index, NULL, 0) == 0);
+    CHECK(g_parses == 0);
+    directoryIndexFree(index);
+    index = open_index();
+    CHECK(file_count(index) == FILES - DELETED + CREATED);
+    directoryIndexFree(index);
+    printf("ok - torn journal record is dropped\n");
+}
+
+/** Rewriting the same few files over and over does not grow the journal without bound. */
+static void test_compaction(void)
+{
+    char name[64], udid[256];
+    struct stat st;
+    directory_index_t index;
+
+    remove_directory();
+    make_directory();
+    index = open_index();
+    for (unsigned int i = 0; i < COMPACT_REWRITES; i++) {
+        file_name(name, i % 4);
+        snprintf(udid, sizeof(udid), "%0200u", i);
+        write_file(name, udid);
+        CHECK(directoryIndexReconcile(index, NULL, 0) == 1);
+    }
+    directoryIndexFree(index);
+    CHECK(stat(g_index_path, &st) == 0);
+    CHECK(st.st_size < MAX_COMPACT_SIZE);
+    index = open_index();
+    CHECK(file_count(index) == 4);
+    file_name(name, (COMPACT_REWRITES - 1) % 4);
+    snprintf(udid, sizeof(udid), "%0200u", COMPACT_REWRITES - 1);
+    CHECK(has_udid(index, name, udid));
+    directoryIndexFree(index);
+    printf("ok - journal compacted to %lld bytes after %u rewrites\n", (long long)st.st_size, COMPACT_REWRITES);
+}
+
+int main(void)
+{
+    make_directory();
+    test_cold_and_warm();
+    test_changed_on_disk();
+    test_watch();
+    test_torn_journal();
+    test_compaction();
+    remove_directory();
+    return 0;
+}
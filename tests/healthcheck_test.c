@@ -0,0 +1,562 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <plist/plist.h>
+#include "healthcheck.h"
+
+#define LIVE_UDID "00008030-000000000000001A"
+#define REVOKED_UDID "00008030-000000000000002B"
+#define UNREACHABLE_UDID "00008030-000000000000003C"
+#define UNMAPPED_UDID "00008030-000000000000004D"
+#define REPAIRED_UDID "00008030-000000000000005E"
+#define NETWORK_UDID "00008030-000000000000006F"
+#define LOCKDOWN_PORT 62078
+#define SCAN_TIMEOUT_MS 10000
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// MARK: - Identity
+
+typedef struct {
+    char *cert_pem;
+    size_t cert_len;
+    char *key_pem;
+    size_t key_len;
+    X509 *cert;
+    EVP_PKEY *key;
+} identity_t;
+
+static identity_t identity;
+
+static char *bio_string(BIO *bio, size_t *len)
+{
+    char *data;
+    char *copy;
+    long size = BIO_get_mem_data(bio, &data);
+    copy = malloc((size_t)size);
+    memcpy(copy, data, (size_t)size);
+    *len = (size_t)size;
+    return copy;
+}
+
+/** One self-signed identity serves as root, host and device certificate. */
+static void make_identity(identity_t *id)
+{
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+    X509_NAME *name;
+    BIO *bio;
+
+    CHECK(pctx && EVP_PKEY_keygen_init(pctx) > 0);
+    CHECK(EVP_PKEY_CTX_set_rsa_keygen_bits(pctx, 2048) > 0);
+    CHECK(EVP_PKEY_keygen(pctx, &id->key) > 0);
+    EVP_PKEY_CTX_free(pctx);
+    id->cert = X509_new();
+    X509_set_version(id->cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(id->cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(id->cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(id->cert), 3600);
+    name = X509_get_subject_name(id->cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"jitterbugpair test", -1, -1, 0);
+    X509_set_issuer_name(id->cert, name);
+    X509_set_pubkey(id->cert, id->key);
+    CHECK(X509_sign(id->cert, id->key, EVP_sha256()) > 0);
+
+    bio = BIO_new(BIO_s_mem());
+    PEM_write_bio_X509(bio, id->cert);
+    id->cert_pem = bio_string(bio, &id->cert_len);
+    BIO_free(bio);
+    bio = BIO_new(BIO_s_mem());
+    PEM_write_bio_PrivateKey(bio, id->key, NULL, NULL, 0, NULL, NULL);
+    id->key_pem = bio_string(bio, &id->key_len);
+    BIO_free(bio);
+}
+
+// MARK: - Mock lockdown
+
+typedef struct {
+    int listen_fd;
+    uint16_t port;
+    int revoked;
+    X509 *trusted;
+    volatile int done;
+    int sessions;
+    pthread_t thread;
+} mock_lockdown_t;
+
+typedef struct {
+    int fd;
+    SSL *ssl;
+} mock_conn_t;
+
+static int conn_read(mock_conn_t *conn, void *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len) {
+        int ret = conn->ssl ? SSL_read(conn->ssl, (char *)buf + got, (int)(len - got))
+                            : (int)recv(conn->fd, (char *)buf + got, len - got, 0);
+        if (ret <= 0) {
+            return 0;
+        }
+        got += (size_t)ret;
+    }
+    return 1;
+}
+
+static int conn_write(mock_conn_t *conn, const void *buf, size_t len)
+{
+    if (conn->ssl) {
+        return SSL_write(conn->ssl, buf, (int)len) == (int)len;
+    } else {
+        return send(conn->fd, buf, len, MSG_NOSIGNAL) == (ssize_t)len;
+    }
+}
+
+static plist_t read_request(mock_conn_t *conn)
+{
+    uint8_t header[4];
+    uint32_t length;
+    char *xml;
+    plist_t request = NULL;
+
+    if (!conn_read(conn, header, sizeof(header))) {
+        return NULL;
+    }
+    length = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | header[3];
+    xml = calloc(1, length + 1);
+    if (conn_read(conn, xml, length)) {
+        plist_from_xml(xml, length, &request);
+    }
+    free(xml);
+    return request;
+}
+
+static void send_reply(mock_conn_t *conn, plist_t reply)
+{
+    char *xml = NULL;
+    uint32_t length = 0;
+    uint8_t header[4];
+
+    plist_to_xml(reply, &xml, &length);
+    header[0] = length >> 24;
+    header[1] = length >> 16;
+    header[2] = length >> 8;
+    header[3] = length;
+    conn_write(conn, header, sizeof(header));
+    conn_write(conn, xml, length);
+    free(xml);
+    plist_free(reply);
+}
+
+static plist_t reply_for(plist_t request)
+{
+    plist_t reply = plist_new_dict();
+    char *type = NULL;
+
+    plist_get_string_val(plist_dict_get_item(request, "Request"), &type);
+    plist_dict_set_item(reply, "Request", plist_new_string(type ? type : ""));
+    plist_dict_set_item(reply, "Result", plist_new_string("Success"));
+    if (type && strcmp(type, "QueryType") == 0) {
+        plist_dict_set_item(reply, "Type", plist_new_string("com.apple.mobile.lockdown"));
+    } else if (type && strcmp(type, "GetValue") == 0) {
+        plist_dict_set_item(reply, "Key", plist_new_string("ProductVersion"));
+        plist_dict_set_item(reply, "Value", plist_new_string("15.0"));
+    } else if (type && strcmp(type, "StartSession") == 0) {
+        plist_dict_set_item(reply, "SessionID", plist_new_string("6C0C0E73-9A4B-4E23-A2E1-2C3C8A6A1D10"));
+        plist_dict_set_item(reply, "EnableSessionSSL", plist_new_bool(1));
+    }
+    free(type);
+    return reply;
+}
+
+/** Accepts only the host certificate the device was paired with. */
+static int verify_host(int ok, X509_STORE_CTX *ctx)
+{
+    SSL *ssl = X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+    mock_lockdown_t *mock = SSL_get_app_data(ssl);
+    (void)ok;
+
+    if (mock->revoked) {
+        return 0;
+    }
+    return X509_cmp(X509_STORE_CTX_get_current_cert(ctx), mock->trusted) == 0;
+}
+
+/**
+ * Speaks lockdown in plain text until StartSession, then switches to TLS. A
+ * device that revoked the pairing, or was paired again since, no longer
+ * trusts the host certificate and fails the handshake.
+ */
+static void mock_lockdown_serve(mock_lockdown_t *mock, int fd)
+{
+    mock_conn_t conn = { fd, NULL };
+    SSL_CTX *ctx = NULL;
+    plist_t request;
+
+    while ((request = read_request(&conn)) != NULL) {
+        plist_t reply = reply_for(request);
+        int start_tls = plist_dict_get_item(reply, "EnableSessionSSL") != NULL;
+        plist_free(request);
+        send_reply(&conn, reply);
+        if (start_tls && !conn.ssl) {
+            ctx = SSL_CTX_new(TLS_server_method());
+            SSL_CTX_use_certificate(ctx, identity.cert);
+            SSL_CTX_use_PrivateKey(ctx, identity.key);
+            SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, verify_host);
+            conn.ssl = SSL_new(ctx);
+            SSL_set_app_data(conn.ssl, mock);
+            SSL_set_fd(conn.ssl, fd);
+            if (SSL_accept(conn.ssl) != 1) {
+                break;
+            }
+            mock->sessions++;
+        }
+    }
+    if (conn.ssl) {
+        SSL_free(conn.ssl);
+    }
+    SSL_CTX_free(ctx);
+}
+
+static void *mock_lockdown_thread(void *arg)
+{
+    mock_lockdown_t *mock = arg;
+
+    while (!mock->done) {
+        struct pollfd pfd = { mock->listen_fd, POLLIN, 0 };
+        struct timeval timeout = { 5, 0 };
+        int fd;
+
+        if (poll(&pfd, 1, 100) != 1) {
+            continue;
+        }
+        if ((fd = accept(mock->listen_fd, NULL, NULL)) < 0) {
+            break;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        mock_lockdown_serve(mock, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/** Listens on `*port`, or on any free port if it is 0. Returns -1 if the port is taken. */
+static int listen_loopback(uint16_t *port)
+{
+    struct sockaddr_in addr = { 0 };
+    socklen_t len = sizeof(addr);
+    int one = 1;
+    int fd;
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(*port);
+    CHECK((fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        CHECK(*port != 0);
+        close(fd);
+        return -1;
+    }
+    CHECK(listen(fd, 8) == 0);
+    CHECK(getsockname(fd, (struct sockaddr *)&addr, &len) == 0);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int mock_lockdown_start_on(mock_lockdown_t *mock, uint16_t port, int revoked)
+{
+    mock->revoked = revoked;
+    mock->trusted = identity.cert;
+    mock->port = port;
+    if ((mock->listen_fd = listen_loopback(&mock->port)) < 0) {
+        return 0;
+    }
+    CHECK(pthread_create(&mock->thread, NULL, mock_lockdown_thread, mock) == 0);
+    return 1;
+}
+
+static void mock_lockdown_start(mock_lockdown_t *mock, int revoked)
+{
+    mock_lockdown_start_on(mock, 0, revoked);
+}
+
+static void mock_lockdown_stop(mock_lockdown_t *mock)
+{
+    mock->done = 1;
+    pthread_join(mock->thread, NULL);
+    close(mock->listen_fd);
+}
+
+// MARK: - Fixtures
+
+/** Writes `name`.mobiledevicepairing for `udid` with `id` as all of its certificates. */
+static void write_pairing_file(const char *dir, const char *name, const char *udid, const identity_t *id)
+{
+    plist_t record = plist_new_dict();
+    char *xml = NULL;
+    uint32_t length = 0;
+    char path[512];
+    FILE *f;
+
+    plist_dict_set_item(record, "UDID", plist_new_string(udid));
+    plist_dict_set_item(record, "HostID", plist_new_string("2F5B0C3E-4C1A-4C5E-9C55-1E0D4F7A6B21"));
+    plist_dict_set_item(record, "SystemBUID", plist_new_string("9E1A2B3C-4D5E-6F70-8192-A3B4C5D6E7F8"));
+    plist_dict_set_item(record, "WiFiMACAddress", plist_new_string("a4:83:e7:00:00:01"));
+    plist_dict_set_item(record, "HostCertificate", plist_new_data(id->cert_pem, id->cert_len));
+    plist_dict_set_item(record, "HostPrivateKey", plist_new_data(id->key_pem, id->key_len));
+    plist_dict_set_item(record, "RootCertificate", plist_new_data(id->cert_pem, id->cert_len));
+    plist_dict_set_item(record, "RootPrivateKey", plist_new_data(id->key_pem, id->key_len));
+    plist_dict_set_item(record, "DeviceCertificate", plist_new_data(id->cert_pem, id->cert_len));
+    plist_to_xml(record, &xml, &length);
+    snprintf(path, sizeof(path), "%s/%s.mobiledevicepairing", dir, name);
+    CHECK((f = fopen(path, "w")) != NULL);
+    fwrite(xml, 1, length, f);
+    fclose(f);
+    free(xml);
+    plist_free(record);
+}
+
+static void write_pairing(const char *dir, const char *udid)
+{
+    write_pairing_file(dir, udid, udid, &identity);
+}
+
+/** Runs the health check with stdout captured and returns the JSON report. */
+static char *run_health_check(const char *pairing_dir, const char *address_map)
+{
+    char path[] = "/tmp/healthcheck-report-XXXXXX";
+    int fd = mkstemp(path);
+    int saved = dup(STDOUT_FILENO);
+    char *report;
+    long size;
+    FILE *f;
+
+    CHECK(fd >= 0 && saved >= 0);
+    fflush(stdout);
+    dup2(fd, STDOUT_FILENO);
+    CHECK(health_check(pairing_dir, address_map, 0, NULL, 0) == EXIT_SUCCESS);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(fd);
+
+    CHECK((f = fopen(path, "r")) != NULL);
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    report = calloc(1, (size_t)size + 1);
+    CHECK(fread(report, 1, (size_t)size, f) == (size_t)size);
+    fclose(f);
+    unlink(path);
+    return report;
+}
+
+/** Checks that the report line containing `needle` also contains `expected`. */
+static int report_line_has(const char *report, const char *needle, const char *expected)
+{
+    const char *line;
+    const char *end;
+
+    if (!(line = strstr(report, needle))) {
+        return 0;
+    }
+    end = strchr(line, '\n');
+    line = strstr(line, expected);
+    return line && (!end || line < end);
+}
+
+static int report_has(const char *report, const char *udid, const char *expected)
+{
+    char needle[128];
+    snprintf(needle, sizeof(needle), "\"udid\": \"%s\"", udid);
+    return report_line_has(report, needle, expected);
+}
+
+static int report_file_has(const char *report, const char *dir, const char *name, const char *expected)
+{
+    char needle[512];
+    snprintf(needle, sizeof(needle), "\"file\": \"%s/%s.mobiledevicepairing\"", dir, name);
+    return report_line_has(report, needle, expected);
+}
+
+static void write_address_map(char *path, size_t size, const char *dir, const char *line)
+{
+    FILE *f;
+    snprintf(path, size, "%s/addresses.txt", dir);
+    CHECK((f = fopen(path, "w")) != NULL);
+    fputs(line, f);
+    fclose(f);
+}
+
+// MARK: - Tests
+
+/**
+ * Live, revoked and unreachable devices get told apart by the JSON report.
+ * Each device is a lockdown listener on its own loopback port, reached through
+ * "127.0.0.1:PORT" entries in the address map.
+ */
+static void test_report(void)
+{
+    char pairing_dir[] = "/tmp/healthcheck-pairings-XXXXXX";
+    char address_map[512];
+    mock_lockdown_t live = { 0 };
+    mock_lockdown_t revoked = { 0 };
+    uint16_t unreachable_port = 0;
+    char *report;
+    uint64_t start;
+    FILE *f;
+
+    CHECK(mkdtemp(pairing_dir) != NULL);
+    write_pairing(pairing_dir, LIVE_UDID);
+    write_pairing(pairing_dir, REVOKED_UDID);
+    write_pairing(pairing_dir, UNREACHABLE_UDID);
+    write_pairing(pairing_dir, UNMAPPED_UDID);
+    mock_lockdown_start(&live, 0);
+    mock_lockdown_start(&revoked, 1);
+    // nothing listens here any more
+    close(listen_loopback(&unreachable_port));
+
+    snprintf(address_map, sizeof(address_map), "%s/addresses.txt", pairing_dir);
+    CHECK((f = fopen(address_map, "w")) != NULL);
+    fprintf(f, "%s 127.0.0.1:%u\n", LIVE_UDID, live.port);
+    fprintf(f, "%s 127.0.0.1:%u\n", REVOKED_UDID, revoked.port);
+    fprintf(f, "%s 127.0.0.1:%u\n", UNREACHABLE_UDID, unreachable_port);
+    fclose(f);
+
+    start = now_ms();
+    report = run_health_check(pairing_dir, address_map);
+    CHECK(now_ms() - start < SCAN_TIMEOUT_MS);
+    mock_lockdown_stop(&live);
+    mock_lockdown_stop(&revoked);
+
+    fprintf(stderr, "%s", report);
+    CHECK(report_has(report, LIVE_UDID, "\"alive\": true"));
+    CHECK(live.sessions == 1);
+    CHECK(report_has(report, REVOKED_UDID, "\"alive\": false"));
+    CHECK(report_has(report, REVOKED_UDID, "\"error\": \"SSL handshake failed, pairing may be revoked\""));
+    CHECK(revoked.sessions == 0);
+    CHECK(report_has(report, UNREACHABLE_UDID, "\"alive\": false"));
+    CHECK(report_has(report, UNREACHABLE_UDID, "\"error\": \"Cannot connect to device\""));
+    CHECK(report_has(report, UNMAPPED_UDID, "\"error\": \"No address in map\""));
+    printf("ok - live, revoked and unreachable devices in %llu ms\n", (unsigned long long)(now_ms() - start));
+
+    free(report);
+}
+
+/**
+ * A device paired again keeps its UDID, so an old and a new pairing file for
+ * it sit side by side. Each file must be checked with its own pair record: the
+ * new one works and the old one is rejected by the device.
+ */
+static void test_duplicate_udids(void)
+{
+    char pairing_dir[] = "/tmp/healthcheck-pairings-XXXXXX";
+    char address_map[512];
+    char line[128];
+    identity_t stale = { 0 };
+    mock_lockdown_t device = { 0 };
+    char *report;
+
+    CHECK(mkdtemp(pairing_dir) != NULL);
+    make_identity(&stale);
+    // sorts first, so it would be the record found for the UDID
+    write_pairing_file(pairing_dir, REPAIRED_UDID "-old", REPAIRED_UDID, &stale);
+    write_pairing_file(pairing_dir, REPAIRED_UDID, REPAIRED_UDID, &identity);
+    mock_lockdown_start(&device, 0);
+    snprintf(line, sizeof(line), "%s 127.0.0.1:%u\n", REPAIRED_UDID, device.port);
+    write_address_map(address_map, sizeof(address_map), pairing_dir, line);
+
+    report = run_health_check(pairing_dir, address_map);
+    mock_lockdown_stop(&device);
+
+    fprintf(stderr, "%s", report);
+    CHECK(report_file_has(report, pairing_dir, REPAIRED_UDID, "\"alive\": true"));
+    CHECK(report_file_has(report, pairing_dir, REPAIRED_UDID "-old", "\"alive\": false"));
+    CHECK(report_file_has(report, pairing_dir, REPAIRED_UDID "-old", "\"error\": \"SSL handshake failed, pairing may be revoked\""));
+    CHECK(device.sessions == 1);
+    printf("ok - pairings sharing a UDID are checked with their own records\n");
+
+    free(report);
+}
+
+/**
+ * A plain address is how Wi-Fi devices are listed: libimobiledevice connects
+ * to the lockdown port of the address itself instead of going through the
+ * responder.
+ */
+static void test_network_address(void)
+{
+    char pairing_dir[] = "/tmp/healthcheck-pairings-XXXXXX";
+    char address_map[512];
+    mock_lockdown_t device = { 0 };
+    char *report;
+
+    if (!mock_lockdown_start_on(&device, LOCKDOWN_PORT, 0)) {
+        printf("ok - network address # SKIP port %u is in use\n", LOCKDOWN_PORT);
+        return;
+    }
+    CHECK(mkdtemp(pairing_dir) != NULL);
+    write_pairing(pairing_dir, NETWORK_UDID);
+    write_address_map(address_map, sizeof(address_map), pairing_dir, NETWORK_UDID " 127.0.0.1\n");
+
+    report = run_health_check(pairing_dir, address_map);
+    mock_lockdown_stop(&device);
+
+    fprintf(stderr, "%s", report);
+    CHECK(report_has(report, NETWORK_UDID, "\"address\": \"127.0.0.1\""));
+    CHECK(report_has(report, NETWORK_UDID, "\"alive\": true"));
+    CHECK(device.sessions == 1);
+    printf("ok - network device at a plain address\n");
+
+    free(report);
+}
+
+int main(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+    make_identity(&identity);
+    test_report();
+    test_duplicate_udids();
+    test_network_address();
+    return 0;
+}
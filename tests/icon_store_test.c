@@ -0,0 +1,364 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "IconStore.h"
+
+#define MAX_DEVICES 16
+#define MAX_APPS 800
+#define ICON_FILE_SIZE 1024
+#define BYTE_BUDGET (8 * 1024 * 1024)
+#define FAVORITE_LOOKUPS 2000
+#define MAX_PEAK_GROWTH (2 * BYTE_BUDGET)
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+/** Stands in for a CGImage: reference counted pixels plus the version read from the icon file. */
+typedef struct {
+    atomic_int refs;
+    unsigned int version;
+    size_t size;
+    unsigned char pixels[];
+} image_t;
+
+static char g_directory[64];
+static atomic_size_t g_live_bytes;
+static atomic_uint g_decodes;
+
+// lets a test hold one decode in the middle
+static pthread_mutex_t g_gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_gate_cond = PTHREAD_COND_INITIALIZER;
+static const char *g_gate_key;
+static int g_gate_waiting;
+static int g_gate_open = 1;
+
+static void *decode_image(const char *path, unsigned int pixel_size, size_t *cost, void *ctx)
+{
+    char data[ICON_FILE_SIZE];
+    size_t size = (size_t)pixel_size * pixel_size * 4;
+    FILE *file = fopen(path, "rb");
+    image_t *image;
+    size_t length;
+
+    (void)ctx;
+    atomic_fetch_add(&g_decodes, 1);
+    pthread_mutex_lock(&g_gate_lock);
+    if (g_gate_key && strstr(path, g_gate_key)) {
+        g_gate_waiting = 1;
+        pthread_cond_broadcast(&g_gate_cond);
+        while (!g_gate_open) {
+            pthread_cond_wait(&g_gate_cond, &g_gate_lock);
+        }
+    }
+    pthread_mutex_unlock(&g_gate_lock);
+    if (!file) {
+        return NULL;
+    }
+    length = fread(data, 1, sizeof(data) - 1, file);
+    fclose(file);
+    data[length] = '\0';
+    CHECK((image = malloc(sizeof(image_t) + size)) != NULL);
+    atomic_init(&image->refs, 1);
+    CHECK(sscanf(data, "v%u", &image->version) == 1);
+    image->size = size;
+    memset(image->pixels, image->version & 0xFF, size); // touch every page like a real decode
+    atomic_fetch_add(&g_live_bytes, size);
+    *cost = size;
+    return image;
+}
+
+static void retain_image(void *image, void *ctx)
+{
+    (void)ctx;
+    atomic_fetch_add(&((image_t *)image)->refs, 1);
+}
+
+static void release_image(void *ptr, void *ctx)
+{
+    image_t *image = ptr;
+
+    (void)ctx;
+    if (atomic_fetch_sub(&image->refs, 1) == 1) {
+        atomic_fetch_sub(&g_live_bytes, image->size);
+        free(image);
+    }
+}
+
+static void host_name(char host[static 24], unsigned int device)
+{
+    snprintf(host, 24, "device-%02u", device);
+}
+
+static void bundle_name(char bundle[static 24], unsigned int app)
+{
+    snprintf(bundle, 24, "com.example.app%03u", app);
+}
+
+static void icon_key(char key[static 64], unsigned int device, unsigned int app)
+{
+    char host[24], bundle[24];
+
+    host_name(host, device);
+    bundle_name(bundle, app);
+    snprintf(key, 64, "%s/%s.png", host, bundle);
+}
+
+/** Returns what iconStoreStoreIcon() did, the icon data starts with its version. */
+static int store_icon(icon_store_t store, unsigned int device, unsigned int app, unsigned int version)
+{
+    char data[ICON_FILE_SIZE];
+    char host[24], bundle[24], expected[64];
+    char *key = NULL;
+    int result;
+
+    memset(data, 'x', sizeof(data));
+    snprintf(data, sizeof(data), "v%u\n", version);
+    host_name(host, device);
+    bundle_name(bundle, app);
+    result = iconStoreStoreIcon(store, host, bundle, data, sizeof(data), &key);
+    CHECK(result >= 0);
+    icon_key(expected, device, app);
+    CHECK(key && strcmp(key, expected) == 0);
+    free(key);
+    return result;
+}
+
+static icon_store_t new_store(void)
+{
+    icon_store_t store = iconStoreNew(g_directory, decode_image, retain_image, release_image, NULL);
+
+    CHECK(store != NULL);
+    iconStoreSetByteBudget(store, BYTE_BUDGET);
+    return store;
+}
+
+static double peak_rss_mb(void)
+{
+    struct rusage usage;
+
+    CHECK(getrusage(RUSAGE_SELF, &usage) == 0);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+static int path_exists(const char *name)
+{
+    char path[256];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", g_directory, name);
+    return stat(path, &st) == 0;
+}
+
+/** Loads a thumbnail and checks the cache stayed within its budget. */
+static void load(icon_store_t store, unsigned int device, unsigned int app)
+{
+    char key[64];
+    icon_store_stats_t stats;
+    void *image;
+
+    icon_key(key, device, app);
+    image = iconStoreCopyCachedThumbnail(store, key);
+    if (!image) {
+        image = iconStoreLoadThumbnail(store, key);
+    }
+    CHECK(image != NULL);
+    release_image(image, NULL);
+    iconStoreGetStats(store, &stats);
+    CHECK(stats.current_bytes <= BYTE_BUDGET);
+}
+
+/**
+ * Scrolls through every device's app list twice and then opens favorites,
+ * mostly the first fifth of the apps, for each grid size. Memory must stay
+ * flat as the number of icons grows.
+ */
+static void test_growth(void)
+{
+    static const unsigned int devices[] = { 1, 4, 16 };
+    static const unsigned int apps[] = { 50, 200, 800 };
+    icon_store_t store = new_store();
+    double baseline;
+
+    for (unsigned int device = 0; device < MAX_DEVICES; device++) {
+        for (unsigned int app = 0; app < MAX_APPS; app++) {
+            store_icon(store, device, app, 1);
+        }
+    }
+    iconStoreFree(store);
+    baseline = peak_rss_mb();
+    srand(1);
+    for (size_t d = 0; d < sizeof(devices) / sizeof(devices[0]); d++) {
+        for (size_t a = 0; a < sizeof(apps) / sizeof(apps[0]); a++) {
+            icon_store_stats_t stats;
+            double hit_rate;
+
+            store = new_store();
+            for (unsigned int device = 0; device < devices[d]; device++) {
+                for (int pass = 0; pass < 2; pass++) {
+                    for (unsigned int app = 0; app < apps[a]; app++) {
+                        load(store, device, app);
+                    }
+                }
+            }
+            for (unsigned int i = 0; i < FAVORITE_LOOKUPS; i++) {
+                unsigned int device = rand() % devices[d];
+                unsigned int app = (rand() % 5) ? rand() % (apps[a] / 5) : rand() % apps[a];
+                load(store, device, app);
+            }
+            iconStoreGetStats(store, &stats);
+            CHECK(atomic_load(&g_live_bytes) == stats.current_bytes);
+            hit_rate = 100.0 * stats.hits / (stats.hits + stats.misses);
+            printf("ok - %2u devices x %3u apps: hit rate %5.1f%%, %3zu thumbnails in %.1f MB, peak RSS %.1f MB\n",
+                   devices[d], apps[a], hit_rate, stats.thumbnails, stats.current_bytes / (1024.0 * 1024.0), peak_rss_mb());
+            iconStoreFree(store);
+            CHECK(atomic_load(&g_live_bytes) == 0);
+        }
+    }
+    CHECK(peak_rss_mb() - baseline < MAX_PEAK_GROWTH / (1024.0 * 1024.0));
+    printf("ok - peak RSS grew %.1f MB for %u icons with a %u MB budget\n", peak_rss_mb() - baseline, MAX_DEVICES * MAX_APPS, BYTE_BUDGET / (1024 * 1024));
+}
+
+static void *load_thread(void *ctx)
+{
+    icon_store_t store = ctx;
+    char key[64];
+
+    icon_key(key, 0, 0);
+    return iconStoreLoadThumbnail(store, key);
+}
+
+/** A decode that started before the icon was replaced is not cached or returned. */
+static void test_replaced_while_decoding(void)
+{
+    icon_store_t store = new_store();
+    pthread_t thread;
+    image_t *image;
+    char key[64];
+
+    icon_key(key, 0, 0);
+    CHECK(store_icon(store, 0, 0, 1) == 0); // written by test_growth
+    pthread_mutex_lock(&g_gate_lock);
+    g_gate_key = key;
+    g_gate_waiting = 0;
+    g_gate_open = 0;
+    pthread_mutex_unlock(&g_gate_lock);
+    atomic_store(&g_decodes, 0);
+    CHECK(pthread_create(&thread, NULL, load_thread, store) == 0);
+    pthread_mutex_lock(&g_gate_lock);
+    while (!g_gate_waiting) {
+        pthread_cond_wait(&g_gate_cond, &g_gate_lock);
+    }
+    pthread_mutex_unlock(&g_gate_lock);
+
+    // the decode has started on the old file, now replace it
+    CHECK(store_icon(store, 0, 0, 2) == 1);
+    pthread_mutex_lock(&g_gate_lock);
+    g_gate_key = NULL;
+    g_gate_open = 1;
+    pthread_cond_broadcast(&g_gate_cond);
+    pthread_mutex_unlock(&g_gate_lock);
+    CHECK(pthread_join(thread, (void **)&image) == 0);
+    CHECK(image != NULL);
+    CHECK(image->version == 2);
+    CHECK(atomic_load(&g_decodes) == 2);
+    release_image(image, NULL);
+    CHECK((image = iconStoreCopyCachedThumbnail(store, key)) != NULL);
+    CHECK(image->version == 2);
+    release_image(image, NULL);
+
+    // storing the same data again keeps the thumbnail
+    CHECK(store_icon(store, 0, 0, 2) == 0);
+    CHECK((image = iconStoreCopyCachedThumbnail(store, key)) != NULL);
+    release_image(image, NULL);
+    iconStoreFree(store);
+    printf("ok - decode of a replaced icon is redone\n");
+}
+
+/** Pruning a host deletes the files and thumbnails of apps that are gone. */
+static void test_remove_host(void)
+{
+    const char *keep[] = { "com.example.app001", "com.example.app002" };
+    icon_store_t store = new_store();
+    icon_store_stats_t stats;
+    char key[64], host[32];
+
+    for (unsigned int app = 0; app < 10; app++) {
+        load(store, 1, app);
+    }
+    load(store, 2, 0);
+    host_name(host, 1);
+    iconStoreRemoveHost(store, host, keep, 2);
+    icon_key(key, 1, 1);
+    CHECK(path_exists(key));
+    void *image = iconStoreCopyCachedThumbnail(store, key);
+    CHECK(image != NULL);
+    release_image(image, NULL);
+    icon_key(key, 1, 3);
+    CHECK(!path_exists(key));
+    CHECK(iconStoreCopyCachedThumbnail(store, key) == NULL);
+    iconStoreGetStats(store, &stats);
+    CHECK(stats.thumbnails == 3);
+
+    iconStoreRemoveHost(store, host, NULL, 0);
+    CHECK(!path_exists(host));
+    iconStoreGetStats(store, &stats);
+    CHECK(stats.thumbnails == 1);
+    iconStoreFree(store);
+    CHECK(atomic_load(&g_live_bytes) == 0);
+    printf("ok - removing a host prunes files and thumbnails\n");
+}
+
+static void remove_directory(void)
+{
+    icon_store_t store = new_store();
+    char host[24];
+
+    for (unsigned int device = 0; device < MAX_DEVICES; device++) {
+        host_name(host, device);
+        iconStoreRemoveHost(store, host, NULL, 0);
+    }
+    iconStoreFree(store);
+    CHECK(rmdir(g_directory) == 0);
+}
+
+int main(void)
+{
+    strcpy(g_directory, "/tmp/icon_store_test.XXXXXX");
+    CHECK(mkdtemp(g_directory) != NULL);
+    test_growth();
+    test_replaced_while_decoding();
+    test_remove_host();
+    remove_directory();
+    return 0;
+}
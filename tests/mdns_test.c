@@ -0,0 +1,543 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "mdns.h"
+
+#define SERVICE MDNS_SERVICE_MOBDEV2
+#define GROUP "239.255.83.53"
+#define LOOPBACK "127.0.0.1"
+#define INSTANCES 16
+#define MAX_FAKES (INSTANCES + 4)
+#define RESOLVE_TIMEOUT_MS 2000
+#define CACHE_HIT_MS 50
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_PTR 12
+#define DNS_TYPE_AAAA 28
+#define DNS_TYPE_SRV 33
+#define DNS_CLASS_IN 1
+#define DNS_CACHE_FLUSH 0x8000
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+static uint16_t g_port;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// MARK: - Responder
+
+/**
+ * A device advertising _apple-mobdev2._tcp. Records are only sent for the
+ * questions asked, so the browser has to follow up from PTR to SRV to the
+ * address like it does with real responders.
+ */
+typedef struct {
+    char instance[128];
+    char host[64];
+    char address[64];
+    uint32_t ttl;
+    int hidden;
+} fake_device_t;
+
+typedef struct {
+    int fd;
+    pthread_mutex_t lock;
+    fake_device_t devices[MAX_FAKES];
+    size_t count;
+    int silent;
+    int queries;
+    volatile int done;
+    pthread_t thread;
+} responder_t;
+
+typedef struct {
+    uint8_t data[9000];
+    size_t len;
+    uint16_t answers;
+} packet_t;
+
+static void put16(packet_t *packet, uint16_t value)
+{
+    packet->data[packet->len++] = value >> 8;
+    packet->data[packet->len++] = value & 0xFF;
+}
+
+static void put32(packet_t *packet, uint32_t value)
+{
+    put16(packet, value >> 16);
+    put16(packet, value & 0xFFFF);
+}
+
+static void put_name(packet_t *packet, const char *name)
+{
+    while (*name) {
+        const char *dot = strchr(name, '.');
+        size_t label = dot ? (size_t)(dot - name) : strlen(name);
+        packet->data[packet->len++] = (uint8_t)label;
+        memcpy(&packet->data[packet->len], name, label);
+        packet->len += label;
+        name += label + (dot ? 1 : 0);
+    }
+    packet->data[packet->len++] = 0;
+}
+
+/** Starts a record and returns the offset of its rdlength. */
+static size_t put_record_header(packet_t *packet, const char *name, uint16_t type, int unique, uint32_t ttl)
+{
+    size_t rdlength;
+    put_name(packet, name);
+    put16(packet, type);
+    put16(packet, DNS_CLASS_IN | (unique ? DNS_CACHE_FLUSH : 0));
+    put32(packet, ttl);
+    rdlength = packet->len;
+    put16(packet, 0);
+    packet->answers++;
+    return rdlength;
+}
+
+static void end_record(packet_t *packet, size_t rdlength)
+{
+    uint16_t len = (uint16_t)(packet->len - rdlength - 2);
+    packet->data[rdlength] = len >> 8;
+    packet->data[rdlength + 1] = len & 0xFF;
+}
+
+static void put_ptr(packet_t *packet, const fake_device_t *device, uint32_t ttl)
+{
+    size_t rdlength = put_record_header(packet, SERVICE, DNS_TYPE_PTR, 0, ttl);
+    put_name(packet, device->instance);
+    end_record(packet, rdlength);
+}
+
+static void put_srv(packet_t *packet, const fake_device_t *device)
+{
+    size_t rdlength = put_record_header(packet, device->instance, DNS_TYPE_SRV, 1, device->ttl);
+    put16(packet, 0);
+    put16(packet, 0);
+    put16(packet, 62078);
+    put_name(packet, device->host);
+    end_record(packet, rdlength);
+}
+
+static void put_address(packet_t *packet, const fake_device_t *device, uint16_t type)
+{
+    uint8_t addr[16];
+    size_t rdlength;
+
+    if (type == DNS_TYPE_A && inet_pton(AF_INET, device->address, addr) == 1) {
+        rdlength = put_record_header(packet, device->host, DNS_TYPE_A, 1, device->ttl);
+        memcpy(&packet->data[packet->len], addr, 4);
+        packet->len += 4;
+        end_record(packet, rdlength);
+    } else if (type == DNS_TYPE_AAAA && inet_pton(AF_INET6, device->address, addr) == 1) {
+        rdlength = put_record_header(packet, device->host, DNS_TYPE_AAAA, 1, device->ttl);
+        memcpy(&packet->data[packet->len], addr, 16);
+        packet->len += 16;
+        end_record(packet, rdlength);
+    }
+}
+
+static void send_packet(responder_t *responder, packet_t *packet)
+{
+    struct sockaddr_in group = { 0 };
+
+    group.sin_family = AF_INET;
+    group.sin_port = htons(g_port);
+    inet_pton(AF_INET, GROUP, &group.sin_addr);
+    packet->data[2] = 0x84; // response, authoritative
+    packet->data[6] = packet->answers >> 8;
+    packet->data[7] = packet->answers & 0xFF;
+    CHECK(sendto(responder->fd, packet->data, packet->len, 0, (struct sockaddr *)&group, sizeof(group)) == (ssize_t)packet->len);
+}
+
+/** Questions from the browser are never compressed. */
+static int read_name(const uint8_t *data, size_t len, size_t *offset, char *name, size_t size)
+{
+    size_t out = 0;
+
+    while (*offset < len && data[*offset] != 0) {
+        uint8_t label = data[(*offset)++];
+        if (*offset + label > len || out + label + 2 > size) {
+            return 0;
+        }
+        if (out > 0) {
+            name[out++] = '.';
+        }
+        memcpy(&name[out], &data[*offset], label);
+        out += label;
+        *offset += label;
+    }
+    name[out] = '\0';
+    (*offset)++;
+    return *offset <= len;
+}
+
+static void answer_query(responder_t *responder, const uint8_t *data, size_t len)
+{
+    packet_t *packet = calloc(1, sizeof(packet_t));
+    size_t offset = 12;
+    uint16_t questions;
+
+    if (len < 12 || (data[2] & 0x80) != 0) {
+        free(packet);
+        return;
+    }
+    questions = (uint16_t)((data[4] << 8) | data[5]);
+    packet->len = 12;
+    pthread_mutex_lock(&responder->lock);
+    responder->queries++;
+    for (uint16_t i = 0; i < questions && !responder->silent; i++) {
+        char name[256];
+        uint16_t type;
+        if (!read_name(data, len, &offset, name, sizeof(name)) || offset + 4 > len) {
+            break;
+        }
+        type = (uint16_t)((data[offset] << 8) | data[offset + 1]);
+        offset += 4;
+        for (size_t j = 0; j < responder->count; j++) {
+            fake_device_t *device = &responder->devices[j];
+            if (device->hidden) {
+                continue;
+            }
+            if (type == DNS_TYPE_PTR && strcasecmp(name, SERVICE) == 0) {
+                put_ptr(packet, device, device->ttl);
+            } else if (type == DNS_TYPE_SRV && strcasecmp(name, device->instance) == 0) {
+                put_srv(packet, device);
+            } else if ((type == DNS_TYPE_A || type == DNS_TYPE_AAAA) && strcasecmp(name, device->host) == 0) {
+                put_address(packet, device, type);
+            }
+        }
+    }
+    pthread_mutex_unlock(&responder->lock);
+    if (packet->answers > 0) {
+        send_packet(responder, packet);
+    }
+    free(packet);
+}
+
+static void *responder_thread(void *arg)
+{
+    responder_t *responder = arg;
+    uint8_t data[9000];
+
+    while (!responder->done) {
+        struct pollfd pfd = { responder->fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 50) == 1) {
+            ssize_t len = recv(responder->fd, data, sizeof(data), 0);
+            if (len > 0) {
+                answer_query(responder, data, (size_t)len);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int multicast_socket(void)
+{
+    struct sockaddr_in addr = { 0 };
+    struct ip_mreq mreq = { 0 };
+    int yes = 1;
+    int fd;
+
+    CHECK((fd = socket(AF_INET, SOCK_DGRAM, 0)) >= 0);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+#ifdef SO_REUSEPORT
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+#endif
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(g_port);
+    CHECK(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    inet_pton(AF_INET, GROUP, &mreq.imr_multiaddr);
+    inet_pton(AF_INET, LOOPBACK, &mreq.imr_interface);
+    CHECK(setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == 0);
+    CHECK(setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq.imr_interface, sizeof(mreq.imr_interface)) == 0);
+    return fd;
+}
+
+static fake_device_t *responder_add(responder_t *responder, const char *mac, const char *address, uint32_t ttl)
+{
+    fake_device_t *device;
+
+    CHECK(responder->count < MAX_FAKES);
+    device = &responder->devices[responder->count];
+    snprintf(device->instance, sizeof(device->instance), "%s@fe80::%zx.%s", mac, responder->count + 1, SERVICE);
+    snprintf(device->host, sizeof(device->host), "device-%zu.local", responder->count);
+    snprintf(device->address, sizeof(device->address), "%s", address);
+    device->ttl = ttl;
+    responder->count++;
+    return device;
+}
+
+static void responder_start(responder_t *responder)
+{
+    pthread_mutex_init(&responder->lock, NULL);
+    responder->fd = multicast_socket();
+    CHECK(pthread_create(&responder->thread, NULL, responder_thread, responder) == 0);
+}
+
+static void responder_stop(responder_t *responder)
+{
+    responder->done = 1;
+    pthread_join(responder->thread, NULL);
+    close(responder->fd);
+    pthread_mutex_destroy(&responder->lock);
+}
+
+/** Withdraws a device the way a responder going to sleep does. */
+static void responder_goodbye(responder_t *responder, fake_device_t *device)
+{
+    packet_t *packet = calloc(1, sizeof(packet_t));
+
+    pthread_mutex_lock(&responder->lock);
+    device->hidden = 1;
+    pthread_mutex_unlock(&responder->lock);
+    packet->len = 12;
+    put_ptr(packet, device, 0);
+    send_packet(responder, packet);
+    free(packet);
+}
+
+static int responder_queries(responder_t *responder)
+{
+    int queries;
+    pthread_mutex_lock(&responder->lock);
+    queries = responder->queries;
+    pthread_mutex_unlock(&responder->lock);
+    return queries;
+}
+
+// MARK: - Browsing
+
+typedef struct {
+    char instance[MAX_FAKES][128];
+    char address[MAX_FAKES][64];
+    int added[MAX_FAKES];
+    int removed[MAX_FAKES];
+    size_t count;
+    size_t added_count;
+    size_t removed_count;
+    size_t wait_added;
+    size_t wait_removed;
+    uint64_t last_added;
+} seen_t;
+
+static size_t seen_index(seen_t *seen, const char *instance)
+{
+    for (size_t i = 0; i < seen->count; i++) {
+        if (strcmp(seen->instance[i], instance) == 0) {
+            return i;
+        }
+    }
+    CHECK(seen->count < MAX_FAKES);
+    snprintf(seen->instance[seen->count], sizeof(seen->instance[0]), "%s", instance);
+    return seen->count++;
+}
+
+static int on_instance(const char *instance, const char *address, int added, void *user_data)
+{
+    seen_t *seen = user_data;
+    size_t i = seen_index(seen, instance);
+
+    if (added) {
+        snprintf(seen->address[i], sizeof(seen->address[0]), "%s", address);
+        seen->added[i]++;
+        seen->added_count++;
+        seen->last_added = now_ms();
+    } else {
+        seen->removed[i]++;
+        seen->removed_count++;
+    }
+    return (seen->wait_added && seen->added_count >= seen->wait_added) ||
+           (seen->wait_removed && seen->removed_count >= seen->wait_removed);
+}
+
+static const char *seen_address(seen_t *seen, const fake_device_t *device)
+{
+    for (size_t i = 0; i < seen->count; i++) {
+        if (strcasecmp(seen->instance[i], device->instance) == 0) {
+            return seen->address[i];
+        }
+    }
+    return NULL;
+}
+
+static mdns_browser_t new_browser(void)
+{
+    mdns_browser_t browser = mdns_browser_new(SERVICE, GROUP, g_port, LOOPBACK);
+    CHECK(browser != NULL);
+    return browser;
+}
+
+// MARK: - Tests
+
+/**
+ * All instances are resolved together: the SRV and address questions for
+ * every instance go out in the same packets, so resolving 16 devices takes
+ * about as long and as many queries as resolving one.
+ */
+static void test_concurrent_resolve(void)
+{
+    responder_t responder = { 0 };
+    seen_t seen = { 0 };
+    mdns_browser_t browser;
+    char path[] = "/tmp/mdns-cache-XXXXXX";
+    uint64_t start, elapsed;
+    int queries;
+    int fd;
+
+    for (int i = 0; i < INSTANCES; i++) {
+        char mac[32];
+        char address[32];
+        snprintf(mac, sizeof(mac), "a4:83:e7:00:00:%02x", i);
+        snprintf(address, sizeof(address), "10.0.0.%d", i + 1);
+        responder_add(&responder, mac, address, 120);
+    }
+    responder_start(&responder);
+    browser = new_browser();
+
+    start = now_ms();
+    seen.wait_added = INSTANCES;
+    CHECK(mdns_browser_run(browser, RESOLVE_TIMEOUT_MS * 2, on_instance, &seen));
+    elapsed = seen.last_added - start;
+    queries = responder_queries(&responder);
+    CHECK(seen.added_count == INSTANCES);
+    for (size_t i = 0; i < responder.count; i++) {
+        const char *address = seen_address(&seen, &responder.devices[i]);
+        CHECK(address && strcmp(address, responder.devices[i].address) == 0);
+    }
+    // browse, then one batch of SRV questions, then one batch of A/AAAA questions
+    CHECK(queries <= 4);
+    CHECK(elapsed < RESOLVE_TIMEOUT_MS);
+    printf("ok - resolved %d instances in %llu ms with %d queries\n", INSTANCES, (unsigned long long)elapsed, queries);
+
+    // the second run is answered from the cache without touching the network
+    responder.silent = 1;
+    memset(&seen, 0, sizeof(seen));
+    seen.wait_added = INSTANCES;
+    start = now_ms();
+    CHECK(mdns_browser_run(browser, RESOLVE_TIMEOUT_MS, on_instance, &seen));
+    CHECK(seen.added_count == INSTANCES);
+    CHECK(now_ms() - start < CACHE_HIT_MS);
+    CHECK(responder_queries(&responder) == queries);
+    printf("ok - second run served from the cache\n");
+
+    // and so is a new browser, like the next jitterbugpair run, after loading the saved cache
+    CHECK((fd = mkstemp(path)) >= 0);
+    close(fd);
+    CHECK(mdns_browser_save(browser, path));
+    mdns_browser_free(browser);
+    browser = new_browser();
+    CHECK(mdns_browser_load(browser, path));
+    memset(&seen, 0, sizeof(seen));
+    seen.wait_added = INSTANCES;
+    start = now_ms();
+    CHECK(mdns_browser_run(browser, RESOLVE_TIMEOUT_MS, on_instance, &seen));
+    CHECK(seen.added_count == INSTANCES);
+    CHECK(now_ms() - start < CACHE_HIT_MS);
+    CHECK(responder_queries(&responder) == queries);
+    printf("ok - saved cache reused by a new browser\n");
+
+    unlink(path);
+    mdns_browser_free(browser);
+    responder_stop(&responder);
+}
+
+/** Devices disappear when their records expire or when they say goodbye. */
+static void test_expiry_and_goodbye(void)
+{
+    responder_t responder = { 0 };
+    seen_t seen = { 0 };
+    mdns_browser_t browser = new_browser();
+    fake_device_t *expiring = responder_add(&responder, "a4:83:e7:00:01:01", "10.0.1.1", 1);
+    fake_device_t *leaving = responder_add(&responder, "a4:83:e7:00:01:02", "10.0.1.2", 120);
+    uint64_t start;
+
+    responder_start(&responder);
+    seen.wait_added = 2;
+    CHECK(mdns_browser_run(browser, RESOLVE_TIMEOUT_MS, on_instance, &seen));
+    CHECK(seen.added_count == 2);
+
+    // the expiring device stops answering, the leaving one withdraws its records
+    pthread_mutex_lock(&responder.lock);
+    expiring->hidden = 1;
+    pthread_mutex_unlock(&responder.lock);
+    memset(&seen, 0, sizeof(seen));
+    seen.wait_removed = 2;
+    start = now_ms();
+    responder_goodbye(&responder, leaving);
+    CHECK(mdns_browser_run(browser, 5000, on_instance, &seen));
+    CHECK(seen.removed_count == 2);
+    CHECK(seen.removed[seen_index(&seen, expiring->instance)] == 1);
+    CHECK(seen.removed[seen_index(&seen, leaving->instance)] == 1);
+    // TTL of 1 s, goodbye records linger for 1 s
+    CHECK(now_ms() - start < 2500);
+    printf("ok - TTL expiry and goodbye in %llu ms\n", (unsigned long long)(now_ms() - start));
+
+    mdns_browser_free(browser);
+    responder_stop(&responder);
+}
+
+/** A link-local IPv6 address has no scope in the report, so it is dropped. */
+static void test_link_local(void)
+{
+    responder_t responder = { 0 };
+    seen_t seen = { 0 };
+    mdns_browser_t browser = new_browser();
+    fake_device_t *link_local = responder_add(&responder, "a4:83:e7:00:02:01", "fe80::1c2b:3a4d:5e6f:7081", 120);
+    fake_device_t *global = responder_add(&responder, "a4:83:e7:00:02:02", "2001:db8::2", 120);
+
+    responder_start(&responder);
+    CHECK(mdns_browser_run(browser, 1500, on_instance, &seen));
+    CHECK(seen_address(&seen, link_local) == NULL);
+    CHECK(seen_address(&seen, global) && strcmp(seen_address(&seen, global), "2001:db8::2") == 0);
+    printf("ok - link-local addresses are dropped\n");
+
+    mdns_browser_free(browser);
+    responder_stop(&responder);
+}
+
+int main(void)
+{
+    // keep away from other runs of this test on the same machine
+    g_port = (uint16_t)(20000 + getpid() % 20000);
+    test_concurrent_resolve();
+    test_expiry_and_goodbye();
+    test_link_local();
+    return 0;
+}
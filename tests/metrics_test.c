@@ -0,0 +1,190 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "Metrics.h"
+
+#define DEVICES 1000
+#define THREADS 8
+#define SAMPLES_PER_THREAD 100000
+#define OVERHEAD_SAMPLES 1000000
+#define MAX_RELATIVE_ERROR 0.0625
+#define MAX_RECORD_NS 1000
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+/** Records a sample of about `value_us` by backdating the start time. */
+static void record_value(const char *device, metrics_operation_t op, uint64_t value_us)
+{
+    metricsRecord(device, op, metricsNow() - value_us, 1);
+}
+
+/** Returns the Prometheus export, which must be freed. */
+static char *export_metrics(void)
+{
+    char *data = NULL;
+    size_t len = 0;
+    FILE *file = open_memstream(&data, &len);
+
+    CHECK(file != NULL);
+    CHECK(metricsWritePrometheus(file));
+    fclose(file);
+    return data;
+}
+
+static unsigned long long exported_count(const char *report, const char *device, const char *operation)
+{
+    char needle[256];
+    const char *line;
+
+    snprintf(needle, sizeof(needle), "jitterbug_operation_duration_seconds_count{device=\"%s\",operation=\"%s\"} ", device, operation);
+    CHECK((line = strstr(report, needle)) != NULL);
+    return strtoull(line + strlen(needle), NULL, 10);
+}
+
+/** Quantiles of 1..1000 ms come back within the bucket resolution. */
+static void test_accuracy(void)
+{
+    static const double quantiles[] = { 0.01, 0.25, 0.5, 0.9, 0.99, 1.0 };
+
+    for (uint64_t ms = 1; ms <= 1000; ms++) {
+        record_value("accuracy", kMetricsImageUpload, ms * 1000);
+    }
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        double expected = quantiles[i] * 1000 / 1000.0;
+        double actual = metricsQuantile("accuracy", kMetricsImageUpload, quantiles[i]);
+        double error = (actual - expected) / expected;
+        CHECK(error > -MAX_RELATIVE_ERROR && error < MAX_RELATIVE_ERROR);
+    }
+    CHECK(metricsQuantile("accuracy", kMetricsAppLaunch, 0.5) == 0);
+    CHECK(metricsQuantile("missing", kMetricsImageUpload, 0.5) == 0);
+    printf("ok - quantiles within %.2f%%\n", MAX_RELATIVE_ERROR * 100);
+}
+
+/** Every operation of a thousand devices gets its own series. */
+static void test_many_devices(void)
+{
+    char device[64];
+    char *report;
+
+    for (int i = 0; i < DEVICES; i++) {
+        snprintf(device, sizeof(device), "00008030-%016d", i);
+        for (int op = 0; op < kMetricsOperationCount; op++) {
+            record_value(device, (metrics_operation_t)op, 1000 + (uint64_t)op);
+        }
+    }
+    report = export_metrics();
+    CHECK(strstr(report, "jitterbug_metrics_dropped_total 0\n") != NULL);
+    CHECK(exported_count(report, "00008030-0000000000000000", "lockdown_start") == 1);
+    CHECK(exported_count(report, "00008030-0000000000000999", "pair_record_read") == 1);
+    CHECK(exported_count(report, "00008030-0000000000000500", "heartbeat_wait") == 1);
+    free(report);
+    printf("ok - %d devices x %d operations without drops\n", DEVICES, kMetricsOperationCount);
+}
+
+static void *record_worker(void *arg)
+{
+    char device[32];
+
+    snprintf(device, sizeof(device), "worker-%d", (int)(intptr_t)arg);
+    for (int i = 0; i < SAMPLES_PER_THREAD; i++) {
+        // half the samples contend on one series, half go to a private one
+        metricsRecord(i % 2 ? "shared" : device, kMetricsServiceStart, metricsNow(), 1);
+    }
+    return NULL;
+}
+
+/** Threads recording at once, into shared and new series, lose no samples. */
+static void test_concurrent(void)
+{
+    pthread_t threads[THREADS];
+    char *report;
+
+    for (int i = 0; i < THREADS; i++) {
+        CHECK(pthread_create(&threads[i], NULL, record_worker, (void *)(intptr_t)i) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    report = export_metrics();
+    CHECK(exported_count(report, "shared", "service_start") == (unsigned long long)THREADS * SAMPLES_PER_THREAD / 2);
+    CHECK(exported_count(report, "worker-0", "service_start") == SAMPLES_PER_THREAD / 2);
+    CHECK(exported_count(report, "worker-7", "service_start") == SAMPLES_PER_THREAD / 2);
+    free(report);
+    printf("ok - %d threads recording concurrently\n", THREADS);
+}
+
+/** Recording is cheap next to any device round trip, even with 7000 series. */
+static void test_overhead(void)
+{
+    uint64_t start = metricsNow();
+    double ns_per_record;
+
+    for (int i = 0; i < OVERHEAD_SAMPLES; i++) {
+        metricsRecord("00008030-0000000000000500", kMetricsServiceStart, start, 1);
+    }
+    // includes the clock read in each sample
+    ns_per_record = (metricsNow() - start) * 1000.0 / OVERHEAD_SAMPLES;
+    CHECK(ns_per_record < MAX_RECORD_NS);
+    printf("ok - %.0f ns per sample\n", ns_per_record);
+}
+
+/** The file export replaces the previous file in one step. */
+static void test_write_to_file(void)
+{
+    char dir[] = "/tmp/metrics-test-XXXXXX";
+    char path[256];
+    char tmp[sizeof(path) + 4];
+    FILE *file;
+    char line[256];
+    int found = 0;
+
+    CHECK(mkdtemp(dir) != NULL);
+    snprintf(path, sizeof(path), "%s/metrics.prom", dir);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    CHECK(metricsWriteToFile(path));
+    CHECK(access(tmp, F_OK) != 0);
+    CHECK((file = fopen(path, "r")) != NULL);
+    while (fgets(line, sizeof(line), file)) {
+        found |= strncmp(line, "# TYPE jitterbug_operation_duration_seconds histogram", 53) == 0;
+    }
+    fclose(file);
+    CHECK(found);
+    unlink(path);
+    rmdir(dir);
+    printf("ok - write to file\n");
+}
+
+int main(void)
+{
+    test_accuracy();
+    test_many_devices();
+    test_concurrent();
+    test_overhead();
+    test_write_to_file();
+    return 0;
+}
@@ -0,0 +1,597 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include "ServiceLoop.h"
+
+#define LOOKUP_DELAY_MS 200
+#define UPLOAD_CHUNK 65536
+#define UPLOAD_CHUNKS 80
+#define UPLOAD_CHUNK_DELAY_MS 10
+#define UPLOAD_SIZE ((uint64_t)UPLOAD_CHUNK * UPLOAD_CHUNKS)
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void sleep_ms(unsigned int ms)
+{
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+// MARK: - Mock device
+
+typedef struct mock_service mock_service_t;
+typedef void (*mock_handler_t)(mock_service_t *service, int fd);
+
+struct mock_service {
+    int listen_fd;
+    uint16_t port;
+    mock_handler_t handler;
+    SSL_CTX *ssl_ctx;
+    pthread_t thread;
+};
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len) {
+        ssize_t ret = recv(fd, (char *)buf + got, len - got, 0);
+        if (ret <= 0) {
+            return 0;
+        }
+        got += (size_t)ret;
+    }
+    return 1;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    return send(fd, buf, len, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+static char *read_message(int fd, uint32_t *length)
+{
+    uint8_t header[4];
+    char *payload;
+    if (!read_all(fd, header, sizeof(header))) {
+        return NULL;
+    }
+    *length = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | header[3];
+    payload = calloc(1, *length + 1);
+    if (!read_all(fd, payload, *length)) {
+        free(payload);
+        return NULL;
+    }
+    return payload;
+}
+
+static void write_message(int fd, const char *payload)
+{
+    uint32_t length = (uint32_t)strlen(payload);
+    uint8_t header[4] = { length >> 24, length >> 16, length >> 8, length };
+    write_all(fd, header, sizeof(header));
+    write_all(fd, payload, length);
+}
+
+static void *mock_thread(void *arg)
+{
+    mock_service_t *service = arg;
+    int fd = accept(service->listen_fd, NULL, NULL);
+    if (fd >= 0) {
+        service->handler(service, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void mock_start(mock_service_t *service, mock_handler_t handler)
+{
+    struct sockaddr_in addr = { 0 };
+    socklen_t len = sizeof(addr);
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    service->handler = handler;
+    CHECK((service->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+    CHECK(bind(service->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    CHECK(listen(service->listen_fd, 1) == 0);
+    CHECK(getsockname(service->listen_fd, (struct sockaddr *)&addr, &len) == 0);
+    service->port = ntohs(addr.sin_port);
+    CHECK(pthread_create(&service->thread, NULL, mock_thread, service) == 0);
+}
+
+static void mock_join(mock_service_t *service)
+{
+    pthread_join(service->thread, NULL);
+    close(service->listen_fd);
+}
+
+static int connect_to(mock_service_t *service)
+{
+    struct sockaddr_in addr = { 0 };
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(service->port);
+    CHECK(fd >= 0);
+    CHECK(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    return fd;
+}
+
+/** Answers a lookup after a delay, like installation_proxy walking the app list. */
+static void mock_lookup(mock_service_t *service, int fd)
+{
+    uint32_t length;
+    char *request = read_message(fd, &length);
+    (void)service;
+    if (request && strcmp(request, "Lookup") == 0) {
+        sleep_ms(LOOKUP_DELAY_MS);
+        write_message(fd, "LookupResult");
+    }
+    free(request);
+}
+
+/** Accepts an image upload at a limited rate, like mobile_image_mounter over Wi-Fi. */
+static void mock_upload(mock_service_t *service, int fd)
+{
+    uint32_t length;
+    char *request = read_message(fd, &length);
+    uint8_t *chunk = malloc(UPLOAD_CHUNK);
+    uint64_t sum = 0;
+    char reply[64];
+    (void)service;
+    if (request && strcmp(request, "ReceiveBytes") == 0) {
+        write_message(fd, "ReceiveBytesAck");
+        for (int i = 0; i < UPLOAD_CHUNKS; i++) {
+            sleep_ms(UPLOAD_CHUNK_DELAY_MS);
+            if (!read_all(fd, chunk, UPLOAD_CHUNK)) {
+                break;
+            }
+            for (size_t j = 0; j < UPLOAD_CHUNK; j++) {
+                sum += chunk[j];
+            }
+        }
+        snprintf(reply, sizeof(reply), "Complete %llu", (unsigned long long)sum);
+        write_message(fd, reply);
+    }
+    free(request);
+    free(chunk);
+}
+
+static void mock_echo(mock_service_t *service, int fd)
+{
+    uint32_t length;
+    char *request;
+    (void)service;
+    while ((request = read_message(fd, &length))) {
+        for (uint32_t i = 0; i < length; i++) {
+            if (request[i] >= 'a' && request[i] <= 'z') {
+                request[i] -= 'a' - 'A';
+            }
+        }
+        write_message(fd, request);
+        free(request);
+    }
+}
+
+static void mock_silent(mock_service_t *service, int fd)
+{
+    char buf[64];
+    (void)service;
+    while (recv(fd, buf, sizeof(buf), 0) > 0);
+}
+
+static void mock_hangup(mock_service_t *service, int fd)
+{
+    uint32_t length;
+    (void)service;
+    free(read_message(fd, &length));
+}
+
+static void mock_tls_echo(mock_service_t *service, int fd)
+{
+    SSL *ssl = SSL_new(service->ssl_ctx);
+    uint8_t header[4];
+    char payload[256];
+    uint32_t length;
+
+    SSL_set_fd(ssl, fd);
+    if (SSL_accept(ssl) == 1) {
+        X509 *peer = SSL_get_peer_certificate(ssl);
+        if (peer && SSL_read(ssl, header, 4) == 4) {
+            length = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | header[3];
+            if (length < sizeof(payload) && SSL_read(ssl, payload, (int)length) == (int)length) {
+                SSL_write(ssl, header, 4);
+                SSL_write(ssl, payload, (int)length);
+            }
+        }
+        X509_free(peer);
+        SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+}
+
+// MARK: - Client
+
+typedef struct {
+    int done;
+    int error;
+    char reply[256];
+    uint64_t finished;
+    pthread_t thread;
+} result_t;
+
+static void on_receive(service_connection_t conn, int error, const uint8_t *data, size_t length, void *ctx)
+{
+    result_t *result = ctx;
+    (void)conn;
+    result->error = error;
+    if (!error) {
+        snprintf(result->reply, sizeof(result->reply), "%.*s", (int)length, data);
+    }
+    result->finished = now_ms();
+    result->thread = pthread_self();
+    result->done++;
+}
+
+static void on_done(service_connection_t conn, int error, void *ctx)
+{
+    result_t *result = ctx;
+    (void)conn;
+    result->error = error;
+    result->done++;
+}
+
+static ssize_t read_pattern(void *buf, size_t size, void *ctx)
+{
+    uint64_t *offset = ctx;
+    for (size_t i = 0; i < size; i++) {
+        ((uint8_t *)buf)[i] = (uint8_t)((*offset + i) * 31);
+    }
+    *offset += size;
+    return (ssize_t)size;
+}
+
+static void run_until(service_loop_t loop, int *done, int count)
+{
+    uint64_t deadline = now_ms() + 10000;
+    while (*done < count) {
+        CHECK(now_ms() < deadline);
+        CHECK(serviceLoopRunOnce(loop, 100) == 0);
+    }
+}
+
+/**
+ * An app lookup and an image upload on the same device overlap on one thread:
+ * the lookup finishes while the upload is still streaming and the total time
+ * is close to the longer of the two instead of their sum.
+ */
+static void test_overlapping_operations(void)
+{
+    service_loop_t loop = serviceLoopNew();
+    mock_service_t lookup = { 0 };
+    mock_service_t upload = { 0 };
+    result_t lookup_result = { 0 };
+    result_t ack_result = { 0 };
+    result_t upload_result = { 0 };
+    uint64_t offset = 0;
+    uint64_t expected = 0;
+    uint64_t start;
+    char reply[64];
+
+    mock_start(&lookup, mock_lookup);
+    mock_start(&upload, mock_upload);
+    service_connection_t lookup_conn = serviceConnectionNew(loop, connect_to(&lookup));
+    service_connection_t upload_conn = serviceConnectionNew(loop, connect_to(&upload));
+
+    start = now_ms();
+    serviceConnectionSendMessage(upload_conn, "ReceiveBytes", 12, NULL, NULL);
+    serviceConnectionReceive(upload_conn, serviceFrameMessage, on_receive, &ack_result);
+    serviceConnectionSendStream(upload_conn, UPLOAD_SIZE, read_pattern, &offset, NULL, NULL);
+    serviceConnectionReceive(upload_conn, serviceFrameMessage, on_receive, &upload_result);
+    serviceConnectionSendMessage(lookup_conn, "Lookup", 6, NULL, NULL);
+    serviceConnectionReceive(lookup_conn, serviceFrameMessage, on_receive, &lookup_result);
+    while (!lookup_result.done || !upload_result.done) {
+        CHECK(now_ms() - start < 10000);
+        CHECK(serviceLoopRunOnce(loop, 100) == 0);
+    }
+
+    for (uint64_t i = 0; i < UPLOAD_SIZE; i++) {
+        expected += (uint8_t)(i * 31);
+    }
+    snprintf(reply, sizeof(reply), "Complete %llu", (unsigned long long)expected);
+    CHECK(lookup_result.error == 0 && strcmp(lookup_result.reply, "LookupResult") == 0);
+    CHECK(ack_result.error == 0 && strcmp(ack_result.reply, "ReceiveBytesAck") == 0);
+    CHECK(upload_result.error == 0 && strcmp(upload_result.reply, reply) == 0);
+    CHECK(pthread_equal(lookup_result.thread, pthread_self()));
+    CHECK(pthread_equal(upload_result.thread, pthread_self()));
+    CHECK(lookup_result.finished < upload_result.finished);
+    CHECK(upload_result.finished - start >= UPLOAD_CHUNKS * UPLOAD_CHUNK_DELAY_MS);
+    CHECK(upload_result.finished - start < UPLOAD_CHUNKS * UPLOAD_CHUNK_DELAY_MS + LOOKUP_DELAY_MS);
+    printf("ok - overlapping lookup and upload (lookup %llu ms, upload %llu ms)\n",
+           (unsigned long long)(lookup_result.finished - start),
+           (unsigned long long)(upload_result.finished - start));
+
+    serviceConnectionClose(lookup_conn);
+    serviceConnectionClose(upload_conn);
+    serviceLoopFree(loop);
+    mock_join(&lookup);
+    mock_join(&upload);
+}
+
+static void test_pipelined_requests(void)
+{
+    service_loop_t loop = serviceLoopNew();
+    mock_service_t echo = { 0 };
+    result_t results[3] = { 0 };
+    const char *requests[3] = { "one", "two", "three" };
+    const char *replies[3] = { "ONE", "TWO", "THREE" };
+    int done = 0;
+
+    mock_start(&echo, mock_echo);
+    service_connection_t conn = serviceConnectionNew(loop, connect_to(&echo));
+    for (int i = 0; i < 3; i++) {
+        serviceConnectionSendMessage(conn, requests[i], (uint32_t)strlen(requests[i]), NULL, NULL);
+    }
+    for (int i = 0; i < 3; i++) {
+        serviceConnectionReceive(conn, serviceFrameMessage, on_receive, &results[i]);
+    }
+    while (done < 3) {
+        run_until(loop, &results[done].done, 1);
+        done++;
+    }
+    for (int i = 0; i < 3; i++) {
+        CHECK(results[i].error == 0 && strcmp(results[i].reply, replies[i]) == 0);
+    }
+    printf("ok - pipelined requests are answered in order\n");
+
+    serviceConnectionClose(conn);
+    serviceLoopFree(loop);
+    mock_join(&echo);
+}
+
+static void test_timeout(void)
+{
+    service_loop_t loop = serviceLoopNew();
+    mock_service_t silent = { 0 };
+    result_t result = { 0 };
+    uint64_t start;
+
+    mock_start(&silent, mock_silent);
+    service_connection_t conn = serviceConnectionNew(loop, connect_to(&silent));
+    serviceConnectionSetTimeout(conn, 200);
+    start = now_ms();
+    serviceConnectionSendMessage(conn, "Lookup", 6, NULL, NULL);
+    serviceConnectionReceive(conn, serviceFrameMessage, on_receive, &result);
+    run_until(loop, &result.done, 1);
+    CHECK(result.error == -ETIMEDOUT);
+    CHECK(now_ms() - start >= 200);
+    CHECK(now_ms() - start < 2000);
+    printf("ok - stalled device times out\n");
+
+    serviceConnectionClose(conn);
+    serviceLoopFree(loop);
+    mock_join(&silent);
+}
+
+static void test_hangup_and_close(void)
+{
+    service_loop_t loop = serviceLoopNew();
+    mock_service_t hangup = { 0 };
+    mock_service_t silent = { 0 };
+    result_t reset = { 0 };
+    result_t cancelled = { 0 };
+
+    mock_start(&hangup, mock_hangup);
+    mock_start(&silent, mock_silent);
+    service_connection_t conn = serviceConnectionNew(loop, connect_to(&hangup));
+    serviceConnectionSendMessage(conn, "Lookup", 6, NULL, NULL);
+    serviceConnectionReceive(conn, serviceFrameMessage, on_receive, &reset);
+    run_until(loop, &reset.done, 1);
+    CHECK(reset.error == -ECONNRESET);
+    serviceConnectionClose(conn);
+
+    conn = serviceConnectionNew(loop, connect_to(&silent));
+    serviceConnectionReceive(conn, serviceFrameMessage, on_receive, &cancelled);
+    serviceConnectionClose(conn);
+    CHECK(serviceLoopRunOnce(loop, 0) == 0);
+    CHECK(cancelled.done == 1 && cancelled.error == -ECANCELED);
+    printf("ok - hangup and close fail pending requests\n");
+
+    serviceLoopFree(loop);
+    mock_join(&hangup);
+    mock_join(&silent);
+}
+
+// MARK: - TLS
+
+static int accept_any(int ok, X509_STORE_CTX *ctx)
+{
+    (void)ok;
+    (void)ctx;
+    return 1;
+}
+
+static void make_identity(char **cert_pem, size_t *cert_len, char **key_pem, size_t *key_len, X509 **cert_out, EVP_PKEY **key_out)
+{
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+    EVP_PKEY *pkey = NULL;
+    X509 *x509 = X509_new();
+    BIO *bio;
+    char *data;
+    long len;
+
+    CHECK(pctx && EVP_PKEY_keygen_init(pctx) > 0);
+    CHECK(EVP_PKEY_CTX_set_rsa_keygen_bits(pctx, 2048) > 0);
+    CHECK(EVP_PKEY_keygen(pctx, &pkey) > 0);
+    EVP_PKEY_CTX_free(pctx);
+    ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+    X509_set_pubkey(x509, pkey);
+    CHECK(X509_sign(x509, pkey, EVP_sha256()) > 0);
+
+    bio = BIO_new(BIO_s_mem());
+    PEM_write_bio_X509(bio, x509);
+    len = BIO_get_mem_data(bio, &data);
+    *cert_pem = malloc((size_t)len);
+    memcpy(*cert_pem, data, (size_t)len);
+    *cert_len = (size_t)len;
+    BIO_free(bio);
+
+    bio = BIO_new(BIO_s_mem());
+    PEM_write_bio_PrivateKey(bio, pkey, NULL, NULL, 0, NULL, NULL);
+    len = BIO_get_mem_data(bio, &data);
+    *key_pem = malloc((size_t)len);
+    memcpy(*key_pem, data, (size_t)len);
+    *key_len = (size_t)len;
+    BIO_free(bio);
+
+    *cert_out = x509;
+    *key_out = pkey;
+}
+
+/** Lockdown services authenticate the host with a client certificate. */
+static void test_tls(void)
+{
+    service_loop_t loop = serviceLoopNew();
+    mock_service_t tls = { 0 };
+    result_t handshake = { 0 };
+    result_t result = { 0 };
+    char *cert_pem;
+    char *key_pem;
+    size_t cert_len;
+    size_t key_len;
+    X509 *cert;
+    EVP_PKEY *key;
+
+    make_identity(&cert_pem, &cert_len, &key_pem, &key_len, &cert, &key);
+    tls.ssl_ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_use_certificate(tls.ssl_ctx, cert);
+    SSL_CTX_use_PrivateKey(tls.ssl_ctx, key);
+    SSL_CTX_set_verify(tls.ssl_ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, accept_any);
+    mock_start(&tls, mock_tls_echo);
+
+    service_connection_t conn = serviceConnectionNew(loop, connect_to(&tls));
+    serviceConnectionSetTimeout(conn, 5000);
+    serviceConnectionStartTLS(conn, cert_pem, cert_len, key_pem, key_len, on_done, &handshake);
+    serviceConnectionSendMessage(conn, "secret", 6, NULL, NULL);
+    serviceConnectionReceive(conn, serviceFrameMessage, on_receive, &result);
+    run_until(loop, &result.done, 1);
+    CHECK(handshake.done == 1 && handshake.error == 0);
+    CHECK(result.error == 0 && strcmp(result.reply, "secret") == 0);
+    printf("ok - TLS with client certificate\n");
+
+    serviceConnectionClose(conn);
+    serviceLoopFree(loop);
+    mock_join(&tls);
+    SSL_CTX_free(tls.ssl_ctx);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    free(cert_pem);
+    free(key_pem);
+}
+
+// MARK: - Loop thread
+
+typedef struct {
+    service_loop_t loop;
+    mock_service_t *service;
+    result_t result;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} threaded_t;
+
+static void threaded_receive(service_connection_t conn, int error, const uint8_t *data, size_t length, void *ctx)
+{
+    threaded_t *threaded = ctx;
+    pthread_mutex_lock(&threaded->lock);
+    on_receive(conn, error, data, length, &threaded->result);
+    pthread_cond_signal(&threaded->cond);
+    pthread_mutex_unlock(&threaded->lock);
+    serviceConnectionClose(conn);
+}
+
+static void threaded_start(void *ctx)
+{
+    threaded_t *threaded = ctx;
+    service_connection_t conn = serviceConnectionNew(threaded->loop, connect_to(threaded->service));
+    serviceConnectionSendMessage(conn, "hello", 5, NULL, NULL);
+    serviceConnectionReceive(conn, serviceFrameMessage, threaded_receive, threaded);
+}
+
+static void test_loop_thread(void)
+{
+    mock_service_t echo = { 0 };
+    threaded_t threaded = { 0 };
+
+    mock_start(&echo, mock_echo);
+    threaded.loop = serviceLoopNew();
+    threaded.service = &echo;
+    pthread_mutex_init(&threaded.lock, NULL);
+    pthread_cond_init(&threaded.cond, NULL);
+    CHECK(serviceLoopStart(threaded.loop));
+    serviceLoopAsync(threaded.loop, threaded_start, &threaded);
+    pthread_mutex_lock(&threaded.lock);
+    while (!threaded.result.done) {
+        pthread_cond_wait(&threaded.cond, &threaded.lock);
+    }
+    pthread_mutex_unlock(&threaded.lock);
+    CHECK(threaded.result.error == 0 && strcmp(threaded.result.reply, "HELLO") == 0);
+    CHECK(!pthread_equal(threaded.result.thread, pthread_self()));
+    serviceLoopFree(threaded.loop);
+    mock_join(&echo);
+    printf("ok - operations submitted from another thread\n");
+}
+
+int main(void)
+{
+    // SSL_write on a socket BIO can raise SIGPIPE on Linux
+    signal(SIGPIPE, SIG_IGN);
+    test_overlapping_operations();
+    test_pipelined_requests();
+    test_timeout();
+    test_hangup_and_close();
+    test_tls();
+    test_loop_thread();
+    return 0;
+}
@@ -0,0 +1,710 @@
+//
+// Copyright © 2021 osy. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "ServiceOperations.h"
+
+#define UPLOAD_CHUNK 65536
+#define UPLOAD_CHUNKS 40
+#define UPLOAD_CHUNK_DELAY_MS 10
+#define UPLOAD_SIZE ((uint64_t)UPLOAD_CHUNK * UPLOAD_CHUNKS)
+#define LOOKUP_DELAY_MS 100
+#define NUM_ICONS 20
+#define EXECUTABLE_PATH "/private/var/containers/Bundle/Application/UUID/Test.app/Test"
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void sleep_ms(unsigned int ms)
+{
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+// MARK: - Mock device
+
+typedef void (*mock_handler_t)(int fd, void *ctx);
+
+typedef struct {
+    int listen_fd;
+    uint16_t port;
+    mock_handler_t handler;
+    void *ctx;
+    pthread_t thread;
+} mock_service_t;
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len) {
+        ssize_t ret = recv(fd, (char *)buf + got, len - got, 0);
+        if (ret <= 0) {
+            return 0;
+        }
+        got += (size_t)ret;
+    }
+    return 1;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    return send(fd, buf, len, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+/** Reads one length prefixed property list, XML or binary. */
+static plist_t read_plist(int fd, int *binary)
+{
+    uint8_t header[4];
+    uint32_t length;
+    char *payload;
+    plist_t plist = NULL;
+
+    if (!read_all(fd, header, sizeof(header))) {
+        return NULL;
+    }
+    length = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | header[3];
+    payload = malloc(length ? length : 1);
+    if (read_all(fd, payload, length)) {
+        *binary = plist_is_binary(payload, length);
+        if (*binary) {
+            plist_from_bin(payload, length, &plist);
+        } else {
+            plist_from_xml(payload, length, &plist);
+        }
+    }
+    free(payload);
+    return plist;
+}
+
+/** Replies in the same format as the request, like the services do. */
+static void write_plist(int fd, plist_t plist, int binary)
+{
+    char *data = NULL;
+    uint32_t length = 0;
+    uint8_t header[4];
+
+    if (binary) {
+        plist_to_bin(plist, &data, &length);
+    } else {
+        plist_to_xml(plist, &data, &length);
+    }
+    header[0] = length >> 24;
+    header[1] = length >> 16;
+    header[2] = length >> 8;
+    header[3] = length;
+    write_all(fd, header, sizeof(header));
+    write_all(fd, data, length);
+    free(data);
+    plist_free(plist);
+}
+
+static plist_t reply_with(const char *key, const char *value)
+{
+    plist_t reply = plist_new_dict();
+    plist_dict_set_item(reply, key, plist_new_string(value));
+    return reply;
+}
+
+static const char *string_item(plist_t dict, const char *key)
+{
+    plist_t node = plist_dict_get_item(dict, key);
+    return node && plist_get_node_type(node) == PLIST_STRING ? plist_get_string_ptr(node, NULL) : "";
+}
+
+static void *mock_thread(void *arg)
+{
+    mock_service_t *service = arg;
+    int fd = accept(service->listen_fd, NULL, NULL);
+    if (fd >= 0) {
+        service->handler(fd, service->ctx);
+        close(fd);
+    }
+    return NULL;
+}
+
+static service_connection_t mock_connect(service_loop_t loop, mock_service_t *service, mock_handler_t handler, void *ctx)
+{
+    struct sockaddr_in addr = { 0 };
+    socklen_t len = sizeof(addr);
+    int fd;
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    service->handler = handler;
+    service->ctx = ctx;
+    CHECK((service->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+    CHECK(bind(service->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    CHECK(listen(service->listen_fd, 1) == 0);
+    CHECK(getsockname(service->listen_fd, (struct sockaddr *)&addr, &len) == 0);
+    service->port = ntohs(addr.sin_port);
+    CHECK(pthread_create(&service->thread, NULL, mock_thread, service) == 0);
+    CHECK((fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+    CHECK(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    return serviceConnectionNew(loop, fd);
+}
+
+static void mock_join(mock_service_t *service)
+{
+    pthread_join(service->thread, NULL);
+    close(service->listen_fd);
+}
+
+/** installation_proxy: answers Lookup after a delay, or with an error. */
+static void mock_instproxy(int fd, void *ctx)
+{
+    const char *error = ctx;
+    int binary = 0;
+    plist_t request = read_plist(fd, &binary);
+    plist_t reply;
+    plist_t result;
+    plist_t app;
+
+    if (!request) {
+        return;
+    }
+    if (strcmp(string_item(request, "Command"), "Lookup") == 0 && plist_dict_get_item(request, "ClientOptions")) {
+        sleep_ms(LOOKUP_DELAY_MS);
+        if (error) {
+            write_plist(fd, reply_with("Error", error), binary);
+        } else {
+            reply = reply_with("Status", "Complete");
+            result = plist_new_dict();
+            app = plist_new_dict();
+            plist_dict_set_item(app, "CFBundleIdentifier", plist_new_string("com.example.test"));
+            plist_dict_set_item(app, "CFBundleExecutable", plist_new_string("Test"));
+            plist_dict_set_item(result, "com.example.test", app);
+            plist_dict_set_item(reply, "LookupResult", result);
+            write_plist(fd, reply, binary);
+        }
+    }
+    plist_free(request);
+}
+
+/** springboardservices: icons are the bundle id bytes, "com.example.5" has none. */
+static void mock_sbservices(int fd, void *ctx)
+{
+    int *max_pipelined = ctx;
+    int binary = 0;
+    plist_t requests[NUM_ICONS];
+    int count = 0;
+
+    while ((requests[count] = read_plist(fd, &binary))) {
+        count++;
+        // let the client fill its window before answering
+        sleep_ms(5);
+        if (count == NUM_ICONS || recv(fd, &(char){ 0 }, 1, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+            if (count > *max_pipelined) {
+                *max_pipelined = count;
+            }
+            for (int i = 0; i < count; i++) {
+                const char *bundle_id = string_item(requests[i], "bundleId");
+                plist_t reply = plist_new_dict();
+                CHECK(binary);
+                CHECK(strcmp(string_item(requests[i], "command"), "getIconPNGData") == 0);
+                if (strcmp(bundle_id, "com.example.5") != 0) {
+                    plist_dict_set_item(reply, "pngData", plist_new_data(bundle_id, strlen(bundle_id)));
+                }
+                write_plist(fd, reply, binary);
+                plist_free(requests[i]);
+            }
+            count = 0;
+        }
+    }
+}
+
+typedef struct {
+    int mounted;
+    const char *lookup_error;
+    const char *error;
+    int uploaded;
+    int hangup;
+} mount_mock_t;
+
+/** mobile_image_mounter: the full LookupImage, ReceiveBytes, MountImage, Hangup exchange. */
+static void mock_image_mounter(int fd, void *ctx)
+{
+    mount_mock_t *mock = ctx;
+    int binary = 0;
+    plist_t request;
+
+    while ((request = read_plist(fd, &binary))) {
+        const char *command = string_item(request, "Command");
+        plist_t reply = NULL;
+        if (strcmp(command, "LookupImage") == 0) {
+            plist_t signatures = plist_new_array();
+            CHECK(strcmp(string_item(request, "ImageType"), "Developer") == 0);
+            if (mock->mounted) {
+                plist_array_append_item(signatures, plist_new_data("sig", 3));
+            }
+            if (mock->lookup_error) {
+                reply = reply_with("Error", mock->lookup_error);
+                plist_free(signatures);
+            } else {
+                reply = reply_with("Status", "Complete");
+                plist_dict_set_item(reply, "ImageSignature", signatures);
+            }
+        } else if (strcmp(command, "ReceiveBytes") == 0) {
+            uint64_t size = 0;
+            uint64_t length = 0;
+            uint8_t *chunk = malloc(UPLOAD_CHUNK);
+            plist_get_uint_val(plist_dict_get_item(request, "ImageSize"), &size);
+            CHECK(size == UPLOAD_SIZE);
+            CHECK(memcmp(plist_get_data_ptr(plist_dict_get_item(request, "ImageSignature"), &length), "signature", 9) == 0 && length == 9);
+            if (mock->error) {
+                reply = reply_with("Error", mock->error);
+                free(chunk);
+            } else {
+                write_plist(fd, reply_with("Status", "ReceiveBytesAck"), binary);
+                for (uint64_t offset = 0; offset < size; offset += UPLOAD_CHUNK) {
+                    sleep_ms(UPLOAD_CHUNK_DELAY_MS);
+                    CHECK(read_all(fd, chunk, UPLOAD_CHUNK));
+                    for (size_t i = 0; i < UPLOAD_CHUNK; i++) {
+                        CHECK(chunk[i] == (uint8_t)((offset + i) * 31));
+                    }
+                }
+                free(chunk);
+                mock->uploaded = 1;
+                reply = reply_with("Status", "Complete");
+            }
+        } else if (strcmp(command, "MountImage") == 0) {
+            CHECK(mock->uploaded);
+            CHECK(strcmp(string_item(request, "ImagePath"), "/private/var/mobile/Media/PublicStaging/staging.dimage") == 0);
+            reply = reply_with("Status", "Complete");
+        } else if (strcmp(command, "Hangup") == 0) {
+            mock->hangup = 1;
+            reply = reply_with("Status", "Complete");
+        }
+        plist_free(request);
+        if (reply) {
+            write_plist(fd, reply, binary);
+        }
+    }
+}
+
+/** Reads one GDB packet payload, skipping acknowledgements. */
+static int read_gdb_packet(int fd, char *payload, size_t size)
+{
+    size_t length = 0;
+    char c;
+
+    do {
+        if (!read_all(fd, &c, 1)) {
+            return 0;
+        }
+    } while (c == '+');
+    if (c == '\x03') {
+        strcpy(payload, "\x03");
+        return 1;
+    }
+    CHECK(c == '$');
+    while (read_all(fd, &c, 1) && c != '#') {
+        CHECK(length + 1 < size);
+        payload[length++] = c;
+    }
+    payload[length] = '\0';
+    char checksum[2];
+    return read_all(fd, checksum, sizeof(checksum));
+}
+
+static void write_gdb_packet(int fd, const char *payload)
+{
+    char packet[256];
+    uint8_t checksum = 0;
+    for (const char *p = payload; *p; p++) {
+        checksum += (uint8_t)*p;
+    }
+    snprintf(packet, sizeof(packet), "$%s#%02x", payload, checksum);
+    write_all(fd, packet, strlen(packet));
+}
+
+/** debugserver: checks the launch sequence, `ctx` is the qLaunchSuccess reply. */
+static void mock_debugserver(int fd, void *ctx)
+{
+    const char *launch_reply = ctx;
+    char payload[512];
+    char expected[512];
+    size_t length = strlen(EXECUTABLE_PATH);
+
+    CHECK(read_gdb_packet(fd, payload, sizeof(payload)) && strcmp(payload, "QStartNoAckMode") == 0);
+    write_all(fd, "+", 1);
+    write_gdb_packet(fd, "OK");
+    snprintf(expected, sizeof(expected), "A%zu,0,", length * 2);
+    for (size_t i = 0; i < length; i++) {
+        sprintf(expected + strlen(expected), "%02x", (uint8_t)EXECUTABLE_PATH[i]);
+    }
+    CHECK(read_gdb_packet(fd, payload, sizeof(payload)) && strcmp(payload, expected) == 0);
+    write_gdb_packet(fd, "OK");
+    CHECK(read_gdb_packet(fd, payload, sizeof(payload)) && strcmp(payload, "qLaunchSuccess") == 0);
+    write_gdb_packet(fd, launch_reply);
+    if (strcmp(launch_reply, "OK") != 0) {
+        return;
+    }
+    CHECK(read_gdb_packet(fd, payload, sizeof(payload)) && strcmp(payload, "c") == 0);
+    CHECK(read_gdb_packet(fd, payload, sizeof(payload)) && strcmp(payload, "\x03") == 0);
+    write_gdb_packet(fd, "O48656c6c6f");
+    write_gdb_packet(fd, "T11thread:1;");
+    CHECK(read_gdb_packet(fd, payload, sizeof(payload)) && strcmp(payload, "D") == 0);
+    write_gdb_packet(fd, "OK");
+}
+
+// MARK: - Client
+
+typedef struct {
+    int done;
+    int error;
+    char message[256];
+    char first_app[256];
+    int icons;
+    int missing_icons;
+    uint64_t finished;
+} result_t;
+
+static void on_plist(int error, const char *message, plist_t reply, void *ctx)
+{
+    result_t *result = ctx;
+    result->error = error;
+    snprintf(result->message, sizeof(result->message), "%s", message ? message : "");
+    if (!error) {
+        plist_t app = plist_dict_get_item(reply, "com.example.test");
+        snprintf(result->first_app, sizeof(result->first_app), "%s", app ? string_item(app, "CFBundleExecutable") : "");
+    }
+    result->finished = now_ms();
+    result->done++;
+}
+
+static void on_result(int error, const char *message, void *ctx)
+{
+    result_t *result = ctx;
+    result->error = error;
+    snprintf(result->message, sizeof(result->message), "%s", message ? message : "");
+    result->finished = now_ms();
+    result->done++;
+}
+
+static void on_icon(const char *bundle_id, const void *png, size_t length, void *ctx)
+{
+    result_t *result = ctx;
+    char expected[32];
+    snprintf(expected, sizeof(expected), "com.example.%d", result->icons + result->missing_icons);
+    CHECK(strcmp(bundle_id, expected) == 0);
+    if (png) {
+        CHECK(length == strlen(bundle_id) && memcmp(png, bundle_id, length) == 0);
+        result->icons++;
+    } else {
+        result->missing_icons++;
+    }
+}
+
+static ssize_t read_pattern(void *buf, size_t size, void *ctx)
+{
+    uint64_t *offset = ctx;
+    for (size_t i = 0; i < size; i++) {
+        ((uint8_t *)buf)[i] = (uint8_t)((*offset + i) * 31);
+    }
+    *offset += size;
+    return (ssize_t)size;
+}
+
+static FILE *make_image(void)
+{
+    FILE *image = tmpfile();
+    uint64_t offset = 0;
+    uint8_t *chunk = malloc(UPLOAD_CHUNK);
+    CHECK(image);
+    while (offset < UPLOAD_SIZE) {
+        read_pattern(chunk, UPLOAD_CHUNK, &offset);
+        CHECK(fwrite(chunk, 1, UPLOAD_CHUNK, image) == UPLOAD_CHUNK);
+    }
+    free(chunk);
+    rewind(image);
+    return image;
+}
+
+typedef struct {
+    FILE *image;
+    int fd;
+    unsigned int stall_ms;
+    pthread_t thread;
+} image_feeder_t;
+
+/** Copies the image into the pipe like the app's reader queue does. */
+static void *feed_image(void *arg)
+{
+    image_feeder_t *feeder = arg;
+    uint8_t *chunk = malloc(UPLOAD_CHUNK);
+    size_t length;
+
+    // a slow disk
+    sleep_ms(feeder->stall_ms);
+    while ((length = fread(chunk, 1, UPLOAD_CHUNK, feeder->image)) > 0) {
+        size_t offset = 0;
+        while (offset < length) {
+            ssize_t ret = write(feeder->fd, chunk + offset, length - offset);
+            if (ret <= 0) {
+                // the mount finished without needing the rest
+                goto done;
+            }
+            offset += (size_t)ret;
+        }
+    }
+done:
+    close(feeder->fd);
+    free(chunk);
+    return NULL;
+}
+
+/** Returns the read end of a pipe that gets the image after `stall_ms`. */
+static int image_feeder_start(image_feeder_t *feeder, unsigned int stall_ms)
+{
+    int fds[2];
+
+    CHECK(pipe(fds) == 0);
+    feeder->image = make_image();
+    feeder->fd = fds[1];
+    feeder->stall_ms = stall_ms;
+    CHECK(pthread_create(&feeder->thread, NULL, feed_image, feeder) == 0);
+    return fds[0];
+}
+
+static void image_feeder_join(image_feeder_t *feeder)
+{
+    pthread_join(feeder->thread, NULL);
+    fclose(feeder->image);
+}
+
+static void run_until(service_loop_t loop, int *done, int count)
+{
+    uint64_t deadline = now_ms() + 10000;
+    while (*done < count) {
+        CHECK(now_ms() < deadline);
+        CHECK(serviceLoopRunOnce(loop, 100) == 0);
+    }
+}
+
+static plist_t lookup_options(void)
+{
+    plist_t options = plist_new_dict();
+    plist_dict_set_item(options, "ApplicationType", plist_new_string("Any"));
+    return options;
+}
+
+static void test_lookup(void)
+{
+    service_loop_t loop = serviceLoopNew();
+    mock_service_t service = { 0 };
+    mock_service_t failing = { 0 };
+    result_t result = { 0 };
+    result_t failed = { 0 };
+    plist_t options = lookup_options();
+
+    service_connection_t conn = mock_connect(loop, &service, mock_instproxy, NULL);
+    service_connection_t failing_conn = mock_connect(loop, &failing, mock_instproxy, "InstallProhibited");
+    instproxyLookupAsync(conn, options, on_plist, &result);
+    instproxyLookupAsync(failing_conn, options, on_plist, &failed);
+    plist_free(options);
+    run_until(loop, &result.done, 1);
+    run_until(loop, &failed.done, 1);
+    CHECK(result.error == 0 && strcmp(result.first_app, "Test") == 0);
+    CHECK(failed.error == kServiceOperationFailed && strcmp(failed.message, "InstallProhibited") == 0);
+    printf("ok - installation_proxy lookup and error reply\n");
+
+    serviceConnectionClose(conn);
+    serviceConnectionClose(failing_conn);
+    serviceLoopFree(loop);
+    mock_join(&service);
+    mock_join(&failing);
+}
+
+static void test_icons(void)
+{
+    service_loop_t loop = serviceLoopNew();
+    mock_service_t service = { 0 };
+    result_t result = { 0 };
+    char names[NUM_ICONS][32];
+    const char *bundle_ids[NUM_ICONS];
+    int max_pipelined = 0;
+
+    for (int i = 0; i < NUM_ICONS; i++) {
+        snprintf(names[i], sizeof(names[i]), "com.example.%d", i);
+        bundle_ids[i] = names[i];
+    }
+    service_connection_t conn = mock_connect(loop, &service, mock_sbservices, &max_pipelined);
+    sbservicesGetIconsAsync(conn, bundle_ids, NUM_ICONS, on_icon, on_result, &result);
+    run_until(loop, &result.done, 1);
+    CHECK(result.error == 0);
+    CHECK(result.icons == NUM_ICONS - 1 && result.missing_icons == 1);
+    serviceConnectionClose(conn);
+    serviceLoopRunOnce(loop, 0);
+    mock_join(&service);
+    CHECK(max_pipelined > 1);
+    printf("ok - springboardservices icons are pipelined (%d in flight)\n", max_pipelined);
+
+    serviceLoopFree(loop);
+}
+
+static void test_mount(void)
+{
+    service_loop_t loop = serviceLoopNew();
+    mock_service_t fresh = { 0 };
+    mock_service_t mounted = { 0 };
+    mock_service_t locked = { 0 };
+    mock_service_t old = { 0 };
+    mount_mock_t fresh_mock = { 0 };
+    mount_mock_t mounted_mock = { .mounted = 1 };
+    mount_mock_t locked_mock = { .error = "DeviceLocked" };
+    mount_mock_t old_mock = { .lookup_error = "UnknownCommand" };
+    result_t fresh_result = { 0 };
+    result_t mounted_result = { 0 };
+    result_t locked_result = { 0 };
+    result_t old_result = { 0 };
+    image_feeder_t fresh_feeder;
+    image_feeder_t mounted_feeder;
+    image_feeder_t locked_feeder;
+    image_feeder_t old_feeder;
+    const char *path = "/private/var/mobile/Media/PublicStaging/staging.dimage";
+
+    service_connection_t fresh_conn = mock_connect(loop, &fresh, mock_image_mounter, &fresh_mock);
+    service_connection_t mounted_conn = mock_connect(loop, &mounted, mock_image_mounter, &mounted_mock);
+    service_connection_t locked_conn = mock_connect(loop, &locked, mock_image_mounter, &locked_mock);
+    service_connection_t old_conn = mock_connect(loop, &old, mock_image_mounter, &old_mock);
+    imageMounterMountAsync(fresh_conn, "test", "Developer", image_feeder_start(&fresh_feeder, 0), UPLOAD_SIZE, "signature", 9, path, on_result, &fresh_result);
+    imageMounterMountAsync(mounted_conn, "test", "Developer", image_feeder_start(&mounted_feeder, 0), UPLOAD_SIZE, "signature", 9, path, on_result, &mounted_result);
+    imageMounterMountAsync(locked_conn, "test", "Developer", image_feeder_start(&locked_feeder, 0), UPLOAD_SIZE, "signature", 9, path, on_result, &locked_result);
+    imageMounterMountAsync(old_conn, "test", "Developer", image_feeder_start(&old_feeder, 0), UPLOAD_SIZE, "signature", 9, path, on_result, &old_result);
+    run_until(loop, &fresh_result.done, 1);
+    run_until(loop, &mounted_result.done, 1);
+    run_until(loop, &locked_result.done, 1);
+    run_until(loop, &old_result.done, 1);
+    CHECK(fresh_result.error == 0 && fresh_mock.uploaded && fresh_mock.hangup);
+    CHECK(mounted_result.error == 0 && !mounted_mock.uploaded && mounted_mock.hangup);
+    CHECK(locked_result.error == kServiceOperationDeviceLocked && locked_mock.hangup);
+    // a failed lookup falls through to the upload
+    CHECK(old_result.error == 0 && old_mock.uploaded && old_mock.hangup);
+    // writers of images that were not needed are released
+    image_feeder_join(&fresh_feeder);
+    image_feeder_join(&mounted_feeder);
+    image_feeder_join(&locked_feeder);
+    image_feeder_join(&old_feeder);
+    printf("ok - mobile_image_mounter upload, already mounted, locked device and failed lookup\n");
+
+    serviceConnectionClose(fresh_conn);
+    serviceConnectionClose(mounted_conn);
+    serviceConnectionClose(locked_conn);
+    serviceConnectionClose(old_conn);
+    serviceLoopFree(loop);
+    mock_join(&fresh);
+    mock_join(&mounted);
+    mock_join(&locked);
+    mock_join(&old);
+}
+
+static void test_launch(void)
+{
+    service_loop_t loop = serviceLoopNew();
+    mock_service_t service = { 0 };
+    mock_service_t failing = { 0 };
+    result_t result = { 0 };
+    result_t failed = { 0 };
+
+    service_connection_t conn = mock_connect(loop, &service, mock_debugserver, "OK");
+    service_connection_t failing_conn = mock_connect(loop, &failing, mock_debugserver, "Eno such file");
+    debugserverLaunchAsync(conn, EXECUTABLE_PATH, on_result, &result);
+    debugserverLaunchAsync(failing_conn, EXECUTABLE_PATH, on_result, &failed);
+    run_until(loop, &result.done, 1);
+    run_until(loop, &failed.done, 1);
+    CHECK(result.error == 0);
+    CHECK(failed.error == kServiceOperationFailed && strcmp(failed.message, "Eno such file") == 0);
+    printf("ok - debugserver launch and launch failure\n");
+
+    serviceConnectionClose(conn);
+    serviceConnectionClose(failing_conn);
+    serviceLoopFree(loop);
+    mock_join(&service);
+    mock_join(&failing);
+}
+
+/**
+ * Mounting an image and listing apps on the same device overlap on the loop
+ * thread: the lookup finishes in about its own time while the image is still
+ * uploading, even when reading the image stalls for longer than the lookup.
+ */
+static void test_overlapping_operations(void)
+{
+    service_loop_t loop = serviceLoopNew();
+    mock_service_t mounter = { 0 };
+    mock_service_t instproxy = { 0 };
+    mount_mock_t mount_mock = { 0 };
+    result_t mount_result = { 0 };
+    result_t lookup_result = { 0 };
+    image_feeder_t feeder;
+    plist_t options = lookup_options();
+    uint64_t start = now_ms();
+
+    service_connection_t mount_conn = mock_connect(loop, &mounter, mock_image_mounter, &mount_mock);
+    service_connection_t lookup_conn = mock_connect(loop, &instproxy, mock_instproxy, NULL);
+    imageMounterMountAsync(mount_conn, "test", "Developer", image_feeder_start(&feeder, 2 * LOOKUP_DELAY_MS), UPLOAD_SIZE, "signature", 9, "/private/var/mobile/Media/PublicStaging/staging.dimage", on_result, &mount_result);
+    instproxyLookupAsync(lookup_conn, options, on_plist, &lookup_result);
+    plist_free(options);
+    run_until(loop, &mount_result.done, 1);
+    run_until(loop, &lookup_result.done, 1);
+    CHECK(mount_result.error == 0 && lookup_result.error == 0);
+    CHECK(lookup_result.finished < mount_result.finished);
+    CHECK(mount_result.finished - start >= 2 * LOOKUP_DELAY_MS + UPLOAD_CHUNKS * UPLOAD_CHUNK_DELAY_MS);
+    // the lookup is not queued behind the upload
+    CHECK(lookup_result.finished - start < 2 * LOOKUP_DELAY_MS);
+    printf("ok - lookup overlaps image upload (lookup %llu ms, mount %llu ms)\n",
+           (unsigned long long)(lookup_result.finished - start),
+           (unsigned long long)(mount_result.finished - start));
+
+    serviceConnectionClose(mount_conn);
+    serviceConnectionClose(lookup_conn);
+    serviceLoopFree(loop);
+    mock_join(&mounter);
+    mock_join(&instproxy);
+    image_feeder_join(&feeder);
+}
+
+int main(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+    test_lookup();
+    test_icons();
+    test_mount();
+    test_launch();
+    test_overlapping_operations();
+    return 0;
+}